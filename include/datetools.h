@@ -0,0 +1,38 @@
+#ifndef __DATETOOLS_H__
+#define __DATETOOLS_H__
+
+#include <stdbool.h>
+
+/** Parse an RFC 5322 date-time (as found in the Date: header), including the
+ * obsolete forms of RFC 822/2822 (two and three digit years, named and
+ * military zones, comments anywhere) and a number of common malformations
+ * (missing day of week, comma or seconds, asctime() ordering, +hh:mm offsets,
+ * trailing zone names, missing zone which is taken as local time).  Returns
+ * false if the string couldn't be parsed. */
+bool rfc5322_parse_date(const char* str, long long* t);
+
+/** Convert str using date(1), either forking for every call, or if
+ * date_coprocess_start() succeeded, via a single long-lived date process.
+ * Returns false if date couldn't parse str. */
+bool date_command(const char* str, long long* t);
+
+/** start a persistent date(1) process for date_command(), returns false (and
+ * date_command() will fork per call) if that failed */
+bool date_coprocess_start();
+void date_coprocess_stop();
+
+/** rfc5322_parse_date(), with date_command() as fallback */
+bool parse_mail_date(const char* str, long long* t);
+
+/** Parse the date expressions used on command lines (eg, --maxage), with the
+ * semantics of GNU date -d: "@seconds", ISO 8601 dates with optional time and
+ * zone ("2020-01-31", "2020-01-31 12:00", "2020-01-31T12:00:00Z"), and
+ * relative items ("1 year ago", "90 days ago", "2 weeks", "yesterday", "now"),
+ * the latter relative to now.  Returns false for anything else. */
+bool parse_relative_date(const char* str, long long now, long long* t);
+
+/** parse_relative_date() relative to the current time, with date_command() as
+ * fallback */
+bool parse_date_option(const char* str, long long* t);
+
+#endif
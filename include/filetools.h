@@ -2,10 +2,48 @@
 #define __FILETOOLS_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct stat;
+struct fsbatch;
 
+/* Bulk directory iterator, replacement for readdir() using getdents64 with a
+ * large buffer so that huge cur/ folders requires as few syscalls as possible.
+ * Entries are valid until the next call to dirscan_next(). */
+struct dirscan_entry {
+	unsigned long long ino;
+	unsigned char type; /* DT_* values, may be DT_UNKNOWN */
+	unsigned short namelen;
+	char *name; /* NUL terminated, may be modified in place provided the length stays the same */
+};
+
+struct dirscan;
+
+/** maximum buffer size used by getdents64, defaults to 1MiB, can be overridden
+ * using the MAILDIR_DIRSCAN_BUFSIZE environment variable. */
+void dirscan_set_bufsize(size_t bufsize);
+/** takes ownership of fd (even on failure), like fdopendir() */
+struct dirscan* dirscan_fdopen(int fd);
+struct dirscan* dirscan_openat(int dirfd, const char* name);
+/** returns NULL at end of directory (errno == 0) or on error (errno set) */
+struct dirscan_entry* dirscan_next(struct dirscan* ds);
+int dirscan_fd(const struct dirscan* ds);
+/** closes the underlying fd */
+void dirscan_close(struct dirscan* ds);
+
+static inline
+bool dirscan_dots(const struct dirscan_entry* de)
+{
+	return de->name[0] == '.' && (de->namelen == 1 || (de->namelen == 2 && de->name[1] == '.'));
+}
+
+/** 1 if the files have identical content, 0 if not, -1 on error (already
+ * output).  st1 and st2 may be NULL in which case they're stat'ed. */
 int files_identical(int fd1, const char* path1, const struct stat* st1, int fd2, const char* path2, const struct stat* st2);
+/** as files_identical(), but with (optional, may be NULL) cached content
+ * hashes (see hash64.h), differing hashes avoids reading the files. */
+int files_identical_hash(int fd1, const char* path1, const struct stat* st1, const unsigned long long* hash1,
+		int fd2, const char* path2, const struct stat* st2, const unsigned long long* hash2);
 int is_maildir(int fd, const char* folder);
 int get_maildir_fd_at(int bfd, const char* folder);
 int get_maildir_fd(const char* folder);
@@ -13,16 +51,117 @@ int maildir_create_sub(int bfd, const char* target, const char* foldername, bool
 
 int message_seen(const char* filename);
 
-void maildir_move(int sfd, const char* source, int tfd, const char* target, const char* sub, const char* fname, bool dry_run);
+/** formats input as "1.50 MiB" and the like, buffer should be at least 12
+ * bytes ("XXXX.XX XiB"), returns buffer */
+char* pretty_size(size_t input, char* buffer);
+
+/** invoke cb for every non-empty line (line endings removed) of fname, "-"
+ * being stdin, until cb returns false.  Returns -1 with errno set if fname
+ * couldn't be opened or read. */
+int read_lines(const char* fname, bool (*cb)(void* data, const char* line), void* data);
+
+/* Maildir info flags as a bit mask.  Any letter can be represented, with the
+ * bits assigned in ASCII order (A-Z, then a-z) such that the canonical (sorted)
+ * flag string is simply the set bits from low to high. */
+#define MAILDIR_FLAG_BIT(c)		((c) >= 'a' ? (c) - 'a' + 26 : (c) - 'A')
+#define MAILDIR_FLAG(c)			(1ULL << MAILDIR_FLAG_BIT(c))
+#define MAILDIR_FLAG_KEYWORDS	(((1ULL << 26) - 1) << 26) /* a-z */
+#define MAILDIR_FLAGS_VALID		(MAILDIR_FLAG('D') | MAILDIR_FLAG('F') | MAILDIR_FLAG('P') | \
+		MAILDIR_FLAG('R') | MAILDIR_FLAG('S') | MAILDIR_FLAG('T') | MAILDIR_FLAG_KEYWORDS)
+#define MAILDIR_FLAGS_MAX		52 /* length of the longest canonical flag string */
+
+/** parse len flag characters into *mask, returns false if there are characters
+ * that can't be represented (anything other than letters).  ordered (may be
+ * NULL) is set to whether the flags are strictly ascending, ie, canonical. */
+bool maildir_flags_parse(const char* flags, size_t len, unsigned long long* mask, bool* ordered);
+/** canonical flag string for mask, buf needs room for MAILDIR_FLAGS_MAX + 1
+ * characters, returns the length */
+size_t maildir_flags_format(unsigned long long mask, char* buf);
+/** flags of a file name, returns false if it has no (or unsupported) :2, info,
+ * or flags that can't be represented */
+bool maildir_name_flags(const char* fname, unsigned long long* mask);
+
+#define MAILDIR_SIZE_S		0x01 /* S=, size of the file */
+#define MAILDIR_SIZE_W		0x02 /* W=, RFC822 size (ie, with CRLF line endings) */
+#define MAILDIR_NAME_TIME	0x04 /* leading seconds since epoch, followed by a . */
+#define MAILDIR_NAME_USEC	0x08 /* M, microseconds */
+#define MAILDIR_NAME_PID	0x10 /* P (or the old style bare pid) */
+#define MAILDIR_NAME_DEV	0x20 /* V, device number */
+#define MAILDIR_NAME_INO	0x40 /* I, inode number */
+#define MAILDIR_NAME_INFO	0x80 /* :2, info */
+
+/* A decoded maildir file name, time.delivery.host[,ext...][:2,flags[,ext]],
+ * where delivery is made up of M, P, V and I (and other, ignored) parts, or
+ * the old style pid[_n].  Positions are offsets into the name. */
+struct maildir_name {
+	unsigned long long timestamp;
+	unsigned long long size, wsize; /* S=, W= */
+	unsigned long long dev, ino; /* V, I (hexadecimal) */
+	unsigned long usec, pid; /* M, P */
+	unsigned short fields; /* MAILDIR_SIZE_* and MAILDIR_NAME_* found */
+	unsigned short hostoff, hostlen; /* only with MAILDIR_NAME_TIME */
+	unsigned short uniquelen; /* up to the : (or the end) */
+	unsigned short flagsoff, flagslen; /* only with MAILDIR_NAME_INFO, flags end at a , */
+};
+
+/** decode fname in a single pass, returns (and sets mn->fields to) the mask of
+ * fields found. */
+int maildir_name_parse(const char* fname, struct maildir_name* mn);
+
+/** parse the ,S= and ,W= tags from a maildir file name, returns a mask of the
+ * MAILDIR_SIZE_* values found, size and wsize may be NULL. */
+int maildir_name_sizes(const char* fname, unsigned long long* size, unsigned long long* wsize);
+/** obtain the sizes of the files names[0..count) in dirfd (for files that
+ * don't have S= tags), requesting only STATX_SIZE, batched where batch (which
+ * may be NULL) is asynchronous.  errs[i] is set to 0 or an errno value. */
+void maildir_stat_sizes(struct fsbatch* batch, int dirfd, char* const* names, size_t count,
+		unsigned long long* sizes, int* errs);
+
+typedef void (*maildir_move_cb)(void* data, const char* fname, int err);
+
+/** batch may be NULL for a synchronous rename, else sfd and tfd must remain
+ * open, and source, target, sub and data valid, until batch has been flushed.
+ * cb (which may be NULL) is invoked once the rename has completed, with err 0
+ * on success or an errno value (failures are already output), but not for a
+ * dry run. */
+void maildir_move(struct fsbatch* batch, int sfd, const char* source, int tfd, const char* target, const char* sub, const char* fname, bool dry_run,
+		maildir_move_cb cb, void* data);
+
+/* Zero copy mail header parser.  The header block of a message (never the
+ * body) is read incrementally into a fixed buffer of up to MAIL_HEADER_MAX
+ * bytes, and headers are returned as slices into it, valid until the next
+ * mail_headers_open() or mail_headers_free().  Folded values are returned as
+ * is, use mail_header_unfold() to obtain a single line. */
+#define MAIL_HEADER_MAX		(256 << 10)
 
 struct mail_header {
-	char * header;
-	char **value; /* NULL terminated list of values */
-	struct mail_header* next;
+	const char* name; /* not NUL terminated */
+	size_t namelen;
+	const char* value; /* leading whitespace and final line ending removed */
+	size_t valuelen;
+};
+
+struct mail_headers {
+	char *buffer;
+	int fd;
+	size_t length, pos;
+	bool eof;
+	int error; /* errno of a failed read, if any */
+	const char* const* wanted;
 };
 
-struct mail_header* get_mail_header(int sfd, const char* filename);
-const struct mail_header* find_mail_header(const struct mail_header* head, const char* header);
-void free_mail_header(struct mail_header* head);
+#define MAIL_HEADERS_INIT	{ NULL, -1, 0, 0, false, 0, NULL }
+
+/** wanted is a NULL terminated list of (case insensitive) header names to
+ * return, or NULL for all.  Returns -1 with errno set on failure. */
+int mail_headers_open(struct mail_headers* mh, int dirfd, const char* filename, const char* const* wanted);
+/** the next (wanted) header, false at the end of the headers */
+bool mail_headers_next(struct mail_headers* mh, struct mail_header* h);
+/** copies the value into buf with line breaks removed, truncating if needed,
+ * returns the length */
+size_t mail_header_unfold(const struct mail_header* h, char* buf, size_t bufsize);
+/** closes the file, the buffer (and thus any slices) remains valid */
+void mail_headers_close(struct mail_headers* mh);
+void mail_headers_free(struct mail_headers* mh);
 
 #endif
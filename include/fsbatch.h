@@ -0,0 +1,41 @@
+#ifndef __FSBATCH_H__
+#define __FSBATCH_H__
+
+#include <stdbool.h>
+
+/* Batched filesystem operations.  When io_uring (with the required opcodes)
+ * is available operations are queued and submitted in batches of up to depth
+ * operations, otherwise (or when depth is 0) every operation is performed
+ * synchronously at the time it is queued.
+ *
+ * Completion callbacks are invoked from within the queueing, flush and free
+ * calls (never asynchronously), err is 0 on success or an errno value.
+ *
+ * Operations may complete in any order, and any fds passed in MUST remain
+ * open until fsbatch_flush() has been called.
+ */
+struct fsbatch;
+struct statx;
+
+typedef void (*fsbatch_cb)(void* data, const char* oldpath, const char* newpath, int err);
+
+struct fsbatch* fsbatch_new(unsigned depth);
+
+void fsbatch_renameat2(struct fsbatch* b, int olddirfd, const char* oldpath,
+		int newdirfd, const char* newpath, unsigned flags, fsbatch_cb cb, void* data);
+void fsbatch_unlinkat(struct fsbatch* b, int dirfd, const char* path, int flags,
+		fsbatch_cb cb, void* data);
+/** buf must remain valid until the callback has been invoked */
+void fsbatch_statx(struct fsbatch* b, int dirfd, const char* path, int flags, unsigned mask,
+		struct statx* buf, fsbatch_cb cb, void* data);
+
+/** wait for all outstanding operations to complete */
+void fsbatch_flush(struct fsbatch* b);
+
+/** flushes and releases */
+void fsbatch_free(struct fsbatch* b);
+
+/** parse a batch depth argument, exits with an error if invalid */
+unsigned fsbatch_parse_depth(const char* arg);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef __HASH64_H__
+#define __HASH64_H__
+
+#include <stddef.h>
+
+/* Fast non-cryptographic 64-bit hash (XXH64), for finding candidate
+ * duplicates by content.  Collisions are possible (if unlikely), so anything
+ * destructive should still verify the content. */
+struct hash64 {
+	unsigned long long v[4];
+	unsigned long long total;
+	unsigned char mem[32];
+	unsigned memsize;
+};
+
+void hash64_init(struct hash64* h);
+void hash64_update(struct hash64* h, const void* data, size_t len);
+unsigned long long hash64_final(const struct hash64* h);
+
+#endif
@@ -2,6 +2,9 @@
 #define __SERVERTYPES_H__
 
 #include <stdbool.h>
+#include <stdio.h>
+
+#include "strmap.h"
 
 enum server_bugs {
 	root_maildirfolder = 1, /* dovecot marks root folders as begin a subfolder. */
@@ -12,8 +15,9 @@ struct maildir_type {
 
 	enum server_bugs buglist;
 
-	/** returns non-zero if the given path is detected as being of this type */
-	int (*detect)(const char* folder);
+	/** files in the maildir of which the presence indicates this type, NULL
+	 * terminated.  These are matched in a single scan of the directory. */
+	const char * const* markers;
 
 	/** returns a list of files (outside of cur/new/tmp) which is used by the server
 	 * this is used by maildirreconstruct to know which additional files needs to be copied
@@ -38,6 +42,19 @@ struct maildir_type {
 	 */
 	void (*pop3_set_uidl)(void* pvt, const char* basename, const char* uidl);
 
+	/** IMAP UIDVALIDITY of the folder, 0 if unknown */
+	unsigned long (*imap_uidvalidity)(void* pvt);
+
+	/** IMAP UID of the message basename (the file name without :2,...), 0 if
+	 * unknown */
+	unsigned long (*imap_get_uid)(void* pvt, const char* basename);
+
+	/** record that basename was moved into the folder, keeping uid (0 if
+	 * unknown) from a folder with UIDVALIDITY uidvalidity where the server
+	 * permits, else allocating a new UID (once all messages have been
+	 * added).  Returns the UID kept, or 0 if a new one will be allocated. */
+	unsigned long (*imap_add_uid)(void* pvt, const char* basename, unsigned long uid, unsigned long uidvalidity);
+
 	/** fldrname is as per directory, so may need to prefix with eg INBOX. as per rquirement */
 	int (*imap_is_subscribed)(void* pvt, const char* fldrname);
 	void (*imap_subscribe)(void* pvt, const char* fldrname);
@@ -61,7 +78,102 @@ struct maildir_type_list {
 #define maildir_type_list_free(x) do { while (x) { struct maildir_type_list *_t = (x)->next; if (x->pvt && x->type->close) { x->type->close(x->pvt); } free(x); x = _t; }} while (0)
 
 void register_maildir_type(const struct maildir_type *mt);
+/** probe the maildir open as dirfd (which remains open) for all registered
+ * types, folder is only used for error messages.  Returns NULL if no types
+ * were detected, or on error (already output). */
+struct maildir_type_list* maildir_find_type_at(int dirfd, const char* folder);
 struct maildir_type_list* maildir_find_type(const char* folder);
+/** the types of a sub-folder, which are those of its mailbox root, without
+ * probing (pvt values are not copied). */
+struct maildir_type_list* maildir_type_list_inherit(const struct maildir_type_list* root);
 
 const char* const * maildir_get_all_metafiles();
+
+/* Helpers for the backends. */
+
+/** Atomically replace the file fname in the maildir open as dirfd: a
+ * temporary file is created in tmp/ with the mode (and when running as root,
+ * ownership) of the existing file (or the maildir if there is none), which is
+ * renamed over fname by meta_replace_commit().  folder is only used for error
+ * messages, which are output by these functions. */
+struct meta_replace {
+	int dirfd;
+	const char *folder, *fname;
+	char tmpname[256];
+	FILE *fp;
+};
+
+/** returns NULL on failure */
+FILE* meta_replace_open(struct meta_replace* mr, int dirfd, const char* folder, const char* fname);
+/** as meta_replace_open(), but using the server's lock file (eg,
+ * dovecot-uidlist.lock) as the temporary file, which fails if it exists */
+FILE* meta_replace_open_lock(struct meta_replace* mr, int dirfd, const char* folder, const char* fname,
+		const char* lockname);
+/** closes the file and renames it into place, returns -1 on failure (in
+ * which case the temporary file is removed) */
+int meta_replace_commit(struct meta_replace* mr);
+void meta_replace_abort(struct meta_replace* mr);
+
+/** A set of lines (eg, subscribed folders) loaded from a file, with hashed
+ * lookups of the non-empty lines.  Additions are kept in memory and only
+ * written back by line_set_save(), once, if there were any, appended to the
+ * original content which is retained verbatim (headers, blank lines and all). */
+struct line_set {
+	struct strmap map;
+	const char **lines; /* keys in map, those from the file first */
+	size_t count, alloc, loaded;
+	char *raw; /* file content */
+	size_t rawlen;
+	bool dirty;
+};
+
+#define LINE_SET_INIT	{ STRMAP_INIT, NULL, 0, 0, 0, NULL, 0, false }
+
+/** a missing file is an empty set, returns -1 on other errors (output) */
+int line_set_load(struct line_set* ls, int dirfd, const char* folder, const char* fname);
+bool line_set_contains(const struct line_set* ls, const char* line);
+/** returns true if line wasn't in the set yet */
+bool line_set_add(struct line_set* ls, const char* line);
+/** writes the set to fname (using meta_replace) if there were additions */
+int line_set_save(struct line_set* ls, int dirfd, const char* folder, const char* fname);
+void line_set_free(struct line_set* ls);
+/** Index of the messages (by basename, ie, the file name without :2,...) in a
+ * server's per folder UID file, eg dovecot-uidlist.  Entries are kept in file
+ * order, followed by those added, with the rest of the record (ext) as is.
+ * The backend parses and writes the file, the index implements the UID
+ * allocation policy. */
+struct uid_entry {
+	unsigned long uid;
+	const char *basename; /* key in map */
+	const char *ext; /* NULL if none */
+};
+
+struct uid_index {
+	bool loaded, broken, dirty; /* for use by the backend */
+	unsigned long uidvalidity, next_uid;
+	unsigned long first_new; /* next_uid as loaded, UIDs from here on are new to clients */
+	char *header; /* unparsed header fields, for use by the backend */
+	struct strmap map; /* basename => struct uid_entry */
+	struct uid_entry **entries;
+	size_t count, loaded_count, alloc;
+	unsigned char *used; /* bitmap of the UIDs from first_new on in use */
+	size_t usedsize;
+};
+
+/** add a loaded record, returns the existing entry if basename is listed twice */
+struct uid_entry* uid_index_append(struct uid_index* ix, const char* basename, size_t len,
+		unsigned long uid, const char* ext, size_t extlen);
+/** to be called once the file has been loaded (or found missing) */
+void uid_index_loaded(struct uid_index* ix);
+struct uid_entry* uid_index_find(const struct uid_index* ix, const char* basename);
+/** as imap_add_uid(): keeps uid if uidvalidity matches (or the folder is empty,
+ * in which case uidvalidity may be adopted) and uid is still new to clients
+ * and unused, and returns it, else adds the entry with UID 0 and returns 0. */
+unsigned long uid_index_add(struct uid_index* ix, const char* basename, unsigned long uid, unsigned long uidvalidity);
+/** allocates UIDs (above any in use) to the added entries that didn't keep
+ * theirs, then sorts the added entries by UID (those loaded are left in file
+ * order), to be called before writing the file */
+void uid_index_finish(struct uid_index* ix);
+void uid_index_free(struct uid_index* ix);
+
 #endif
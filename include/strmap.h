@@ -0,0 +1,44 @@
+#ifndef __STRMAP_H__
+#define __STRMAP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Open addressing (linear probing) hash table mapping strings to a pointer
+ * sized value.  Keys are copied into an arena owned by the map, so callers
+ * need not keep them around.  Entries can't be removed individually. */
+struct strmap_entry {
+	const char* key; /* NULL for unused slots, NUL terminated */
+	size_t keylen;
+	unsigned long hash;
+	void *value;
+};
+
+struct strmap_arena;
+
+struct strmap {
+	struct strmap_entry *entries;
+	size_t size; /* power of 2 */
+	size_t count;
+	struct strmap_arena *arena;
+};
+
+#define STRMAP_INIT	{ NULL, 0, 0, NULL }
+
+unsigned long strmap_hash(const char* key, size_t keylen);
+
+/** returns NULL if key isn't present */
+struct strmap_entry* strmap_find(const struct strmap* m, const char* key, size_t keylen);
+/** returns the entry for key, inserting it with a NULL value if needed,
+ * created (if non-NULL) indicates whether a new entry was inserted. */
+struct strmap_entry* strmap_insert(struct strmap* m, const char* key, size_t keylen, bool* created);
+/** allocate memory from the map's arena, released by strmap_free() */
+void* strmap_alloc(struct strmap* m, size_t size);
+/** releases all memory, including keys, but not anything values point to */
+void strmap_free(struct strmap* m);
+
+#define strmap_foreach(m, e) \
+	for (struct strmap_entry *e = (m)->entries; e && e < (m)->entries + (m)->size; ++e) \
+		if (e->key)
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __WORKQUEUE_H__
+#define __WORKQUEUE_H__
+
+#include <stddef.h>
+
+/** Ordered worker pool.
+ *
+ * Items are pushed from a single thread, work() is invoked on them from up to
+ * jobs worker threads, and done() is invoked from the pushing thread (from
+ * within workqueue_push() and workqueue_finish()) strictly in the order in
+ * which items were pushed.  This allows the expensive part (usually I/O bound)
+ * to run concurrently whilst output remains deterministic.
+ *
+ * With jobs <= 1 no threads are created and push() simply calls work()
+ * followed by done(), which is identical to the plain serial code path.
+ */
+struct workqueue;
+
+typedef void (*workqueue_fn)(void* item, void* ctx);
+
+/** max_pending bounds the number of items in flight (pushed but not yet
+ * passed to done()), 0 selects a default based on jobs. */
+struct workqueue* workqueue_create(unsigned jobs, size_t max_pending,
+		workqueue_fn work, workqueue_fn done, void* ctx);
+
+/** may block until there is space in the queue */
+void workqueue_push(struct workqueue* wq, void* item);
+
+/** wait for all items to complete, deliver outstanding done() calls, and
+ * release the queue */
+void workqueue_finish(struct workqueue* wq);
+
+/** parse a --jobs argument, exits with an error if invalid, 0 means number of
+ * online CPUs */
+unsigned workqueue_parse_jobs(const char* arg);
+
+#endif
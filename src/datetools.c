@@ -0,0 +1,779 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "datetools.h"
+
+static const char* const month_names[] = {
+	"january", "february", "march", "april", "may", "june", "july",
+	"august", "september", "october", "november", "december", NULL
+};
+
+static const char* const day_names[] = {
+	"sunday", "monday", "tuesday", "wednesday", "thursday", "friday",
+	"saturday", NULL
+};
+
+static const struct {
+	const char* name;
+	int offset; /* minutes east of UTC */
+} zone_names[] = {
+	/* RFC 5322 obs-zone */
+	{ "ut",		0 },
+	{ "gmt",	0 },
+	{ "est",	-5 * 60 },
+	{ "edt",	-4 * 60 },
+	{ "cst",	-6 * 60 },
+	{ "cdt",	-5 * 60 },
+	{ "mst",	-7 * 60 },
+	{ "mdt",	-6 * 60 },
+	{ "pst",	-8 * 60 },
+	{ "pdt",	-7 * 60 },
+	/* not permitted, but common enough in the wild */
+	{ "utc",	0 },
+	{ "z",		0 },
+	{ "wet",	0 },
+	{ "west",	1 * 60 },
+	{ "bst",	1 * 60 },
+	{ "cet",	1 * 60 },
+	{ "met",	1 * 60 },
+	{ "cest",	2 * 60 },
+	{ "mest",	2 * 60 },
+	{ "eet",	2 * 60 },
+	{ "sast",	2 * 60 },
+	{ "eest",	3 * 60 },
+	{ "msk",	3 * 60 },
+	{ "ist",	5 * 60 + 30 },
+	{ "hkt",	8 * 60 },
+	{ "awst",	8 * 60 },
+	{ "jst",	9 * 60 },
+	{ "kst",	9 * 60 },
+	{ "acst",	9 * 60 + 30 },
+	{ "aest",	10 * 60 },
+	{ "aedt",	11 * 60 },
+	{ "nzst",	12 * 60 },
+	{ "nzdt",	13 * 60 },
+	{ "ast",	-4 * 60 },
+	{ "adt",	-3 * 60 },
+	{ "akst",	-9 * 60 },
+	{ "akdt",	-8 * 60 },
+	{ "hst",	-10 * 60 },
+	{ NULL, 0 },
+};
+
+/* whitespace and (possibly nested) comments */
+static
+const char* skip_cfws(const char* p)
+{
+	int depth = 0;
+
+	for ( ; *p; ++p) {
+		if (*p == '(')
+			++depth;
+		else if (*p == ')' && depth)
+			--depth;
+		else if (*p == '\\' && depth && p[1])
+			++p;
+		else if (!depth && !isspace((unsigned char)*p))
+			break;
+	}
+
+	return p;
+}
+
+static
+size_t word_len(const char* p)
+{
+	size_t l = 0;
+	while (isalpha((unsigned char)p[l]))
+		++l;
+	return l;
+}
+
+/* returns number of digits consumed, 0 if none (or too many) */
+static
+int parse_num(const char** pp, int* v, int maxdigits)
+{
+	const char *p = *pp;
+	int n = 0;
+
+	*v = 0;
+	while (isdigit((unsigned char)*p)) {
+		if (++n > maxdigits)
+			return 0;
+		*v = *v * 10 + (*p++ - '0');
+	}
+
+	*pp = p;
+	return n;
+}
+
+/* matches either the full name, or an abbreviation of at least three letters */
+static
+int lookup_name(const char* const* names, const char* p, size_t len)
+{
+	if (len < 3)
+		return -1;
+
+	for (int i = 0; names[i]; ++i)
+		if (len <= strlen(names[i]) && strncasecmp(names[i], p, len) == 0)
+			return i;
+
+	return -1;
+}
+
+static
+bool lookup_zone(const char* p, size_t len, int* offset)
+{
+	for (int i = 0; zone_names[i].name; ++i) {
+		if (strlen(zone_names[i].name) == len && strncasecmp(zone_names[i].name, p, len) == 0) {
+			*offset = zone_names[i].offset;
+			return true;
+		}
+	}
+
+	/* military zones, RFC 5322 says to treat these as -0000 since RFC 822 got the sign wrong */
+	if (len == 1 && *p != 'j' && *p != 'J') {
+		*offset = 0;
+		return true;
+	}
+
+	return false;
+}
+
+/* +hhmm, +hh:mm or +hh */
+static
+bool parse_offset(const char** pp, int* offset)
+{
+	const char *p = *pp;
+	int sign = *p++ == '-' ? -1 : 1, hh, mm = 0, n;
+
+	n = parse_num(&p, &hh, 4);
+	if (n == 4) {
+		mm = hh % 100;
+		hh /= 100;
+	} else if (n == 1 || n == 2) {
+		if (*p == ':') {
+			++p;
+			if (parse_num(&p, &mm, 2) != 2)
+				return false;
+		}
+	} else {
+		return false;
+	}
+
+	if (hh > 23 || mm > 59)
+		return false;
+
+	*offset = sign * (hh * 60 + mm);
+	*pp = p;
+	return true;
+}
+
+/* hh:mm[:ss[.frac]] */
+static
+bool parse_time(const char** pp, struct tm* tm)
+{
+	const char *p = *pp;
+	int v;
+
+	if (!parse_num(&p, &v, 2) || v > 23 || *p != ':')
+		return false;
+	tm->tm_hour = v;
+	++p;
+
+	if (parse_num(&p, &v, 2) != 2 || v > 59)
+		return false;
+	tm->tm_min = v;
+
+	if (*p == ':') {
+		++p;
+		if (parse_num(&p, &v, 2) != 2 || v > 60)
+			return false;
+		tm->tm_sec = v == 60 ? 59 : v; /* leap seconds */
+		if (*p == '.' && isdigit((unsigned char)p[1]))
+			for (++p; isdigit((unsigned char)*p); ++p)
+				;
+	}
+
+	*pp = p;
+	return true;
+}
+
+static
+bool parse_year(const char** pp, struct tm* tm)
+{
+	int v, n = parse_num(pp, &v, 4);
+
+	/* RFC 5322 4.3 obs-year */
+	if (n == 2)
+		v += v < 50 ? 2000 : 1900;
+	else if (n == 3)
+		v += 1900;
+	else if (n != 4)
+		return false;
+
+	tm->tm_year = v - 1900;
+	return true;
+}
+
+static
+bool parse_month(const char** pp, struct tm* tm)
+{
+	size_t l = word_len(*pp);
+	int m = lookup_name(month_names, *pp, l);
+
+	if (m < 0)
+		return false;
+
+	tm->tm_mon = m;
+	*pp += l;
+	return true;
+}
+
+/* false if tm_mday doesn't exist in the month (mktime() would silently
+ * normalise 2020-02-30 to March 1st) */
+static
+bool valid_mday(const struct tm* tm)
+{
+	static const int mdays[] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	int y = tm->tm_year + 1900;
+
+	if (tm->tm_mday <= 28)
+		return true;
+	return tm->tm_mday <= mdays[tm->tm_mon] && (tm->tm_mon != 1 || tm->tm_mday != 29 ||
+			(y % 4 == 0 && (y % 100 != 0 || y % 400 == 0)));
+}
+
+bool rfc5322_parse_date(const char* str, long long* t)
+{
+	const char *p = skip_cfws(str);
+	struct tm tm;
+	bool have_zone = false;
+	int offset = 0, v;
+	size_t l;
+
+	memset(&tm, 0, sizeof(tm));
+
+	/* [ day-of-week "," ] */
+	l = word_len(p);
+	if (l && lookup_name(day_names, p, l) >= 0) {
+		p = skip_cfws(p + l);
+		if (*p == ',' || *p == '.')
+			p = skip_cfws(p + 1);
+	}
+
+	if (isdigit((unsigned char)*p)) {
+		/* day month year time, with "3-Jul-2017" tolerated */
+		if (!parse_num(&p, &v, 2) || v < 1 || v > 31)
+			return false;
+		tm.tm_mday = v;
+		p = skip_cfws(p);
+		if (*p == '-')
+			p = skip_cfws(p + 1);
+		if (!parse_month(&p, &tm))
+			return false;
+		p = skip_cfws(p);
+		if (*p == '-')
+			p = skip_cfws(p + 1);
+		if (!parse_year(&p, &tm))
+			return false;
+		p = skip_cfws(p);
+		if (!parse_time(&p, &tm))
+			return false;
+	} else {
+		/* asctime() ordering: month day time [zone] year */
+		if (!parse_month(&p, &tm))
+			return false;
+		p = skip_cfws(p);
+		if (!parse_num(&p, &v, 2) || v < 1 || v > 31)
+			return false;
+		tm.tm_mday = v;
+		p = skip_cfws(p);
+		if (!parse_time(&p, &tm))
+			return false;
+		p = skip_cfws(p);
+		l = word_len(p);
+		if (l && lookup_zone(p, l, &offset)) {
+			have_zone = true;
+			p = skip_cfws(p + l);
+		}
+		if (!parse_year(&p, &tm))
+			return false;
+	}
+
+	p = skip_cfws(p);
+	if (!have_zone) {
+		l = word_len(p);
+		if (*p == '+' || *p == '-') {
+			if (!parse_offset(&p, &offset))
+				return false;
+			have_zone = true;
+		} else if (l) {
+			if (!lookup_zone(p, l, &offset))
+				return false;
+			p += l;
+			have_zone = true;
+			/* GMT+0200 and the like */
+			if ((*p == '+' || *p == '-') && offset == 0 && !parse_offset(&p, &offset))
+				return false;
+		}
+		p = skip_cfws(p);
+	}
+
+	/* a zone name following the numeric offset, eg "+0200 CEST" */
+	l = word_len(p);
+	if (l && lookup_zone(p, l, &v))
+		p = skip_cfws(p + l);
+
+	if (*p)
+		return false;
+
+	if (!valid_mday(&tm))
+		return false;
+
+	if (have_zone) {
+		*t = (long long)timegm(&tm) - offset * 60LL;
+	} else {
+		/* same as what date(1) would have done */
+		tm.tm_isdst = -1;
+		*t = mktime(&tm);
+	}
+
+	return true;
+}
+
+/* protects the co-process, which can only handle one query at a time */
+static pthread_mutex_t coproc_lock = PTHREAD_MUTEX_INITIALIZER;
+static int coproc_fd = -1;
+static pid_t coproc_pid = -1;
+static char coproc_buf[256];
+static size_t coproc_buflen = 0;
+
+static
+bool coproc_readline(char* line, size_t size)
+{
+	char *nl;
+
+	while (!(nl = memchr(coproc_buf, '\n', coproc_buflen))) {
+		if (coproc_buflen == sizeof(coproc_buf))
+			return false;
+		ssize_t r = recv(coproc_fd, coproc_buf + coproc_buflen, sizeof(coproc_buf) - coproc_buflen, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		coproc_buflen += r;
+	}
+
+	size_t l = nl - coproc_buf;
+	if (l >= size)
+		return false;
+	memcpy(line, coproc_buf, l);
+	line[l] = 0;
+	coproc_buflen -= l + 1;
+	memmove(coproc_buf, nl + 1, coproc_buflen);
+	return true;
+}
+
+static
+bool coproc_send(const char* s, size_t len)
+{
+	while (len) {
+		ssize_t r = send(coproc_fd, s, len, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return false;
+		s += r;
+		len -= r;
+	}
+	return true;
+}
+
+/* Every query is bracketed by two markers that date itself converts
+ * ("@1" => "1", "@2" => "2"), so an invalid date (for which date outputs
+ * nothing on stdout) can be told apart from a slow one. */
+static
+int coproc_query(const char* str, long long* t)
+{
+	char line[64], *e;
+	size_t len = strlen(str);
+
+	if (!coproc_send("@1\n", 3) || !coproc_send(str, len) || !coproc_send("\n@2\n", 4))
+		return -1;
+
+	if (!coproc_readline(line, sizeof(line)) || strcmp(line, "1") != 0)
+		return -1;
+	if (!coproc_readline(line, sizeof(line)))
+		return -1;
+	if (strcmp(line, "2") == 0)
+		return 0;
+
+	*t = strtoll(line, &e, 10);
+	if (!*line || *e)
+		return -1;
+
+	if (!coproc_readline(line, sizeof(line)) || strcmp(line, "2") != 0)
+		return -1;
+	return 1;
+}
+
+static
+void coproc_stop()
+{
+	if (coproc_fd < 0)
+		return;
+
+	close(coproc_fd);
+	coproc_fd = -1;
+	if (waitpid(coproc_pid, NULL, 0) < 0)
+		perror("waitpid");
+	coproc_pid = -1;
+}
+
+bool date_coprocess_start()
+{
+	int sv[2];
+
+	if (coproc_fd >= 0)
+		return true;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		return false;
+	}
+
+	coproc_pid = fork();
+	if (coproc_pid == -1) {
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	} else if (coproc_pid == 0) {
+		/* child, stdbuf is needed to stop date from buffering its output */
+		int null = open("/dev/null", O_WRONLY);
+		if (dup2(sv[1], 0) < 0 || dup2(sv[1], 1) < 0 || null < 0 || dup2(null, 2) < 0)
+			_exit(1);
+		char *const argv[] = {
+			"stdbuf",
+			"-oL",
+			"date",
+			"-f",
+			"-",
+			"+%s",
+			NULL
+		};
+		execvp("stdbuf", argv);
+		_exit(1);
+	}
+
+	close(sv[1]);
+	coproc_fd = sv[0];
+	coproc_buflen = 0;
+
+	/* make sure it actually works */
+	long long t;
+	if (coproc_query("@0", &t) != 1 || t != 0) {
+		fprintf(stderr, "Unable to start date co-process, falling back to a date process per call.\n");
+		coproc_stop();
+		return false;
+	}
+
+	return true;
+}
+
+void date_coprocess_stop()
+{
+	pthread_mutex_lock(&coproc_lock);
+	coproc_stop();
+	pthread_mutex_unlock(&coproc_lock);
+}
+
+static
+bool date_fork(const char* str, long long* t)
+{
+	int pfds[2];
+	/* close-on-exec, so concurrent callers don't hold each other's pipes open */
+	if (pipe2(pfds, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		return false;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close(pfds[0]);
+		close(pfds[1]);
+		return false;
+	} else if (pid == 0) {
+		/* child, the caller reports failures so date needn't */
+		int null = open("/dev/null", O_WRONLY);
+		if (dup2(pfds[1], 1) < 0 || null < 0 || dup2(null, 2) < 0) {
+			perror("dup2");
+			_exit(1);
+		}
+		close(pfds[0]);
+		close(pfds[1]);
+		char *const argv[] = {
+			"date",
+			"-d",
+			(char*)str,
+			"+%s",
+			NULL
+		};
+		execvp("date", argv);
+		_exit(1);
+	}
+
+	/* parent */
+	char bfr[64], *e;
+	int status;
+	close(pfds[1]);
+	int r = read(pfds[0], bfr, sizeof(bfr) - 1);
+	if (r < 0)
+		perror("read");
+	close(pfds[0]);
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		return false;
+	}
+
+	if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return false;
+
+	bfr[r] = 0; /* null terminate the string */
+	*t = strtoll(bfr, &e, 10);
+	if (*bfr == 0 || (*e != '\n' && *e != 0)) {
+		fprintf(stderr, "Invalid output from date for %s (got %s).\n", str, bfr);
+		return false;
+	}
+
+	return true;
+}
+
+bool date_command(const char* str, long long* t)
+{
+	/* date -f reads line by line, so embedded newlines would desync us */
+	if (!strchr(str, '\n')) {
+		pthread_mutex_lock(&coproc_lock);
+		if (coproc_fd >= 0) {
+			int r = coproc_query(str, t);
+			if (r >= 0) {
+				pthread_mutex_unlock(&coproc_lock);
+				return r;
+			}
+			fprintf(stderr, "date co-process failed, falling back to a date process per call.\n");
+			coproc_stop();
+		}
+		pthread_mutex_unlock(&coproc_lock);
+	}
+
+	return date_fork(str, t);
+}
+
+bool parse_mail_date(const char* str, long long* t)
+{
+	return rfc5322_parse_date(str, t) || date_command(str, t);
+}
+
+static const struct {
+	const char* name;
+	enum { REL_SEC, REL_DAY, REL_MON } kind;
+	int mult;
+} rel_units[] = {
+	{ "second",		REL_SEC,	1 },
+	{ "sec",		REL_SEC,	1 },
+	{ "minute",		REL_SEC,	60 },
+	{ "min",		REL_SEC,	60 },
+	{ "hour",		REL_SEC,	3600 },
+	{ "day",		REL_DAY,	1 },
+	{ "week",		REL_DAY,	7 },
+	{ "fortnight",	REL_DAY,	14 },
+	{ "month",		REL_MON,	1 },
+	{ "year",		REL_MON,	12 },
+	{ NULL, 0, 0 },
+};
+
+/* word of length len is name, optionally followed by an s */
+static
+bool word_is(const char* p, size_t len, const char* name)
+{
+	size_t nl = strlen(name);
+	return (len == nl || (len == nl + 1 && (p[nl] == 's' || p[nl] == 'S'))) && strncasecmp(p, name, nl) == 0;
+}
+
+/* YYYY-MM-DD[( |T)HH:MM[:SS]][Z|+hh[:mm]] */
+static
+bool parse_iso_date(const char* p, long long* t)
+{
+	struct tm tm;
+	int v, offset = 0;
+	bool have_zone = false;
+
+	memset(&tm, 0, sizeof(tm));
+
+	if (parse_num(&p, &v, 4) != 4 || *p++ != '-')
+		return false;
+	tm.tm_year = v - 1900;
+	if (!parse_num(&p, &v, 2) || v < 1 || v > 12 || *p++ != '-')
+		return false;
+	tm.tm_mon = v - 1;
+	if (!parse_num(&p, &v, 2) || v < 1 || v > 31)
+		return false;
+	tm.tm_mday = v;
+
+	if ((*p == 'T' || *p == 't' || *p == ' ') && isdigit((unsigned char)p[1])) {
+		++p;
+		if (!parse_time(&p, &tm))
+			return false;
+		if (*p == 'Z' || *p == 'z') {
+			have_zone = true;
+			++p;
+		} else if (*p == '+' || *p == '-') {
+			if (!parse_offset(&p, &offset))
+				return false;
+			have_zone = true;
+		}
+	}
+
+	while (isspace((unsigned char)*p))
+		++p;
+	if (*p || !valid_mday(&tm))
+		return false;
+
+	if (have_zone) {
+		*t = (long long)timegm(&tm) - offset * 60LL;
+	} else {
+		tm.tm_isdst = -1;
+		*t = mktime(&tm);
+	}
+	return true;
+}
+
+bool parse_relative_date(const char* str, long long now, long long* t)
+{
+	const char *p = str;
+	time_t base = now;
+	struct tm tm;
+	long long secs = 0, n;
+	int days = 0, months = 0;
+	char *e;
+
+	while (isspace((unsigned char)*p))
+		++p;
+
+	if (*p == '@') {
+		n = strtoll(p + 1, &e, 10);
+		if (e == p + 1 || !isdigit((unsigned char)e[-1]))
+			return false;
+		while (isspace((unsigned char)*e))
+			++e;
+		if (*e)
+			return false;
+		*t = n;
+		return true;
+	}
+
+	if (isdigit((unsigned char)p[0]) && isdigit((unsigned char)p[1]) && isdigit((unsigned char)p[2]) &&
+			isdigit((unsigned char)p[3]) && p[4] == '-')
+		return parse_iso_date(p, t);
+
+	if (!*p)
+		return false;
+
+	while (*p) {
+		size_t l;
+		int i;
+
+		/* [+-]N unit, or just unit (N = 1) */
+		n = 1;
+		if (*p == '+' || *p == '-' || isdigit((unsigned char)*p)) {
+			n = strtoll(p, &e, 10);
+			if (e == p || !isdigit((unsigned char)e[-1]))
+				return false;
+			p = e;
+			while (isspace((unsigned char)*p))
+				++p;
+		}
+
+		l = word_len(p);
+		if (!l)
+			return false;
+
+		if (l == 3 && strncasecmp(p, "now", 3) == 0) {
+			n = 0; /* 0 seconds */
+			i = 0;
+		} else if (word_is(p, l, "today")) {
+			n = 0;
+			i = 0;
+		} else if (word_is(p, l, "yesterday")) {
+			n = -1;
+			for (i = 0; strcmp(rel_units[i].name, "day"); ++i)
+				;
+		} else if (word_is(p, l, "tomorrow")) {
+			for (i = 0; strcmp(rel_units[i].name, "day"); ++i)
+				;
+		} else {
+			for (i = 0; rel_units[i].name && !word_is(p, l, rel_units[i].name); ++i)
+				;
+			if (!rel_units[i].name)
+				return false;
+		}
+
+		p += l;
+		while (isspace((unsigned char)*p))
+			++p;
+
+		/* ago negates the item it follows */
+		l = word_len(p);
+		if (l == 3 && strncasecmp(p, "ago", 3) == 0) {
+			n = -n;
+			p += l;
+			while (isspace((unsigned char)*p))
+				++p;
+		}
+
+		switch (rel_units[i].kind) {
+		case REL_SEC:
+			secs += n * rel_units[i].mult;
+			break;
+		case REL_DAY:
+			days += n * rel_units[i].mult;
+			break;
+		case REL_MON:
+			months += n * rel_units[i].mult;
+			break;
+		}
+	}
+
+	/* like date(1), calendar units move the local date keeping the time of
+	 * day, after which seconds are added */
+	if (!localtime_r(&base, &tm))
+		return false;
+	tm.tm_year += months / 12;
+	tm.tm_mon += months % 12;
+	tm.tm_mday += days;
+	tm.tm_isdst = -1;
+	*t = mktime(&tm) + secs;
+
+	return true;
+}
+
+bool parse_date_option(const char* str, long long* t)
+{
+	return parse_relative_date(str, time(NULL), t) || date_command(str, t);
+}
@@ -1,9 +1,10 @@
 #include "filetools.h"
+#include "fsbatch.h"
 
 #define _GNU_SOURCE
 
-#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -14,6 +15,155 @@
 #include <stdlib.h>
 #include <ctype.h>
 
+#define DIRSCAN_DEFAULT_BUFSIZE		(1 << 20)
+#define DIRSCAN_INITIAL_BUFSIZE		(64 << 10)
+
+#define STAT_SIZES_CHUNK			256
+
+#define COMPARE_EDGE				(4 << 10)
+#define COMPARE_CHUNK				(256 << 10)
+
+#define MAIL_HEADER_CHUNK			(16 << 10)
+
+struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct dirscan {
+	int fd;
+	char *bfr;
+	size_t size, len, pos;
+	bool eof;
+	struct dirscan_entry entry;
+};
+
+static size_t dirscan_bufsize = 0;
+
+void dirscan_set_bufsize(size_t bufsize)
+{
+	/* must at least be able to hold a single entry with a maximal name */
+	if (bufsize < 4096)
+		bufsize = 4096;
+	dirscan_bufsize = bufsize;
+}
+
+static
+size_t dirscan_get_bufsize()
+{
+	if (!dirscan_bufsize) {
+		const char* e = getenv("MAILDIR_DIRSCAN_BUFSIZE");
+		dirscan_set_bufsize(e ? strtoul(e, NULL, 0) : DIRSCAN_DEFAULT_BUFSIZE);
+	}
+	return dirscan_bufsize;
+}
+
+struct dirscan* dirscan_fdopen(int fd)
+{
+	struct dirscan *ds;
+
+	if (fd < 0)
+		return NULL;
+
+	ds = malloc(sizeof(*ds));
+	if (!ds) {
+		close(fd);
+		return NULL;
+	}
+
+	/* start small, most folders aren't large and there is no need to
+	 * allocate (and fault in) the full buffer for them */
+	ds->size = dirscan_get_bufsize();
+	if (ds->size > DIRSCAN_INITIAL_BUFSIZE)
+		ds->size = DIRSCAN_INITIAL_BUFSIZE;
+	ds->bfr = malloc(ds->size);
+	if (!ds->bfr) {
+		free(ds);
+		close(fd);
+		return NULL;
+	}
+
+	ds->fd = fd;
+	ds->len = ds->pos = 0;
+	ds->eof = false;
+
+	return ds;
+}
+
+struct dirscan* dirscan_openat(int dirfd, const char* name)
+{
+	return dirscan_fdopen(openat(dirfd, name, O_RDONLY | O_DIRECTORY));
+}
+
+struct dirscan_entry* dirscan_next(struct dirscan* ds)
+{
+	struct linux_dirent64 *d;
+	size_t nl, lo;
+	const char *nul;
+
+	if (ds->pos >= ds->len) {
+		if (ds->eof) {
+			errno = 0;
+			return NULL;
+		}
+
+		/* the previous call filled the buffer, so grow it towards the maximum */
+		if (ds->len && ds->size < dirscan_bufsize && ds->len > ds->size / 2) {
+			char *t = realloc(ds->bfr, ds->size * 2);
+			if (t) {
+				ds->bfr = t;
+				ds->size *= 2;
+			}
+		}
+
+		long r = syscall(SYS_getdents64, ds->fd, ds->bfr, ds->size);
+		if (r <= 0) {
+			if (r == 0)
+				errno = 0;
+			ds->eof = true;
+			ds->len = ds->pos = 0;
+			return NULL;
+		}
+		ds->len = r;
+		ds->pos = 0;
+	}
+
+	d = (struct linux_dirent64*)(ds->bfr + ds->pos);
+	ds->pos += d->d_reclen;
+
+	/* d_reclen covers the name, its terminator and up to 7 bytes of
+	 * (uninitialised) alignment padding, so the terminator is in the last 8
+	 * bytes and there is no need to strlen() the whole name. */
+	nl = d->d_reclen - offsetof(struct linux_dirent64, d_name);
+	lo = nl > 8 ? nl - 8 : 0;
+	nul = memchr(d->d_name + lo, 0, nl - lo);
+	nl = nul ? (size_t)(nul - d->d_name) : strlen(d->d_name);
+
+	ds->entry.ino = d->d_ino;
+	ds->entry.type = d->d_type;
+	ds->entry.namelen = nl;
+	ds->entry.name = d->d_name;
+
+	return &ds->entry;
+}
+
+int dirscan_fd(const struct dirscan* ds)
+{
+	return ds->fd;
+}
+
+void dirscan_close(struct dirscan* ds)
+{
+	if (!ds)
+		return;
+	close(ds->fd);
+	free(ds->bfr);
+	free(ds);
+}
+
 static
 void fdperror(int fd, const char* path, int err, const char* operation)
 {
@@ -41,11 +191,51 @@ int relstat_error(int fd, const char* path, struct stat *st)
 	return -1;
 }
 
-int files_identical(int fd1, const char* path1, const struct stat* st1, int fd2, const char* path2, const struct stat* st2)
+/* read exactly len bytes, unless EOF (file shrunk) */
+static
+ssize_t pread_full(int fd, void* buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = pread(fd, (char*)buf + done, len - done, off + done);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		done += r;
+	}
+
+	return done;
+}
+
+/* compares len bytes at off, 1 if identical, 0 if not, -1 on error with errno
+ * set and *failed set to the file (1 or 2) that couldn't be read */
+static
+int compare_range(int f1, int f2, void* b1, void* b2, size_t len, off_t off, int* failed)
+{
+	ssize_t r1 = pread_full(f1, b1, len, off);
+	ssize_t r2 = r1 < 0 ? -1 : pread_full(f2, b2, len, off);
+
+	if (r1 < 0 || r2 < 0) {
+		*failed = r1 < 0 ? 1 : 2;
+		return -1;
+	}
+
+	return r1 == (ssize_t)len && r2 == (ssize_t)len && memcmp(b1, b2, len) == 0;
+}
+
+int files_identical_hash(int fd1, const char* path1, const struct stat* st1, const unsigned long long* hash1,
+		int fd2, const char* path2, const struct stat* st2, const unsigned long long* hash2)
 {
 	struct stat _st1, _st2;
-	int f1, f2;
-	void *m1, *m2;
+	int f1, f2, r, failed = 0;
+	char *b1;
+	off_t size, off, head, tail;
 
 	if (!st1) {
 		if (relstat_error(fd1, path1, &_st1) < 0)
@@ -62,9 +252,13 @@ int files_identical(int fd1, const char* path1, const struct stat* st1, int fd2,
 		return 0;
 
 	/* if they are the same file, short out */
-	if (st1->st_dev == st2->st_dev && st1->st_ino == st2->st_ino)
+	if ((st1->st_dev == st2->st_dev && st1->st_ino == st2->st_ino) || !st1->st_size)
 		return 1;
 
+	/* differing hashes are conclusive, equal ones not */
+	if (hash1 && hash2 && *hash1 != *hash2)
+		return 0;
+
 	f1 = openat(fd1, path1, O_RDONLY | AT_EMPTY_PATH);
 	if (f1 < 0) {
 		fdperror(fd1, path1, errno, "openat");
@@ -77,29 +271,57 @@ int files_identical(int fd1, const char* path1, const struct stat* st1, int fd2,
 		return -1;
 	}
 
-	m1 = mmap(NULL, st1->st_size, PROT_READ, MAP_SHARED, f1, 0);
-	if (!m1) {
-		fdperror(fd1, path1, errno, "mmap");
-		close(f1);
-		close(f2);
-		return -1;
+	b1 = (char*)malloc(2 * COMPARE_CHUNK);
+	if (!b1) {
+		perror("malloc");
+		exit(1);
 	}
-	m2 = mmap(NULL, st1->st_size, PROT_READ, MAP_SHARED, f1, 0);
-	if (!m2) {
-		fdperror(fd2, path2, errno, "mmap");
-		munmap(m1, st1->st_size);
-		close(f1);
-		close(f2);
-		return -1;
+
+	size = st1->st_size;
+
+	/* messages that differ mostly do so in the headers, or in the last part
+	 * (eg, different MIME boundaries or signatures), so check those first */
+	head = size < COMPARE_EDGE ? size : COMPARE_EDGE;
+	tail = size - COMPARE_EDGE > head ? size - COMPARE_EDGE : head;
+
+	r = compare_range(f1, f2, b1, b1 + COMPARE_CHUNK, head, 0, &failed);
+	if (r == 1 && tail < size)
+		r = compare_range(f1, f2, b1, b1 + COMPARE_CHUNK, size - tail, tail, &failed);
+
+	if (r == 1 && head < tail) {
+		posix_fadvise(f1, head, tail - head, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(f2, head, tail - head, POSIX_FADV_SEQUENTIAL);
 	}
+
+	for (off = head; r == 1 && off < tail; off += COMPARE_CHUNK) {
+		size_t len = tail - off < COMPARE_CHUNK ? tail - off : COMPARE_CHUNK;
+
+		/* get the kernel reading the next chunk whilst we compare this one */
+		if (off + (off_t)len < tail) {
+			posix_fadvise(f1, off + len, COMPARE_CHUNK, POSIX_FADV_WILLNEED);
+			posix_fadvise(f2, off + len, COMPARE_CHUNK, POSIX_FADV_WILLNEED);
+		}
+
+		r = compare_range(f1, f2, b1, b1 + COMPARE_CHUNK, len, off, &failed);
+	}
+
+	if (r < 0) {
+		if (failed == 2)
+			fdperror(fd2, path2, errno, "pread");
+		else
+			fdperror(fd1, path1, errno, "pread");
+	}
+
+	free(b1);
 	close(f1);
 	close(f2);
 
-	int r = memcmp(m1, m2, st1->st_size);
-	munmap(m1, st1->st_size);
-	munmap(m2, st2->st_size);
+	return r;
+}
 
-	return r == 0;
+int files_identical(int fd1, const char* path1, const struct stat* st1, int fd2, const char* path2, const struct stat* st2)
+{
+	return files_identical_hash(fd1, path1, st1, NULL, fd2, path2, st2, NULL);
 }
 
 int is_maildir(int fd, const char* folder)
@@ -209,10 +431,120 @@ int maildir_create_sub(int bfd, const char* target, const char* foldername, bool
 	return -1;
 }
 
+char* pretty_size(size_t input, char * buffer)
+{
+	size_t rem = 0;
+	const char *units = "kMGTPEZY";
+	const char *unit = NULL;
+
+	while (*units && input >= 1024) {
+		rem = input & 0x3ff;
+		input >>= 10;
+		unit = units++;
+	}
+
+	if (unit)
+		sprintf(buffer, "%.2f %ciB", input + rem / 1024.0, *unit);
+	else
+		sprintf(buffer, "%zu B", input);
+
+	return buffer;
+}
+
+int read_lines(const char* fname, bool (*cb)(void* data, const char* line), void* data)
+{
+	FILE *fp = strcmp(fname, "-") == 0 ? stdin : fopen(fname, "r");
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int e = 0;
+
+	if (!fp)
+		return -1;
+
+	while ((len = getline(&line, &size, fp)) >= 0) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		if (len && !cb(data, line))
+			break;
+	}
+	if (ferror(fp))
+		e = errno ? errno : EIO;
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+
+	errno = e;
+	return e ? -1 : 0;
+}
+
+/* MAILDIR_FLAG() for letters, 0 for anything else */
+#define F(c) [c] = MAILDIR_FLAG(c)
+static const unsigned long long flag_bits[256] = {
+	F('A'), F('B'), F('C'), F('D'), F('E'), F('F'), F('G'), F('H'), F('I'),
+	F('J'), F('K'), F('L'), F('M'), F('N'), F('O'), F('P'), F('Q'), F('R'),
+	F('S'), F('T'), F('U'), F('V'), F('W'), F('X'), F('Y'), F('Z'),
+	F('a'), F('b'), F('c'), F('d'), F('e'), F('f'), F('g'), F('h'), F('i'),
+	F('j'), F('k'), F('l'), F('m'), F('n'), F('o'), F('p'), F('q'), F('r'),
+	F('s'), F('t'), F('u'), F('v'), F('w'), F('x'), F('y'), F('z'),
+};
+#undef F
+
+bool maildir_flags_parse(const char* flags, size_t len, unsigned long long* mask, bool* ordered)
+{
+	unsigned long long m = 0, b;
+	unsigned char c, last = 0;
+	bool valid = true, asc = true;
+
+	while (len--) {
+		c = *flags++;
+		b = flag_bits[c];
+		valid &= b != 0;
+		asc &= c > last;
+		m |= b;
+		last = c;
+	}
+
+	*mask = m;
+	if (ordered)
+		*ordered = asc;
+	return valid;
+}
+
+size_t maildir_flags_format(unsigned long long mask, char* buf)
+{
+	static const char letters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	size_t l = 0;
+
+	while (mask) {
+		buf[l++] = letters[__builtin_ctzll(mask)];
+		mask &= mask - 1;
+	}
+	buf[l] = 0;
+
+	return l;
+}
+
+bool maildir_name_flags(const char* fname, unsigned long long* mask)
+{
+	const char* p = strchr(fname, ':');
+
+	*mask = 0;
+	if (!p || p[1] != '2' || p[2] != ',')
+		return false;
+
+	p += 3;
+	/* Dovecot extensions follow a , */
+	return maildir_flags_parse(p, strchrnul(p, ',') - p, mask, NULL);
+}
+
 int message_seen(const char* filename)
 {
 	const char* p = strchr(filename, ':');
 	const char* c;
+	unsigned long long mask;
+
 	if (!p) {/* definitely no flags, so can't be seen */
 		fprintf(stderr, "WARNING: No colon (info delimeter) found in %s.\n", filename);
 		return 0;
@@ -228,161 +560,379 @@ int message_seen(const char* filename)
 				(int)(c-p), p, filename);
 	}
 
-	while (*++c) {
-		if (*c == 'S')
-			return 1;
-		if (*c == ',') /* Dovecot extension, we can terminate here */
-			return 0;
+	/* Dovecot extensions follow a , */
+	++c;
+	maildir_flags_parse(c, strchrnul(c, ',') - c, &mask, NULL);
+	return !!(mask & MAILDIR_FLAG('S'));
+}
+
+struct maildir_move_data {
+	const char* source;
+	const char* target;
+	const char* sub;
+	maildir_move_cb cb;
+	void* data;
+};
+
+/* digit value + 1, 0 for anything that isn't a (hex) digit */
+static const unsigned char name_digits[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/* the end of the run of digits at p, *ok is cleared if the value overflowed */
+static inline
+const char* name_number(const char* p, unsigned base, unsigned long long* v, bool* ok)
+{
+	unsigned d;
+
+	*v = 0;
+	*ok = true;
+	while ((d = name_digits[(unsigned char)*p]) && d <= base) {
+		if (__builtin_mul_overflow(*v, base, v) || __builtin_add_overflow(*v, d - 1, v))
+			*ok = false;
+		++p;
+	}
+	return p;
+}
+
+int maildir_name_parse(const char* fname, struct maildir_name* mn)
+{
+	const char *p, *q, *d, *end;
+	unsigned long long v;
+	bool ok;
+	int found = 0;
+
+	memset(mn, 0, sizeof(*mn));
+
+	p = name_number(fname, 10, &mn->timestamp, &ok);
+	if (p != fname && *p == '.' && ok) {
+		found |= MAILDIR_NAME_TIME;
+
+		/* delivery identifier, up to the next . */
+		d = ++p;
+		while (*p && *p != '.' && *p != ',' && *p != ':') {
+			if (p == d && name_digits[(unsigned char)*p] && name_digits[(unsigned char)*p] <= 10) {
+				/* old style pid or pid_n */
+				p = name_number(p, 10, &v, &ok);
+				if (ok) {
+					mn->pid = v;
+					found |= MAILDIR_NAME_PID;
+				}
+				continue;
+			}
+
+			q = name_number(p + 1, *p == 'V' || *p == 'I' ? 16 : 10, &v, &ok);
+			if (q == p + 1) {
+				++p;
+				continue;
+			}
+			if (!ok) {
+				p = q;
+				continue;
+			}
+
+			switch (*p) {
+			case 'M':
+				mn->usec = v;
+				found |= MAILDIR_NAME_USEC;
+				break;
+			case 'P':
+				mn->pid = v;
+				found |= MAILDIR_NAME_PID;
+				break;
+			case 'V':
+				mn->dev = v;
+				found |= MAILDIR_NAME_DEV;
+				break;
+			case 'I':
+				mn->ino = v;
+				found |= MAILDIR_NAME_INO;
+				break;
+			}
+			p = q;
+		}
+
+		if (*p == '.') {
+			q = ++p;
+			while (*q && *q != ',' && *q != ':')
+				++q;
+			mn->hostoff = p - fname;
+			mn->hostlen = q - p;
+			p = q;
+		}
+	} else {
+		mn->timestamp = 0;
+		p = fname;
+	}
+
+	/* tags are in the unique part, before the info */
+	end = strchrnul(p, ':');
+	mn->uniquelen = end - fname;
+
+	while ((p = memchr(p, ',', end - p))) {
+		++p;
+		if ((p[0] != 'S' && p[0] != 'W') || p[1] != '=')
+			continue;
+
+		q = name_number(p + 2, 10, &v, &ok);
+		if (q == p + 2 || !ok || (q != end && *q != ','))
+			continue;
+
+		if (p[0] == 'S') {
+			found |= MAILDIR_SIZE_S;
+			mn->size = v;
+		} else {
+			found |= MAILDIR_SIZE_W;
+			mn->wsize = v;
+		}
+	}
+
+	if (end[0] == ':' && end[1] == '2' && end[2] == ',') {
+		found |= MAILDIR_NAME_INFO;
+		mn->flagsoff = end + 3 - fname;
+		mn->flagslen = strchrnul(end + 3, ',') - (end + 3);
+	}
+
+	mn->fields = found;
+	return found;
+}
+
+int maildir_name_sizes(const char* fname, unsigned long long* size, unsigned long long* wsize)
+{
+	struct maildir_name mn;
+	int found = maildir_name_parse(fname, &mn);
+
+	if (size)
+		*size = mn.size;
+	if (wsize)
+		*wsize = mn.wsize;
+
+	return found & (MAILDIR_SIZE_S | MAILDIR_SIZE_W);
+}
+
+static
+void maildir_stat_size_done(void* data, const char*, const char*, int err)
+{
+	*(int*)data = err;
+}
+
+void maildir_stat_sizes(struct fsbatch* batch, int dirfd, char* const* names, size_t count,
+		unsigned long long* sizes, int* errs)
+{
+	struct statx stx[STAT_SIZES_CHUNK];
+	size_t base, i, n;
+
+	for (base = 0; base < count; base += n) {
+		n = count - base < STAT_SIZES_CHUNK ? count - base : STAT_SIZES_CHUNK;
+
+		for (i = 0; i < n; ++i) {
+			if (batch) {
+				fsbatch_statx(batch, dirfd, names[base + i], AT_SYMLINK_NOFOLLOW, STATX_SIZE,
+						&stx[i], maildir_stat_size_done, &errs[base + i]);
+			} else {
+				errs[base + i] = statx(dirfd, names[base + i], AT_SYMLINK_NOFOLLOW, STATX_SIZE, &stx[i]) < 0 ? errno : 0;
+			}
+		}
+
+		if (batch)
+			fsbatch_flush(batch);
+
+		for (i = 0; i < n; ++i) {
+			if (!errs[base + i])
+				sizes[base + i] = stx[i].stx_size;
+		}
 	}
-	return 0;
 }
 
-void maildir_move(int sfd, const char* source, int tfd, const char* target, const char* sub, const char* fname, bool dry_run)
+static
+void maildir_move_done(void* _d, const char* fname, const char*, int err)
+{
+	struct maildir_move_data *d = _d;
+
+	if (err)
+		fprintf(stderr, "rename %s/%s/%s -> %s/%s/%s failed: %s\n",
+			d->source, d->sub, fname, d->target, d->sub, fname, strerror(err));
+	if (d->cb)
+		d->cb(d->data, fname, err);
+	free(d);
+}
+
+void maildir_move(struct fsbatch* batch, int sfd, const char* source, int tfd, const char* target, const char* sub, const char* fname, bool dry_run,
+		maildir_move_cb cb, void* data)
 {
 	if (dry_run) {
 		printf("Rename: %s/%s/%s -> %s/%s/%s\n",
 				source, sub, fname, target, sub, fname);
+	} else if (batch) {
+		struct maildir_move_data *d = malloc(sizeof(*d));
+		if (!d) {
+			perror("malloc");
+			exit(1);
+		}
+		d->source = source;
+		d->target = target;
+		d->sub = sub;
+		d->cb = cb;
+		d->data = data;
+		fsbatch_renameat2(batch, sfd, fname, tfd, fname, 0, maildir_move_done, d);
 	} else {
-		if (renameat(sfd, fname, tfd, fname) < 0)
+		int err = renameat(sfd, fname, tfd, fname) < 0 ? errno : 0;
+		if (err)
 			fprintf(stderr, "rename %s/%s/%s -> %s/%s/%s failed: %s\n",
-				source, sub, fname, target, sub, fname, strerror(errno));
+				source, sub, fname, target, sub, fname, strerror(err));
+		if (cb)
+			cb(data, fname, err);
 	}
 }
 
+/* makes sure that there is a \n at or after from, or that no more data is
+ * available, returns the position of the \n or NULL */
 static
-void insert_mail_header(struct mail_header ** headp, char* header, char* value)
-{
-	struct mail_header *insp = (struct mail_header*)find_mail_header(*headp, header);  /* we can safely cast the const away here */
-	if (!insp) {
-		insp = malloc(sizeof(*insp));
-		insp->header = header;
-		insp->value = malloc(sizeof(*insp->value) * 2);
-		insp->value[0] = value;
-		insp->value[1] = NULL;
-		insp->next = *headp;
-		*headp = insp;
-		return;
+const char* mail_headers_line_end(struct mail_headers* mh, size_t from)
+{
+	const char* nl;
+	ssize_t r;
+
+	while (!(nl = (const char*)memchr(mh->buffer + from, '\n', mh->length - from))) {
+		size_t want = mh->length + MAIL_HEADER_CHUNK;
+		if (mh->eof || mh->length == MAIL_HEADER_MAX)
+			return NULL;
+
+		if (want > MAIL_HEADER_MAX)
+			want = MAIL_HEADER_MAX;
+		r = pread(mh->fd, mh->buffer + mh->length, want - mh->length, mh->length);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			mh->error = errno;
+			mh->eof = true;
+		} else if (r == 0) {
+			mh->eof = true;
+		} else {
+			mh->length += r;
+		}
 	}
 
-	free(header);
-	int i = 1;
-	while (insp->value[i])
-		++i;
-	insp->value[i++] = value;
-	if ((i & (i-1)) == 0)
-		insp->value = realloc(insp->value, sizeof(*insp->value) * i * 2); /* if this fails we will segfault */
-	insp->value[i] = NULL;
+	return nl;
 }
 
-struct mail_header* get_mail_header(int sfd, const char* filename)
+int mail_headers_open(struct mail_headers* mh, int dirfd, const char* filename, const char* const* wanted)
 {
-	size_t bfrsize = 8192, slen;
-	char *bfr = NULL, *header = NULL, *value = NULL;
-	int fd = openat(sfd, filename, O_RDONLY);
-	struct mail_header *head = NULL;
+	if (!mh->buffer) {
+		mh->buffer = (char*)malloc(MAIL_HEADER_MAX);
+		if (!mh->buffer)
+			return -1;
+	}
 
-	errno= 0;
+	mh->fd = openat(dirfd, filename, O_RDONLY);
+	if (mh->fd < 0)
+		return -1;
 
-	if (fd < 0)
-		return NULL;
-	FILE* fp = fdopen(fd, "r");
-	if (!fp)
-		goto errout;
-	fd = -1; /* taken over by fp */
+	mh->length = mh->pos = 0;
+	mh->eof = false;
+	mh->error = 0;
+	mh->wanted = wanted;
 
-	bfr = malloc(bfrsize);
-	if (!bfr)
-		goto errout;
+	return 0;
+}
 
-	while (fgets(bfr, bfrsize, fp)) {
-		slen = strlen(bfr);
-		while (bfr[slen-1] != '\n') {
-			if (slen != bfrsize - 1) /* we have a NULL character in the input */
-				goto errout;
+static inline
+bool mail_headers_blank(const char* line, const char* end)
+{
+	return line == end || (*line == '\r' && line + 1 == end);
+}
 
-			char *t = realloc(bfr, bfrsize *= 2);
-			if (!t)
-				goto errout;
-			bfr = t;
+bool mail_headers_next(struct mail_headers* mh, struct mail_header* h)
+{
+	const char *line, *end, *nl, *colon, *next;
+	const char* const* w;
 
-			/* now we're looking to read from the file and append it to the existing slen string */
-			if (!fgets(bfr + slen, bfrsize - slen, fp))
-				goto errout;
+	while (mh->pos < mh->length || !mh->eof) {
+		nl = mail_headers_line_end(mh, mh->pos);
+		line = mh->buffer + mh->pos;
+		end = nl ? nl : mh->buffer + mh->length;
 
-			slen = strlen(bfr);
-		}
+		/* the empty line terminates the headers, we never look at the body */
+		if (mail_headers_blank(line, end))
+			break;
 
-		/* trim trailing \r\n characters */
-		while (slen--) {
-			if (bfr[slen] != '\n' && bfr[slen] != '\r')
+		/* consume continuation lines, as well as lines without a : (which is
+		 * invalid, but those were always treated as part of the preceding
+		 * header) */
+		colon = (const char*)memchr(line, ':', end - line);
+		while (nl) {
+			next = nl + 1;
+			nl = mail_headers_line_end(mh, next - mh->buffer);
+			const char* nend = nl ? nl : mh->buffer + mh->length;
+			if (mail_headers_blank(next, nend) || (*next != ' ' && *next != '\t' && memchr(next, ':', nend - next))) {
+				nl = next - 1;
 				break;
-			bfr[slen] = 0;
+			}
+			end = nend;
 		}
+		mh->pos = (nl ? end + 1 : end) - mh->buffer;
+		if (!nl && mh->length == MAIL_HEADER_MAX)
+			mh->eof = true; /* unreasonably large headers, truncate */
 
-		if (!*bfr)
-			break; /* headers are done */
-
-		if (!isspace(*bfr)) {
-
-			char *v = strchr(bfr, ':');
-			if (v) {
-			/* new header */
-				if (header)
-					insert_mail_header(&head, header, value);
+		/* junk before the first header */
+		if (!colon || *line == ' ' || *line == '\t')
+			continue;
 
-				*v++ = '\0';
-				header = strdup(bfr);
+		h->name = line;
+		h->namelen = colon - line;
 
-				while (isspace(*v))
-					++v;
-
-				value = strdup(v);
-			} else if (header) {
-				// no : - this is outright wrong, assume incorrect/invalid mapping and append to existing buffer.
-				char * t = realloc(value, strlen(value) + strlen(bfr) + 1);
-				if (!t)
+		if (mh->wanted) {
+			for (w = mh->wanted; *w; ++w)
+				if (strncasecmp(*w, h->name, h->namelen) == 0 && !(*w)[h->namelen])
 					break;
-				value = t;
-				strcat(value, bfr);
-			}
-		} else {
-			/* appending to existing header */
-			char * t = realloc(value, strlen(value) + strlen(bfr) + 1);
-			if (!t)
-				break;
-			value = t;
-			strcat(value, bfr);
+			if (!*w)
+				continue;
 		}
+
+		h->value = colon + 1;
+		while (h->value < end && (*h->value == ' ' || *h->value == '\t'))
+			++h->value;
+		if (end > h->value && end[-1] == '\r')
+			--end;
+		h->valuelen = end - h->value;
+
+		return true;
 	}
-errout:
-	if (header)
-		insert_mail_header(&head, header, value);
 
-	if (fp)
-		fclose(fp);
-	if (fd >= 0)
-		close(fd);
-	if (bfr)
-		free(bfr);
+	mh->pos = mh->length;
+	mh->eof = true;
+	return false;
+}
+
+size_t mail_header_unfold(const struct mail_header* h, char* buf, size_t bufsize)
+{
+	const char *p = h->value, *end = h->value + h->valuelen;
+	size_t len = 0;
+
+	if (!bufsize)
+		return 0;
+
+	for ( ; p < end && len < bufsize - 1; ++p)
+		if (*p != '\r' && *p != '\n')
+			buf[len++] = *p;
+	buf[len] = 0;
 
-	return head;
+	return len;
 }
 
-const struct mail_header* find_mail_header(const struct mail_header* head, const char* header)
+void mail_headers_close(struct mail_headers* mh)
 {
-	while (head) {
-		if (strcasecmp(head->header, header) == 0)
-			break;
-		head = head->next;
-	}
-	return head;
+	if (mh->fd >= 0)
+		close(mh->fd);
+	mh->fd = -1;
 }
 
-void free_mail_header(struct mail_header* head)
+void mail_headers_free(struct mail_headers* mh)
 {
-	while (head) {
-		struct mail_header *next = head->next;
-		free(head);
-		head = next;
-	}
+	mail_headers_close(mh);
+	free(mh->buffer);
+	mh->buffer = NULL;
 }
@@ -0,0 +1,387 @@
+#include "fsbatch.h"
+
+#define _GNU_SOURCE
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#define FSBATCH_MAX_DEPTH		4096
+
+struct fsbatch_op {
+	char *oldpath;
+	char *newpath;
+	fsbatch_cb cb;
+	void *data;
+	unsigned next_free;
+};
+
+struct fsbatch {
+	unsigned depth;
+	int ring_fd; /* < 0 if synchronous */
+
+	/* submission ring */
+	void *sq_ptr;
+	size_t sq_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	/* completion ring */
+	void *cq_ptr;
+	size_t cq_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned queued; /* added to the sq, but not yet submitted */
+	unsigned inflight; /* submitted, not yet reaped */
+
+	struct fsbatch_op *ops;
+	unsigned free_op; /* head of free list, depth if empty */
+};
+
+static
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static
+bool fsbatch_probe(int ring_fd)
+{
+	static const unsigned char required[] = { IORING_OP_RENAMEAT, IORING_OP_UNLINKAT, IORING_OP_STATX };
+	size_t psize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, psize);
+	bool ok = true;
+	unsigned i;
+
+	if (!probe)
+		return false;
+
+	if (sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		ok = false;
+	} else {
+		for (i = 0; ok && i < sizeof(required); ++i)
+			ok = required[i] <= probe->last_op && (probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	free(probe);
+	return ok;
+}
+
+static
+bool fsbatch_setup_ring(struct fsbatch* b)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	b->ring_fd = sys_io_uring_setup(b->depth, &p);
+	if (b->ring_fd < 0)
+		return false;
+
+	if (!fsbatch_probe(b->ring_fd))
+		goto fail;
+
+	b->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	b->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (b->cq_size > b->sq_size)
+			b->sq_size = b->cq_size;
+		b->cq_size = 0; /* marker that cq_ptr == sq_ptr */
+	}
+
+	b->sq_ptr = mmap(NULL, b->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			b->ring_fd, IORING_OFF_SQ_RING);
+	if (b->sq_ptr == MAP_FAILED)
+		goto fail;
+
+	if (b->cq_size) {
+		b->cq_ptr = mmap(NULL, b->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				b->ring_fd, IORING_OFF_CQ_RING);
+		if (b->cq_ptr == MAP_FAILED)
+			goto fail_sq;
+	} else {
+		b->cq_ptr = b->sq_ptr;
+	}
+
+	b->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	b->sqes = mmap(NULL, b->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			b->ring_fd, IORING_OFF_SQES);
+	if (b->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	b->sq_head = (unsigned*)((char*)b->sq_ptr + p.sq_off.head);
+	b->sq_tail = (unsigned*)((char*)b->sq_ptr + p.sq_off.tail);
+	b->sq_mask = (unsigned*)((char*)b->sq_ptr + p.sq_off.ring_mask);
+	b->sq_array = (unsigned*)((char*)b->sq_ptr + p.sq_off.array);
+
+	b->cq_head = (unsigned*)((char*)b->cq_ptr + p.cq_off.head);
+	b->cq_tail = (unsigned*)((char*)b->cq_ptr + p.cq_off.tail);
+	b->cq_mask = (unsigned*)((char*)b->cq_ptr + p.cq_off.ring_mask);
+	b->cqes = (struct io_uring_cqe*)((char*)b->cq_ptr + p.cq_off.cqes);
+
+	/* the kernel may round up, but we never have more than depth ops */
+	return true;
+
+fail_cq:
+	if (b->cq_size)
+		munmap(b->cq_ptr, b->cq_size);
+fail_sq:
+	munmap(b->sq_ptr, b->sq_size);
+fail:
+	close(b->ring_fd);
+	b->ring_fd = -1;
+	return false;
+}
+
+struct fsbatch* fsbatch_new(unsigned depth)
+{
+	static bool warned = false;
+	struct fsbatch *b = calloc(1, sizeof(*b));
+	unsigned i;
+
+	if (!b) {
+		perror("calloc");
+		exit(1);
+	}
+
+	b->ring_fd = -1;
+	b->depth = depth;
+
+	if (!depth)
+		return b;
+
+	if (!fsbatch_setup_ring(b)) {
+		/* callers may create many batches, only mention it once */
+		if (!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+			fprintf(stderr, "io_uring not available, falling back to synchronous operations.\n");
+		b->depth = 0;
+		return b;
+	}
+
+	b->ops = calloc(depth, sizeof(*b->ops));
+	if (!b->ops) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < depth; ++i)
+		b->ops[i].next_free = i + 1;
+	b->free_op = 0;
+
+	return b;
+}
+
+static
+void fsbatch_reap(struct fsbatch* b)
+{
+	unsigned head = *b->cq_head;
+
+	while (head != __atomic_load_n(b->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &b->cqes[head & *b->cq_mask];
+		struct fsbatch_op *op = &b->ops[cqe->user_data];
+
+		if (op->cb)
+			op->cb(op->data, op->oldpath, op->newpath, cqe->res < 0 ? -cqe->res : 0);
+
+		free(op->oldpath);
+		free(op->newpath);
+		op->oldpath = op->newpath = NULL;
+		op->next_free = b->free_op;
+		b->free_op = op - b->ops;
+		--b->inflight;
+
+		++head;
+	}
+
+	__atomic_store_n(b->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* submit whatever is queued, and wait for at least min_complete completions */
+static
+void fsbatch_enter(struct fsbatch* b, unsigned min_complete)
+{
+	while (b->queued || min_complete) {
+		int r = sys_io_uring_enter(b->ring_fd, b->queued, min_complete,
+				min_complete ? IORING_ENTER_GETEVENTS : 0);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				fsbatch_reap(b);
+				continue;
+			}
+			perror("io_uring_enter");
+			exit(1);
+		}
+		b->inflight += r;
+		b->queued -= r;
+
+		unsigned before = b->inflight;
+		fsbatch_reap(b);
+		min_complete = before - b->inflight >= min_complete ? 0 : min_complete - (before - b->inflight);
+	}
+	fsbatch_reap(b);
+}
+
+static
+struct io_uring_sqe* fsbatch_get_sqe(struct fsbatch* b, const char* oldpath, const char* newpath,
+		fsbatch_cb cb, void* data)
+{
+	struct fsbatch_op *op;
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	/* no free op slots, need to wait for completions */
+	if (b->free_op == b->depth)
+		fsbatch_enter(b, 1);
+
+	op = &b->ops[b->free_op];
+	b->free_op = op->next_free;
+
+	op->oldpath = strdup(oldpath);
+	op->newpath = newpath ? strdup(newpath) : NULL;
+	if (!op->oldpath || (newpath && !op->newpath)) {
+		perror("strdup");
+		exit(1);
+	}
+	op->cb = cb;
+	op->data = data;
+
+	tail = *b->sq_tail;
+	idx = tail & *b->sq_mask;
+	sqe = &b->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = op - b->ops;
+	b->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+static
+void fsbatch_commit_sqe(struct fsbatch* b)
+{
+	__atomic_store_n(b->sq_tail, *b->sq_tail + 1, __ATOMIC_RELEASE);
+	if (++b->queued + b->inflight >= b->depth)
+		fsbatch_enter(b, 0);
+}
+
+void fsbatch_renameat2(struct fsbatch* b, int olddirfd, const char* oldpath,
+		int newdirfd, const char* newpath, unsigned flags, fsbatch_cb cb, void* data)
+{
+	struct io_uring_sqe *sqe;
+
+	if (b->ring_fd < 0) {
+		int r = renameat2(olddirfd, oldpath, newdirfd, newpath, flags);
+		if (cb)
+			cb(data, oldpath, newpath, r < 0 ? errno : 0);
+		return;
+	}
+
+	sqe = fsbatch_get_sqe(b, oldpath, newpath, cb, data);
+	sqe->opcode = IORING_OP_RENAMEAT;
+	sqe->fd = olddirfd;
+	sqe->addr = (unsigned long)b->ops[sqe->user_data].oldpath;
+	sqe->len = newdirfd;
+	sqe->addr2 = (unsigned long)b->ops[sqe->user_data].newpath;
+	sqe->rename_flags = flags;
+	fsbatch_commit_sqe(b);
+}
+
+void fsbatch_unlinkat(struct fsbatch* b, int dirfd, const char* path, int flags,
+		fsbatch_cb cb, void* data)
+{
+	struct io_uring_sqe *sqe;
+
+	if (b->ring_fd < 0) {
+		int r = unlinkat(dirfd, path, flags);
+		if (cb)
+			cb(data, path, NULL, r < 0 ? errno : 0);
+		return;
+	}
+
+	sqe = fsbatch_get_sqe(b, path, NULL, cb, data);
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd = dirfd;
+	sqe->addr = (unsigned long)b->ops[sqe->user_data].oldpath;
+	sqe->unlink_flags = flags;
+	fsbatch_commit_sqe(b);
+}
+
+void fsbatch_statx(struct fsbatch* b, int dirfd, const char* path, int flags, unsigned mask,
+		struct statx* buf, fsbatch_cb cb, void* data)
+{
+	struct io_uring_sqe *sqe;
+
+	if (b->ring_fd < 0) {
+		int r = statx(dirfd, path, flags, mask, buf);
+		if (cb)
+			cb(data, path, NULL, r < 0 ? errno : 0);
+		return;
+	}
+
+	sqe = fsbatch_get_sqe(b, path, NULL, cb, data);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (unsigned long)b->ops[sqe->user_data].oldpath;
+	sqe->len = mask;
+	sqe->off = (unsigned long)buf;
+	sqe->statx_flags = flags;
+	fsbatch_commit_sqe(b);
+}
+
+void fsbatch_flush(struct fsbatch* b)
+{
+	if (b->ring_fd < 0)
+		return;
+
+	while (b->queued || b->inflight)
+		fsbatch_enter(b, b->queued + b->inflight);
+}
+
+void fsbatch_free(struct fsbatch* b)
+{
+	if (!b)
+		return;
+
+	if (b->ring_fd >= 0) {
+		fsbatch_flush(b);
+		munmap(b->sqes, b->sqes_size);
+		if (b->cq_size)
+			munmap(b->cq_ptr, b->cq_size);
+		munmap(b->sq_ptr, b->sq_size);
+		close(b->ring_fd);
+	}
+
+	free(b->ops);
+	free(b);
+}
+
+unsigned fsbatch_parse_depth(const char* arg)
+{
+	char *endp;
+	unsigned long d = strtoul(arg, &endp, 10);
+
+	if (!*arg || *endp || d > FSBATCH_MAX_DEPTH) {
+		fprintf(stderr, "Invalid batch depth %s (must be 0 to %d).\n", arg, FSBATCH_MAX_DEPTH);
+		exit(1);
+	}
+
+	return d;
+}
@@ -0,0 +1,139 @@
+#include "hash64.h"
+
+#include <string.h>
+
+#define P1	11400714785074694791ULL
+#define P2	14029467366897019727ULL
+#define P3	1609587929392839161ULL
+#define P4	9650029242287828579ULL
+#define P5	2870177450012600261ULL
+
+static inline
+unsigned long long rotl64(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline
+unsigned long long read64(const unsigned char* p)
+{
+	unsigned long long v;
+	memcpy(&v, p, sizeof(v)); /* little endian hosts only, this isn't a portable digest */
+	return v;
+}
+
+static inline
+unsigned read32(const unsigned char* p)
+{
+	unsigned v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline
+unsigned long long hash64_round(unsigned long long acc, unsigned long long input)
+{
+	acc += input * P2;
+	acc = rotl64(acc, 31);
+	return acc * P1;
+}
+
+static inline
+unsigned long long hash64_merge(unsigned long long acc, unsigned long long v)
+{
+	acc ^= hash64_round(0, v);
+	return acc * P1 + P4;
+}
+
+/* consumes as many whole 32 byte stripes as possible, returns the number of bytes used */
+static
+size_t hash64_stripes(struct hash64* h, const unsigned char* p, size_t len)
+{
+	const unsigned char* start = p;
+
+	while (len >= 32) {
+		h->v[0] = hash64_round(h->v[0], read64(p));
+		h->v[1] = hash64_round(h->v[1], read64(p + 8));
+		h->v[2] = hash64_round(h->v[2], read64(p + 16));
+		h->v[3] = hash64_round(h->v[3], read64(p + 24));
+		p += 32;
+		len -= 32;
+	}
+
+	return p - start;
+}
+
+void hash64_init(struct hash64* h)
+{
+	memset(h, 0, sizeof(*h));
+	h->v[0] = P1 + P2;
+	h->v[1] = P2;
+	h->v[2] = 0;
+	h->v[3] = -P1;
+}
+
+void hash64_update(struct hash64* h, const void* data, size_t len)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	size_t used;
+
+	h->total += len;
+
+	if (h->memsize) {
+		used = 32 - h->memsize < len ? 32 - h->memsize : len;
+		memcpy(h->mem + h->memsize, p, used);
+		h->memsize += used;
+		p += used;
+		len -= used;
+		if (h->memsize < 32)
+			return;
+		hash64_stripes(h, h->mem, 32);
+		h->memsize = 0;
+	}
+
+	used = hash64_stripes(h, p, len);
+	memcpy(h->mem, p + used, len - used);
+	h->memsize = len - used;
+}
+
+unsigned long long hash64_final(const struct hash64* h)
+{
+	const unsigned char* p = h->mem;
+	const unsigned char* end = h->mem + h->memsize;
+	unsigned long long r;
+
+	if (h->total >= 32) {
+		r = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+		r = hash64_merge(r, h->v[0]);
+		r = hash64_merge(r, h->v[1]);
+		r = hash64_merge(r, h->v[2]);
+		r = hash64_merge(r, h->v[3]);
+	} else {
+		r = h->v[2] + P5; /* v[2] is still the seed */
+	}
+
+	r += h->total;
+
+	while (p + 8 <= end) {
+		r ^= hash64_round(0, read64(p));
+		r = rotl64(r, 27) * P1 + P4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		r ^= read32(p) * P1;
+		r = rotl64(r, 23) * P2 + P3;
+		p += 4;
+	}
+	while (p < end) {
+		r ^= *p++ * P5;
+		r = rotl64(r, 11) * P1;
+	}
+
+	r ^= r >> 33;
+	r *= P2;
+	r ^= r >> 29;
+	r *= P3;
+	r ^= r >> 32;
+
+	return r;
+}
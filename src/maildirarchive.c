@@ -15,72 +15,68 @@
 #include <ctype.h>
 
 #include "servertypes.h"
+#include "filetools.h"
+#include "datetools.h"
+#include "strmap.h"
+#include "fsbatch.h"
+#include "workqueue.h"
 
 #define lerror(fmt, ...) fprintf(stderr, fmt ": %s.\n", ##__VA_ARGS__, strerror(errno))
 
 #define DEFAULT_MAXAGE		"1 year ago"
+#define DEFAULT_MAX_OPEN	128
 
 static const char* progname = NULL;
 static int dry_run = 0;
 static const char * subsources[] = { "new", "cur", NULL };
 
-static
-time_t maxage2time(const char* maxage)
-{
-	int p[2]; // 0 read, 1 write.
-	FILE* fp;
-	pid_t pid;
-	time_t res = 0;
-	if (pipe(p) < 0) {
-		perror("pipe");
-		exit(1);
-	}
-
-	pid = fork();
-	if (pid < -1) {
-		perror("fork");
-		exit(1);
-	}
-
-	if (pid == 0) {
-		char* args[] = {
-			"date",
-			"+%s",
-			"-d",
-			strdupa(maxage),
-			NULL,
-		};
-		/* stdin */
-		int t = open("/dev/null", O_RDONLY);
-		dup2(t, 0);
-		close(t);
-		/* stdout */
-		dup2(p[1], 1);
-		/* read end */
-		close(p[0]);
-
-		execvp(*args, args);
-		perror("execvp(date)");
-		exit(1);
-	}
-
-	close(p[1]);
-	fp =  fdopen(p[0], "r");
-	if (fscanf(fp, "%lu", &res) != 1) {
-		fprintf(stderr, "Error reading from date sub-process.\n");
-		exit(1);
-	}
-	fclose(fp);
-
-	printf("Archiving email older than: %s", ctime(&res));
-
-	return res;
-}
-
+/* shared (read only) by all mailboxes once the options have been parsed */
+static const char* sourcefolder = NULL, *format = NULL;
+static time_t maxage = 0;
+static unsigned rename_flags = RENAME_NOREPLACE;
+static unsigned batch_depth = 0;
+static size_t max_open = DEFAULT_MAX_OPEN;
+static bool subscribe = false;
+static unsigned jobs = 1;
+
+/* set once a mailbox failed, no further mailboxes are started */
+static bool stop = false;
+
+static struct {
+	unsigned long mailboxes, archived, failed;
+} total;
+
+/* Target folders are kept open (along with their new/ and cur/) in a hashed
+ * LRU cache bounded to max_open folders.  Entries are never removed from the
+ * map, evicted entries merely have their fds closed. */
 struct folder_cache_entry {
-	char *foldername;
+	const char *foldername; /* key in folder_cache.map */
 	int folderfd;
-	struct folder_cache_entry *next;
+	int subfd[2]; /* indexed as subsources */
+	struct folder_cache_entry *prev, *next; /* open entries, most recently used first */
+};
+
+struct folder_cache {
+	struct strmap map;
+	struct folder_cache_entry *head, *tail;
+	size_t open;
+	unsigned long hits, misses, evictions;
+	struct fsbatch *batch; /* flushed before fds are closed */
+};
+
+/* A single mailbox (root_folder), processed on a worker thread with --jobs,
+ * with its stdout output collected in report and output in order. */
+struct archive_job {
+	char *base;
+	char *sourcename;
+	FILE *out;
+	char *report;
+	size_t reportlen;
+	struct folder_cache cache;
+	struct fsbatch *batch;
+	bool rename_einval;
+	unsigned long archived, failed;
+	int ret;
 };
 
 static
@@ -99,92 +95,419 @@ bool valid_foldername(const char* fldrname)
 	return true;
 }
 
+/* opens fldrname (in base), creating it if it doesn't exist */
 static
-int get_folderfd(const char* fldrname, int basefd, struct maildir_type_list* stype)
+int open_folder(const char* base, const char* fldrname, int basefd, struct maildir_type_list* stype)
 {
-	// keep re-sorting according to most recently used, on the assumption that
-	// we will typically get files linked into the dirent tree in some ordering
-	// based on date/time, resulting in least recently used being most
-	// required.  This could be very wrong.  But we also don't expect more than
-	// a few tens of entries here.
-	static struct folder_cache_entry *head = NULL;
-
-	if (!fldrname) {
-		while (head) {
-			struct folder_cache_entry *tmp = head->next;
-			free(head->foldername);
-			close(head->folderfd);
-			free(head);
-			head = tmp;
+	int fd = openat(basefd, fldrname, O_RDONLY);
+	if (fd >= 0 || errno != ENOENT)
+		return fd;
+
+	mode_t m = 0700;
+	uid_t u = 0;
+	gid_t g = 0;
+	struct stat st;
+	if (fstat(basefd, &st) == 0) {
+		m = st.st_mode; /* attempt to clone from parent */
+		if (geteuid() == 0) {
+			/* we can chown() */
+			u = st.st_uid;
+			g = st.st_gid;
 		}
+	}
+	if (mkdirat(basefd, fldrname, m) < 0)
 		return -1;
+	if (u || g)
+		fchownat(basefd, fldrname, u, g, 0);
+	fd = openat(basefd, fldrname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	while (stype) {
+		if (stype->type->imap_subscribe) {
+			if (!stype->pvt && stype->type->open)
+				stype->pvt = stype->type->open(base, basefd);
+			if (stype->pvt)
+				stype->type->imap_subscribe(stype->pvt, fldrname);
+		}
+		stype = stype->next;
+	}
+
+#define mksub(x)	do { if (mkdirat(fd, x, m) < 0) { close(fd); return -1; } if (u || g) fchownat(fd, x, u, g, 0); } while(0)
+	mksub("cur");
+	mksub("new");
+	mksub("tmp");
+#undef mksub
+
+	int t = openat(fd, "maildirfolder", O_CREAT, 0600);
+	if (t >= 0) {
+		fchownat(t, "", u, g, AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH);
+		close(t);
+	}
+
+	return fd;
+}
+
+static
+void folder_cache_unlink(struct folder_cache* fc, struct folder_cache_entry* ce)
+{
+	if (ce->prev)
+		ce->prev->next = ce->next;
+	else
+		fc->head = ce->next;
+	if (ce->next)
+		ce->next->prev = ce->prev;
+	else
+		fc->tail = ce->prev;
+	ce->prev = ce->next = NULL;
+}
+
+static
+void folder_cache_close(struct folder_cache* fc, struct folder_cache_entry* ce)
+{
+	folder_cache_unlink(fc, ce);
+	for (size_t i = 0; i < sizeof(ce->subfd) / sizeof(*ce->subfd); ++i) {
+		if (ce->subfd[i] >= 0)
+			close(ce->subfd[i]);
+		ce->subfd[i] = -1;
+	}
+	close(ce->folderfd);
+	ce->folderfd = -1;
+	--fc->open;
+}
+
+/* returns NULL with errno set on failure */
+static
+struct folder_cache_entry* get_folder(struct folder_cache* fc, const char* base, const char* fldrname, int basefd, struct maildir_type_list* stype)
+{
+	struct folder_cache_entry *ce;
+	bool created;
+	struct strmap_entry *e = strmap_insert(&fc->map, fldrname, strlen(fldrname), &created);
+
+	if (created) {
+		e->value = ce = strmap_alloc(&fc->map, sizeof(*ce));
+		ce->foldername = e->key;
+		ce->folderfd = ce->subfd[0] = ce->subfd[1] = -1;
+		ce->prev = ce->next = NULL;
+	} else {
+		ce = e->value;
+	}
+
+	if (ce->folderfd >= 0) {
+		++fc->hits;
+		if (ce == fc->head)
+			return ce;
+		folder_cache_unlink(fc, ce);
 	} else {
-		struct folder_cache_entry *cur, **_cur;
-		for (_cur = &head; *_cur; _cur = &(*_cur)->next) {
-			cur = *_cur;
-			if (strcmp(cur->foldername, fldrname) == 0) {
-				*_cur = cur->next;
-				cur->next = head;
-				head = cur;
-				return cur->folderfd;
+		++fc->misses;
+		if (fc->open >= max_open) {
+			/* queued renames may still reference the fds */
+			if (fc->batch)
+				fsbatch_flush(fc->batch);
+			++fc->evictions;
+			folder_cache_close(fc, fc->tail);
+		}
+
+		ce->folderfd = open_folder(base, fldrname, basefd, stype);
+		if (ce->folderfd < 0)
+			return NULL;
+		for (size_t i = 0; i < sizeof(ce->subfd) / sizeof(*ce->subfd); ++i) {
+			ce->subfd[i] = openat(ce->folderfd, subsources[i], O_RDONLY | O_DIRECTORY);
+			if (ce->subfd[i] < 0) {
+				int err = errno;
+				while (i)
+					close(ce->subfd[--i]);
+				close(ce->folderfd);
+				ce->folderfd = ce->subfd[0] = ce->subfd[1] = -1;
+				errno = err;
+				return NULL;
 			}
 		}
-		// no matching entry found
-		int fd = openat(basefd, fldrname, O_RDONLY);
-		if (fd < 0) {
-			if (errno != ENOENT)
-				return -1;
-
-			mode_t m = 0700;
-			uid_t u = 0;
-			gid_t g = 0;
-			struct stat st;
-			if (fstat(basefd, &st) == 0) {
-				m = st.st_mode; /* attempt to clone from parent */
-				if (geteuid() == 0) {
-					/* we can chown() */
-					u = st.st_uid;
-					g = st.st_gid;
-				}
+		++fc->open;
+	}
+
+	ce->next = fc->head;
+	if (ce->next)
+		ce->next->prev = ce;
+	else
+		fc->tail = ce;
+	fc->head = ce;
+
+	return ce;
+}
+
+/* closes everything, and releases the cache */
+static
+void folder_cache_flush(struct folder_cache* fc, FILE* out)
+{
+	if (fc->hits || fc->misses)
+		fprintf(out, "Target folder cache: %lu hits, %lu misses, %lu evictions.\n",
+				fc->hits, fc->misses, fc->evictions);
+
+	if (fc->batch)
+		fsbatch_flush(fc->batch);
+	while (fc->head)
+		folder_cache_close(fc, fc->head);
+	strmap_free(&fc->map);
+	fc->hits = fc->misses = fc->evictions = 0;
+}
+
+struct archive_move {
+	struct archive_job *job;
+	const char *sfn;
+	int tfd;
+	char tfname[];
+};
+
+static
+void archive_move_done(void* _m, const char* fname, const char*, int err)
+{
+	struct archive_move *m = _m;
+	struct archive_job *job = m->job;
+	struct stat st;
+
+	if (err) {
+		fprintf(stderr, "%s/%s/%s => %s/%s/%s/: %s.\n",
+				job->sourcename, m->sfn, fname, job->base, m->tfname, m->sfn, strerror(err));
+		if ((rename_flags & RENAME_NOREPLACE) != 0 && err == EINVAL &&
+				fstatat(m->tfd, fname, &st, 0) == -1 && errno == ENOENT)
+			job->rename_einval = true;
+		job->failed++;
+	} else {
+		job->archived++;
+	}
+	free(m);
+}
+
+static
+void print_summary(FILE* out, const char* name, unsigned long archived, unsigned long failed)
+{
+	fprintf(out, "%s: %lu messages %s", name, archived,
+			dry_run ? "would be archived" : "archived");
+	fprintf(out, failed ? " (%lu failed).\n" : ".\n", failed);
+}
+
+static
+int archive(struct archive_job* job)
+{
+	int basefd, sfd = -1, ret = 1;
+	const char *base = job->base;
+	struct maildir_type_list* stype = NULL;
+	struct stat st;
+	struct tm tm;
+
+	basefd = open(base, O_RDONLY /*dry_run ? O_RDONLY : O_RDWR */); // TODO: Do we need WR for mkdirat()?
+	if (basefd < 0) {
+		perror(base);
+		return 1;
+	}
+
+	if (subscribe) {
+		stype = maildir_find_type(base);
+		if (!stype) {
+			fprintf(stderr, "%s: We need to be able to determine the folder type if we're to auto-subscribe.\n", base);
+			goto out;
+		}
+	}
+
+	if (sourcefolder) {
+		asprintf(&job->sourcename, "%s/%s", base, sourcefolder);
+		sfd = openat(basefd, sourcefolder, O_RDONLY);
+		if (sfd < 0) {
+			perror(job->sourcename);
+			goto out;
+		}
+	} else {
+		job->sourcename = strdup(base);
+		sfd = dup(basefd);
+	}
+	const char *sourcename = job->sourcename;
+
+	if (batch_depth && !dry_run)
+		job->batch = job->cache.batch = fsbatch_new(batch_depth);
+
+	for (const char * const *_sfn = subsources; *_sfn; ++_sfn) {
+		const char* sfn = *_sfn;
+		struct maildir_name mn;
+		struct dirscan *dir = dirscan_openat(sfd, sfn);
+		if (!dir) {
+			lerror("%s/%s", sourcename, sfn);
+			continue;
+		}
+		int cfd = dirscan_fd(dir);
+		struct dirscan_entry *de;
+
+		fprintf(job->out, "Archiving from %s/%s\n", sourcename, sfn);
+		while (!job->rename_einval && (de = dirscan_next(dir))) {
+			time_t filetime;
+			char tfname[256];
+
+			if (*de->name == '.')
+				continue;
+			if (de->type == DT_UNKNOWN) {
+				static int warned = 0;
+				if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+					fprintf(stderr, "getdents() doesn't provide d_type, assuming everything is files to avoid costly stat() calls.\n");
+			} else if (de->type != DT_REG)
+				continue; /* we only care about files, stuff here must be files */
+
+			// filename should be structured as seconds_since_epoch.stuff, so we care
+			// about the seconds here portion only.
+			if (!(maildir_name_parse(de->name, &mn) & MAILDIR_NAME_TIME)) {
+				fprintf(stderr, "Failed to extra timestamp from %s/%s/%s\n", sourcename, sfn, de->name);
+				continue;
 			}
-			if (mkdirat(basefd, fldrname, m) < 0)
-				return -1;
-			if (u || g)
-				fchownat(basefd, fldrname, u, g, 0);
-			fd = openat(basefd, fldrname, O_RDONLY);
-			if (fd < 0)
-				return -1;
-
-			while (stype) {
-				if (stype->type->imap_subscribe) {
-					if (!stype->pvt && stype->type->open)
-						stype->pvt = stype->type->open(fldrname, basefd);
-					if (stype->pvt)
-						stype->type->imap_subscribe(stype->pvt, fldrname);
-				}
-				stype = stype->next;
+			filetime = mn.timestamp;
+
+			if (filetime >= maxage) {
+				/* file is too young */
+				continue;
 			}
 
-#define mksub(x)	do { if (mkdirat(fd, x, m) < 0) { close(fd); return -1; } if (u || g) fchownat(fd, x, u, g, 0); } while(0)
-			mksub("cur");
-			mksub("new");
-			mksub("tmp");
-#undef mksub
+			if (!strftime(tfname, sizeof(tfname), format, localtime_r(&filetime, &tm)) || !valid_foldername(tfname)) {
+				fprintf(stderr, "Error generating valid foldername from %s (%lu).  Cannot proceed\n", de->name, filetime);
+				continue;
+			}
 
-			int t = openat(fd, "maildirfolder", O_CREAT, 0600);
-			if (t >= 0) {
-				fchownat(t, "", u, g, AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH);
-				close(t);
+			if (dry_run) {
+				fprintf(job->out, "%s/%s/%s => %s/%s/%s/\n",
+						sourcename, sfn, de->name, base, tfname, sfn);
+				job->archived++;
+				continue;
+			}
+
+			struct folder_cache_entry *tce = get_folder(&job->cache, base, tfname, basefd, stype);
+			if (!tce) {
+				lerror("%s/%s", base, tfname);
+				job->failed++;
+				continue;
+			}
+			int tfd = tce->subfd[_sfn - subsources];
+
+			if ((rename_flags & RENAME_NOREPLACE) == 0) {
+				if (fstatat(tfd, de->name, &st, 0) == 0) {
+					errno = EEXIST;
+					lerror("%s/%s/%s => %s/%s/%s/ (stat)",
+						sourcename, sfn, de->name, base, tfname, sfn);
+					job->failed++;
+					continue;
+				} else if (errno != ENOENT) {
+					lerror("%s/%s/%s => %s/%s/%s/ (stat)",
+						sourcename, sfn, de->name, base, tfname, sfn);
+					job->failed++;
+					continue;
+				}
+			}
+
+			if (job->batch) {
+				struct archive_move *m = malloc(sizeof(*m) + strlen(tfname) + 1);
+				if (!m) {
+					perror("malloc");
+					exit(1);
+				}
+				m->job = job;
+				m->sfn = sfn;
+				m->tfd = tfd;
+				strcpy(m->tfname, tfname);
+				fsbatch_renameat2(job->batch, cfd, de->name, tfd, de->name, rename_flags, archive_move_done, m);
+			} else if (renameat2(cfd, de->name, tfd, de->name, rename_flags) < 0) {
+				lerror("%s/%s/%s => %s/%s/%s/",
+						sourcename, sfn, de->name, base, tfname, sfn);
+				if ((rename_flags & RENAME_NOREPLACE) != 0 && errno == EINVAL &&
+					fstatat(tfd, de->name, &st, 0) == -1 && errno == ENOENT)
+					job->rename_einval = true;
+				job->failed++;
+			} else {
+				job->archived++;
 			}
 		}
+		/* the queued renames reference cfd, and may yet fail with EINVAL */
+		if (job->batch)
+			fsbatch_flush(job->batch);
+		dirscan_close(dir); /* also closes cfd */
+
+		if (job->rename_einval) {
+			fprintf(stderr, "We received EINVAL on rename using RENAME_NOREPLACE.  Possibly the filesystem doesn't like this, so please retry using (potentially dangerous) -R.\n");
+			goto out;
+		}
+	}
 
-		struct folder_cache_entry * ce = malloc(sizeof(*ce));
-		ce->foldername = strdup(fldrname);
-		ce->folderfd = fd;
-		ce->next = head;
-		head = ce;
-		return ce->folderfd;
+	ret = 0;
+out:
+	folder_cache_flush(&job->cache, job->out);
+	fsbatch_free(job->batch);
+	job->batch = job->cache.batch = NULL;
+
+	if (sfd >= 0) {
+		print_summary(job->out, job->sourcename, job->archived, job->failed);
+		close(sfd);
 	}
+	/* pending subscriptions are written out on close, through basefd */
+	if (stype)
+		maildir_type_list_free(stype);
+	close(basefd);
+
+	return ret;
+}
+
+/* runs on worker threads */
+static
+void archive_work(void* _job, void*)
+{
+	struct archive_job *job = _job;
+
+	if (jobs <= 1) {
+		/* no need to buffer, output as we go */
+		job->out = stdout;
+	} else if (!(job->out = open_memstream(&job->report, &job->reportlen))) {
+		perror("open_memstream");
+		exit(1);
+	}
+
+	job->ret = archive(job);
+
+	if (job->out != stdout)
+		fclose(job->out);
+}
+
+/* runs in push order on the main thread */
+static
+void archive_done(void* _job, void*)
+{
+	struct archive_job *job = _job;
+
+	if (job->report) {
+		fwrite(job->report, 1, job->reportlen, stdout);
+		fflush(stdout);
+	}
+
+	total.mailboxes++;
+	total.archived += job->archived;
+	total.failed += job->failed;
+	if (job->ret)
+		stop = true;
+
+	free(job->report);
+	free(job->sourcename);
+	free(job->base);
+	free(job);
+}
+
+static
+bool queue_mailbox(void* wq, const char* base)
+{
+	if (stop)
+		return false;
+
+	struct archive_job *job = calloc(1, sizeof(*job));
+	if (!job || !(job->base = strdup(base))) {
+		perror("malloc");
+		exit(1);
+	}
+	job->cache.map = (struct strmap)STRMAP_INIT;
+
+	workqueue_push(wq, job);
+	return true;
 }
 
 static
@@ -208,15 +531,28 @@ void __attribute__((noreturn)) usage(int x)
 	fprintf(o, "  -s|--sourcefolder sourcefolder\n");
 	fprintf(o, "    If archiving should be performed on a source subfolder rather than INBOX\n");
 	fprintf(o, "  -m|--maxage string\n");
-	fprintf(o, "    Maximum age of emails to retain in source folder, this is passed to the\n");
-	fprintf(o, "    date CLI tool using date -d 'string' - so please verify this usage.\n");
+	fprintf(o, "    Maximum age of emails to retain in source folder, as understood by date -d 'string',\n");
+	fprintf(o, "    eg '90 days ago', '2020-01-31' or '@1580428800' (uncommon forms are passed to date).\n");
 	fprintf(o, "    defaults to '%s'.\n", DEFAULT_MAXAGE);
 	fprintf(o, "  -R|--replace\n");
 	fprintf(o, "    Do NOT use REPLACE_NOREPLACE.  This option can potentially destroy email,\n");
 	fprintf(o, "    as an extra safety a stat() call will be made prior to rename, and if the\n");
 	fprintf(o, "    target file exists will be skipped.  This is racey, not to mention bad for performance.\n");
+	fprintf(o, "  -b|--batch depth\n");
+	fprintf(o, "    Use io_uring to queue up to depth renames at a time rather than performing them\n");
+	fprintf(o, "    one by one (falls back to synchronous renames if io_uring is unavailable).\n");
+	fprintf(o, "    Default 0 (synchronous).\n");
+	fprintf(o, "  --max-open N\n");
+	fprintf(o, "    Maximum number of target folders to keep open (each uses three fds), least recently\n");
+	fprintf(o, "    used folders are closed beyond that.  Default %d.\n", DEFAULT_MAX_OPEN);
 	fprintf(o, "  -S|--subscribe\n");
 	fprintf(o, "    Auto-subscribe to newly created folders.\n");
+	fprintf(o, "  --from-file LIST\n");
+	fprintf(o, "    Read the root folders to archive (one per line) from LIST (- for stdin), in\n");
+	fprintf(o, "    addition to those given on the command line.\n");
+	fprintf(o, "  -j|--jobs N\n");
+	fprintf(o, "    Archive up to N root folders concurrently (0 = number of CPUs), output is still\n");
+	fprintf(o, "    in the normal order.  Note that --max-open applies per root folder.  Default 1.\n");
 	fprintf(o, "  -h|--help\n");
 	fprintf(o, "    Enable force mode, permits overriding certain safeties.\n");
 	exit(x);
@@ -229,24 +565,22 @@ static struct option options[] = {
 	{ "maxage",			required_argument,	NULL,	'm' },
 	{ "replace",		no_argument,		NULL,	'R' },
 	{ "subscribe",		no_argument,		NULL,	'S' },
+	{ "max-open",		required_argument,	NULL,	'M' },
+	{ "batch",			required_argument,	NULL,	'b' },
+	{ "from-file",		required_argument,	NULL,	'F' },
+	{ "jobs",			required_argument,	NULL,	'j' },
 	{ NULL, 0, NULL, 0 },
 };
 
 int main(int argc, char** argv)
 {
-	int c, basefd = -1, sfd = -1;
-	const char* sourcefolder = NULL, *format = NULL,
-		  *base, *_maxage = DEFAULT_MAXAGE;
-	char* sourcename = NULL;
-	time_t maxage;
-	unsigned rename_flags = RENAME_NOREPLACE;
-	struct stat st;
-	bool subscribe = false;
-	struct maildir_type_list* stype = NULL;
+	int c;
+	const char *_maxage = DEFAULT_MAXAGE, *from_file = NULL;
+	struct workqueue *wq;
 
 	progname = *argv;
 
-	while ((c = getopt_long(argc, argv, "nf:s:m:R", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "nf:s:m:Rb:j:", options, NULL)) != -1) {
 		switch (c) {
 		case 0:
 			break;
@@ -265,9 +599,29 @@ int main(int argc, char** argv)
 		case 'R':
 			rename_flags &= ~RENAME_NOREPLACE;
 			break;
+		case 'b':
+			batch_depth = fsbatch_parse_depth(optarg);
+			break;
 		case 'S':
 			subscribe = true;
 			break;
+		case 'M':
+			{
+				char *endp;
+				unsigned long n = strtoul(optarg, &endp, 10);
+				if (*endp || !n) {
+					fprintf(stderr, "Invalid --max-open value %s.\n", optarg);
+					usage(1);
+				}
+				max_open = n;
+			}
+			break;
+		case 'F':
+			from_file = optarg;
+			break;
+		case 'j':
+			jobs = workqueue_parse_jobs(optarg);
+			break;
 		case 'h':
 			usage(0);
 		case '?':
@@ -284,165 +638,32 @@ int main(int argc, char** argv)
 		usage(1);
 	}
 
-	maxage = maxage2time(_maxage);
+	long long t;
+	if (parse_date_option(_maxage, &t))
+		maxage = t;
 	if (!maxage) {
 		fprintf(stderr, "Error converting '%s' to a date and time structure.\n",
 				_maxage);
 		usage(1);
 	}
+	printf("Archiving email older than: %s", ctime(&maxage));
 
-	if (!argv[optind]) {
+	if (!argv[optind] && !from_file) {
 		fprintf(stderr, "At least one maildir should be specified.\n");
 		usage(1);
 	}
 
-	while (argv[optind]) {
-		base = argv[optind++];
-		basefd = open(base, O_RDONLY /*dry_run ? O_RDONLY : O_RDWR */); // TODO: Do we need WR for mkdirat()?
-		if (basefd < 0) {
-			perror(base);
-			goto errout;
-		}
-
-		if (subscribe) {
-			stype = maildir_find_type(base);
-			if (!stype) {
-				fprintf(stderr, "%s: We need to be able to determine the folder type if we're to auto-subscribe.\n", base);
-				goto errout;
-			}
-		}
-
-		if (sourcefolder) {
-			asprintf(&sourcename, "%s/%s", base, sourcefolder);
-			sfd = openat(basefd, sourcefolder, O_RDONLY);
-			if (sfd < 0) {
-				perror(sourcename);
-				goto errout;
-			}
-		} else {
-			sourcename = strdup(base);
-			sfd = dup(basefd);
-		}
-
-		for (const char * const *_sfn = subsources; *_sfn; ++_sfn) {
-			const char* sfn = *_sfn;
-			char *endptr;
-			int cfd = openat(sfd, sfn, O_RDONLY);
-			if (cfd < 0) {
-				lerror("%s/%s", sourcename, sfn);
-				continue;
-			}
-			DIR* dir = fdopendir(cfd);
-			struct dirent *de;
-
-			printf("Archiving from %s/%s\n", sourcename, sfn);
-			while ((de = readdir(dir))) {
-				time_t filetime;
-				char tfname[256];
-				char tfname2[256];
-
-				if (*de->d_name == '.')
-					continue;
-				if (de->d_type == DT_UNKNOWN) {
-					static int warned = 0;
-					if (!warned) {
-						fprintf(stderr, "readdir() doesn't provide d_type, assuming everything is files to avoid costly stat() calls.\n");
-						warned = 1;
-					}
-				} else if (de->d_type != DT_REG)
-					continue; /* we only care about files, stuff here must be files */
-
-				// filename should be structured as seconds_since_epoch.stuff, so we care
-				// about the seconds here portion only.  The simplest is to convert as unsigned
-				// int, and then verify that the failure ended at a .
-				filetime = strtoul(de->d_name, &endptr, 10);
-
-				if (endptr == de->d_name || !endptr || *endptr != '.') {
-					fprintf(stderr, "Failed to extra timestamp from %s/%s/%s\n", sourcename, sfn, de->d_name);
-					continue;
-				}
-
-				if (filetime >= maxage) {
-					/* file is too young */
-					continue;
-				}
-
-				if (!strftime(tfname, sizeof(tfname), format, localtime(&filetime)) || !valid_foldername(tfname)) {
-					fprintf(stderr, "Error generating valid foldername from %s (%lu).  Cannot proceed\n", de->d_name, filetime);
-					continue;
-				}
-
-				if (dry_run) {
-					printf("%s/%s/%s => %s/%s/%s/\n",
-							sourcename, sfn, de->d_name, base, tfname, sfn);
-					continue;
-				}
-
-				int tfd = get_folderfd(tfname, basefd, stype);
-				if (tfd < 0) {
-					lerror("%s/%s", base, tfname);
-					continue;
-				}
-
-				/* ssize_t negative will become large positive when cast to size_t */
-				if ((size_t)snprintf(tfname2, sizeof(tfname2), "%s/%s", sfn, de->d_name) >= sizeof(tfname2)) {
-					fprintf(stderr, "Trucation error looking to rename %s/%s/%s into %s/%s/%s.\n",
-							sourcename, sfn, de->d_name, base, tfname, sfn);
-					continue;
-				}
-
-				if ((rename_flags & RENAME_NOREPLACE) == 0) {
-					if (fstatat(tfd, tfname2, &st, 0) == 0) {
-						errno = EEXIST;
-						lerror("%s/%s/%s => %s/%s/%s/ (stat)",
-							sourcename, sfn, de->d_name, base, tfname, sfn);
-						continue;
-					} else if (errno != ENOENT) {
-						lerror("%s/%s/%s => %s/%s/%s/ (stat)",
-							sourcename, sfn, de->d_name, base, tfname, sfn);
-						continue;
-					}
-				}
-
-				if (renameat2(cfd, de->d_name, tfd, tfname2, rename_flags) < 0) {
-					lerror("%s/%s/%s => %s/%s/%s/",
-							sourcename, sfn, de->d_name, base, tfname, sfn);
-					if ((rename_flags & RENAME_NOREPLACE) != 0 && errno == EINVAL &&
-						fstatat(tfd, tfname2, &st, 0) == -1 && errno == ENOENT)
-					{
-						fprintf(stderr, "We received EINVAL on rename using RENAME_NOREPLACE.  Possibly the filesystem doesn't like this, so please retry using (potentially dangerous) -R.\n");
-						goto errout;
-					}
-				}
-			}
-			closedir(dir); /* also closes cfd */
-		}
-
-		get_folderfd(NULL, -1, NULL);
-
-		free(sourcename);
-		sourcename = NULL;
-
-		close(sfd);
-		sfd = -1;
-
-		close(basefd);
-		basefd = -1;
-
-		maildir_type_list_free(stype);
+	wq = workqueue_create(jobs, 0, archive_work, archive_done, NULL);
+	while (argv[optind] && queue_mailbox(wq, argv[optind]))
+		++optind;
+	if (from_file && read_lines(from_file, queue_mailbox, wq) < 0) {
+		perror(from_file);
+		stop = true;
 	}
+	workqueue_finish(wq);
 
-	return 0;
-errout:
-	if (basefd >= 0)
-		close(basefd);
-	if (sfd >= 0)
-		close(sfd);
-	if (stype)
-		maildir_type_list_free(stype);
-
-	get_folderfd(NULL, -1, NULL);
-	free(sourcename);
+	if (total.mailboxes > 1)
+		print_summary(stdout, "Total", total.archived, total.failed);
 
-	return 1;
+	return stop ? 1 : 0;
 }
@@ -1,4 +1,6 @@
 #include "filetools.h"
+#include "strmap.h"
+#include "workqueue.h"
 
 #define _GNU_SOURCE
 
@@ -12,15 +14,18 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stdarg.h>
 
 #define MAX_STAT_ENOENT_RETRY		10
 
 static const char * progname;
 static const char * maildir_subs[] = { "cur", "new", "-tmp", NULL };
-static const char * valid_flags = "PRSTDFabcdefghijklmnopqrstuvwxyz";
 
 static int fix_fixable = false;
-static int fixed = 0;
+static int fixed = 0; /* updated atomically, folders may be checked concurrently */
+static unsigned jobs = 1;
+
+#define add_fixed() __atomic_add_fetch(&fixed, 1, __ATOMIC_RELAXED)
 
 /* tmp/ needs not be scanned.
  * ordering critical as stuff gets rename()d from new/ to cur/,
@@ -30,71 +35,111 @@ static int fixed = 0;
  * + indicates that we must have :2, and optional flags.
  **/
 
-struct msg_list {
-	char* basename; /* unique */
-	char **fullnames; /* NULL terminated */
-	struct msg_list *next;
+/* Index of all messages in a folder by basename (the part before the :),
+ * every basename should occur exactly once.  Names are appended in scan order
+ * and only grouped (contiguously, per basename) by msg_index_finish(). */
+struct msg_base {
+	const char* basename;
+	const char** fullnames; /* count entries, valid after msg_index_finish() */
+	size_t count;
+};
+
+struct msg_name {
+	struct msg_base *base;
+	const char* fullname; /* sub/filename */
+};
+
+struct msg_index {
+	struct strmap bases; /* basename => struct msg_base */
+	struct msg_name *names;
+	size_t count, alloc;
+	const char** fullnames; /* grouped per basename */
+	struct msg_base** dups; /* sorted by basename */
+	size_t ndups;
 };
 
+#define MSG_INDEX_INIT	{ STRMAP_INIT, NULL, 0, 0, NULL, NULL, 0 }
+
 static
-void msg_list_free(struct msg_list *m)
+void msg_index_free(struct msg_index *mi)
 {
-	struct msg_list *t;
-	char **ff;
-	while (m) {
-		t = m->next;
-
-		free(m->basename);
-		for (ff = m->fullnames; *ff; ++ff)
-			free(*ff);
-		free(m->fullnames);
-		free(m);
-
-		m = t;
-	}
+	strmap_free(&mi->bases);
+	free(mi->names);
+	free(mi->fullnames);
+	free(mi->dups);
 }
 
 static
-void msg_list_add(struct msg_list **mlist, const char* sub, const char* fn)
+void msg_index_add(struct msg_index *mi, const char* sub, const char* fn)
 {
-	const char* base = fn;
-	const char* colon = strchr(fn, ':');
-	if (colon)
-		base = strndupa(fn, colon - fn);
-
-	/* insert in ASCII order, this is probably the worst choice */
-	while (*mlist && strcmp((*mlist)->basename, base) < 0)
-		mlist = &(*mlist)->next;
-
-	if (*mlist && strcmp((*mlist)->basename, base) == 0) {
-		/* error condition, base is not unique, just add to the fullnames. */
-		int i = 0;
-		while ((*mlist)->fullnames[i++])
-			;
-		(*mlist)->fullnames = realloc((*mlist)->fullnames, sizeof(*(*mlist)->fullnames) * (i+1));
-		asprintf(&(*mlist)->fullnames[i-1], "%s/%s", sub, fn);
-		(*mlist)->fullnames[i] = NULL;
-	} else {
-		struct msg_list *n = malloc(sizeof(struct msg_list));
-		n->basename = strdup(base);
-		n->fullnames = malloc(sizeof(*n->fullnames) * 2);
-		asprintf(&n->fullnames[0], "%s/%s", sub, fn);
-		n->fullnames[1] = NULL;
-		n->next = *mlist;
-		*mlist = n;
+	size_t baselen = strchrnul(fn, ':') - fn;
+	struct strmap_entry *e = strmap_insert(&mi->bases, fn, baselen, NULL);
+	struct msg_base *mb = e->value;
+	size_t sublen = strlen(sub), fnlen = strlen(fn);
+	char *full;
+
+	if (!mb) {
+		mb = e->value = strmap_alloc(&mi->bases, sizeof(*mb));
+		mb->basename = e->key;
+		mb->fullnames = NULL;
+		mb->count = 0;
+	}
+	mb->count++;
+
+	full = strmap_alloc(&mi->bases, sublen + fnlen + 2);
+	memcpy(full, sub, sublen);
+	full[sublen] = '/';
+	memcpy(full + sublen + 1, fn, fnlen + 1);
+
+	if (mi->count == mi->alloc) {
+		mi->alloc = mi->alloc ? mi->alloc * 2 : 1024;
+		mi->names = realloc(mi->names, mi->alloc * sizeof(*mi->names));
+		if (!mi->names) {
+			perror("realloc");
+			exit(1);
+		}
 	}
+	mi->names[mi->count].base = mb;
+	mi->names[mi->count].fullname = full;
+	mi->count++;
 }
 
 static
-void __attribute__((unused)) msg_list_dump(const struct msg_list *m)
+int msg_base_cmp(const void* a, const void* b)
 {
-	while (m) {
-		printf("base: %s\n", m->basename);
-		char** fn = m->fullnames;
-		while (*fn)
-			printf(" - %s\n", *fn++);
-		m = m->next;
+	return strcmp((*(struct msg_base* const*)a)->basename, (*(struct msg_base* const*)b)->basename);
+}
+
+static
+void msg_index_finish(struct msg_index *mi)
+{
+	const char** next;
+	size_t i;
+
+	mi->fullnames = malloc((mi->count ? mi->count : 1) * sizeof(*mi->fullnames));
+	mi->dups = malloc((mi->bases.count ? mi->bases.count : 1) * sizeof(*mi->dups));
+	if (!mi->fullnames || !mi->dups) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* allocate each basename its slice, then scatter (retaining scan order) */
+	next = mi->fullnames;
+	strmap_foreach(&mi->bases, e) {
+		struct msg_base *mb = e->value;
+		mb->fullnames = next;
+		next += mb->count;
+		if (mb->count > 1)
+			mi->dups[mi->ndups++] = mb;
+		mb->count = 0;
+	}
+
+	for (i = 0; i < mi->count; ++i) {
+		struct msg_base *mb = mi->names[i].base;
+		mb->fullnames[mb->count++] = mi->names[i].fullname;
 	}
+
+	qsort(mi->dups, mi->ndups, sizeof(*mi->dups), msg_base_cmp);
 }
 
 /* This is designed to "accomodate" a glusterfs bug w.r.t. linkto files that
@@ -117,18 +162,8 @@ int myfstatat(int dirfd, const char *restrict pathname, struct stat *restrict st
 	return r;
 }
 
-static
-bool chrinstr(char c, const char* head, const char* tail)
-{
-	while (head < tail)
-		if (c == *head++)
-			return true;
-
-	return false;
-}
-
 /* We cannot assume alphabetic order here since fixing thereof may potentially
- * have failed */
+ * have failed, which doesn't matter with masks */
 /* Note that the exact same set of flags is NOT a subset of the flags itself
  * such that if we have exact duplicate filenames (as is possible through a
  * corrupted glusterfs filesystem) we won't nuke the only copy by accident.
@@ -136,46 +171,20 @@ bool chrinstr(char c, const char* head, const char* tail)
 static
 bool flags_subset_of(const char* fn1, const char* fn2)
 {
-	const char* t;
-	const char* fs1 = strstr(fn1, ":2,");
-	const char* fs2 = strstr(fn2, ":2,");
+	unsigned long long fs1, fs2;
 
-	if (!fs2)
+	if (!strstr(fn2, ":2,") || !maildir_name_flags(fn2, &fs2))
 		return false;
 
-	/* if fs1 doesn't have flags it's *obviously* a subset of fs2's flags */
-	if (!fs1)
+	/* if fn1 doesn't have flags it's *obviously* a subset of fn2's flags */
+	if (!strstr(fn1, ":2,"))
 		return true;
 
-	/* skip over the markers. */
-	fs1 += 3;
-	fs2 += 3;
-
-	const char* fs1t = fs1;
-	while (*fs1t && *fs1t != ',')
-		++fs1t;
-
-	const char* fs2t = fs2;
-	while (*fs2t && *fs2t != ',')
-		++fs2t;
-
-	/* We WANT the tags for fn1 to be fewer than for fn2.  If that holds,
-	 * there is a chance, this is a quick out */
-	if ((fs1t - fs1) >= (fs2t - fs2))
+	/* unrepresentable flags, err on the side of caution */
+	if (!maildir_name_flags(fn1, &fs1))
 		return false;
 
-	/* all tags in fn1 must be in fn2 */
-	for (t = fs1; t < fs1t; t++)
-		if (!chrinstr(*t, fs2, fs2t))
-			return false;
-
-	/* at least one tag in fn2 must not be in fn1 */
-	for (t = fs2; t < fs2t; t++)
-		if (!chrinstr(*t, fs1, fs1t))
-			return true;
-
-	return false;
-
+	return (fs1 & ~fs2) == 0 && fs1 != fs2;
 }
 
 static
@@ -190,7 +199,8 @@ bool copy_prefer_over(int fd, const char* a, const char* b)
 	return !!files_identical(fd, a, NULL, fd, b, NULL);
 }
 
-#define add_error(ec, fmt, ...) do { printf("\n" fmt, ## __VA_ARGS__); fflush(stdout); ++(ec); } while(0)
+/* out is the report stream of the folder being checked */
+#define add_error(ec, fmt, ...) do { fprintf(out, "\n" fmt, ## __VA_ARGS__); fflush(out); ++(ec); } while(0)
 
 #define check_ownership(fd, path, st, ec, fmt, ...) do { \
 	if (myfstatat(fd, path, &st, AT_EMPTY_PATH) < 0) { \
@@ -203,23 +213,24 @@ bool copy_prefer_over(int fd, const char* a, const char* b)
 			add_error(ec, fmt ": Wrong group, gid=%lu is not %lu.", ## __VA_ARGS__, (unsigned long)st.st_gid, (unsigned long)gid); \
 		if (fix_fixable && (st.st_uid != uid || st.st_gid != gid)) { \
 			fchownat(fd, path, uid, gid, AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH); \
-			fixed++; \
+			add_fixed(); \
 		} \
 	} \
 } while(0)
 
 static
-int check_fdpath(int fd, const char* rpath, uid_t uid, gid_t gid)
+int check_fdpath(FILE* out, int fd, const char* rpath, uid_t uid, gid_t gid)
 {
 	const char ** sp = maildir_subs;
 	const char * subname;
 	int ec = 0, sfd;
-	printf("%s:", rpath + 1 /* leading . */); fflush(stdout);
+	fprintf(out, "%s:", *rpath ? rpath + 1 /* leading . */ : ""); fflush(out);
 	int noscan;
 	int forceflags;
-	DIR *dir;
-	struct dirent *de;
-	struct msg_list *mlist = NULL, *slist;
+	struct dirscan *dir;
+	struct dirscan_entry *de;
+	struct msg_index mindex = MSG_INDEX_INIT;
+	size_t di, i;
 	struct stat st;
 
 	if (fstatat(fd, "maildirfolder", &st, 0) < 0) {
@@ -262,7 +273,7 @@ int check_fdpath(int fd, const char* rpath, uid_t uid, gid_t gid)
 				mkdirat(fd, subname, 0700);
 				sfd = openat(fd, subname, O_RDONLY);
 				if (sfd >= 0) {
-					fixed++;
+					add_fixed();
 					fchownat(sfd, "", uid, gid, AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH);
 				}
 			}
@@ -277,211 +288,294 @@ int check_fdpath(int fd, const char* rpath, uid_t uid, gid_t gid)
 			continue;
 		}
 
-		dir = fdopendir(sfd);
+		dir = dirscan_fdopen(sfd);
 		if (!dir) {
 			add_error(ec, "%s: %s", subname, strerror(errno));
-			close(sfd);
 		} else {
-			while ((de = readdir(dir))) {
-				if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			while ((de = dirscan_next(dir))) {
+				if (dirscan_dots(de))
 					continue;
-				check_ownership(sfd, de->d_name, st, ec, "%s/%s", subname, de->d_name);
+				check_ownership(sfd, de->name, st, ec, "%s/%s", subname, de->name);
 
-				const char* ssize = strstr(de->d_name, "S=");
+				unsigned long long sz;
 
-				if (errno == 0 && ssize) {
-					off_t sz = strtoul(ssize + 2, NULL, 10);
-					if (sz != st.st_size) {
-						add_error(ec, "%s/%s: found file to have size %lu, expected S=%lu.",
-								subname, de->d_name, st.st_size, sz);
+				/* the stat is needed for the ownership check anyway */
+				if (errno == 0 && (maildir_name_sizes(de->name, &sz, NULL) & MAILDIR_SIZE_S)) {
+					if (sz != (unsigned long long)st.st_size) {
+						add_error(ec, "%s/%s: found file to have size %lu, expected S=%llu.",
+								subname, de->name, st.st_size, sz);
 					}
 				}
 
-				const char* colon = strchr(de->d_name, ':');
+				const char* colon = strchr(de->name, ':');
+				char *newname = NULL;
 
 				if (!colon) {
 					if (forceflags)
 						add_error(ec, "%s/%s: in folder that requires flags (:2, in filename).\n",
-								subname, de->d_name);
+								subname, de->name);
 				} else if (strncmp(":2,", colon, 3) == 0) {
-					int alphabetic = 1;
-					char last_flag = 0;
-					for (const char* flag = colon + 3; *flag; ++flag) {
-						if (*flag == ',') {
-							/* dovecot extended for this, warn about it but don't error on it */
-							printf("\n%s/%s: warning: , found in flags, indicative of Dovecot extensions.", subname, de->d_name);
-							break;
-						}
-
-						/* TODO: Can we incorporate a check here for DUPLICATE flags */
-
-						alphabetic &= *flag > last_flag;
-						if (!strchr(valid_flags, *flag))
-							add_error(ec, "%s/%s: invalid flag %c found.", subname, de->d_name, *flag);
+					const char* flags = colon + 3;
+					size_t flagslen = strchrnul(flags, ',') - flags;
+					unsigned long long mask, m;
+					bool ordered, representable;
+
+					representable = maildir_flags_parse(flags, flagslen, &mask, &ordered);
+					if (!representable || (mask & ~MAILDIR_FLAGS_VALID)) {
+						/* slow path, to report them in order */
+						for (size_t i = 0; i < flagslen; ++i)
+							if (!maildir_flags_parse(flags + i, 1, &m, NULL) || !(m & MAILDIR_FLAGS_VALID))
+								add_error(ec, "%s/%s: invalid flag %c found.", subname, de->name, flags[i]);
+					}
 
-						last_flag = *flag;
+					if (flags[flagslen] == ',') {
+						/* dovecot extended for this, warn about it but don't error on it */
+						fprintf(out, "\n%s/%s: warning: , found in flags, indicative of Dovecot extensions.", subname, de->name);
 					}
-					if (!alphabetic) {
-						add_error(ec, "%s/%s: flags are not in alphabetic order.", subname, de->d_name);
-						if (fix_fixable) {
-							char t;
-							char *fflag = (char*)colon + 3;
-							char *oldname = strdup(de->d_name);
-							for (char *tflag = fflag; *tflag && *tflag != ','; ++tflag) {
-								t = *tflag;
-								char *aflag = tflag;
-								while (aflag > fflag && *(aflag-1) > t) {
-									*aflag = *(aflag-1);
-									aflag--;
-								}
-								*aflag = t;
+
+					if (!ordered) {
+						add_error(ec, "%s/%s: flags are not in alphabetic order.", subname, de->name);
+						/* the canonical form can only be produced if all flags are
+						 * representable, duplicates are dropped along the way */
+						if (fix_fixable && representable) {
+							char canonical[MAILDIR_FLAGS_MAX + 1];
+
+							maildir_flags_format(mask, canonical);
+							if (asprintf(&newname, "%.*s%s%s", (int)(flags - de->name), de->name,
+										canonical, flags + flagslen) < 0) {
+								perror("asprintf");
+								exit(1);
 							}
 
 							/* reduce the risk of clobering a valid email file */
-							if (fstatat(sfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
+							if (fstatat(sfd, newname, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
 								/* just fail silently */
-								strcpy(de->d_name, oldname);
-							} else if (renameat(sfd, oldname, sfd, de->d_name) < 0) {
-								printf("\nRename %s to %s failed: %s", oldname,
-										de->d_name, strerror(errno));
-								/* rename failed, so keep the old name for adding into mlist */
-								strcpy(de->d_name, oldname);
+								free(newname);
+								newname = NULL;
+							} else if (renameat(sfd, de->name, sfd, newname) < 0) {
+								fprintf(out, "\nRename %s to %s failed: %s", de->name,
+										newname, strerror(errno));
+								/* rename failed, so keep the old name for adding into mindex */
+								free(newname);
+								newname = NULL;
 							} else
-								fixed++;
-							free(oldname);
+								add_fixed();
 						}
 					}
 
 				} else {
-					add_error(ec, "%s/%s: flags marker is not recognized, expected :2, - probably an unsupported version ...\n", subname, de->d_name);
+					add_error(ec, "%s/%s: flags marker is not recognized, expected :2, - probably an unsupported version ...\n", subname, de->name);
 				}
 
-				/* only add here since alpha fix on flags can change de->d_name */
-				msg_list_add(&mlist, subname, de->d_name);
+				/* only add here since alpha fix on flags can change the name */
+				msg_index_add(&mindex, subname, newname ?: de->name);
+				free(newname);
 			}
-			closedir(dir);
+			dirscan_close(dir);
 		}
 	}
 
-	for (slist = mlist; slist; slist = slist->next) {
+	msg_index_finish(&mindex);
+	for (di = 0; di < mindex.ndups; ++di) {
+		const struct msg_base *dup = mindex.dups[di];
 		/* Whilst base name has a structure, it really doesn't matter ...  the
 		 * structure is merely intended to produce a unique - we NEED it to be
 		 * unique, else the POP3 and IMAP servers tend to die. */
 
 		/* We checked the filename structure above, so don't bother again,
 		 * just check for duplicates here */
-		if (slist->fullnames[1]) {
-			// we know there is more than one, count them.
-			int i;
-			for (i = 1; slist->fullnames[i]; ++i)
-				;
-			add_error(ec, "%s: %d occurences, which means stuff is not unique.",
-					slist->basename, i);
-			for (i = 0; slist->fullnames[i]; ++i)
-				printf("\n - %s", slist->fullnames[i]);
-			fflush(stdout);
-
-			if (fix_fixable) {
-				const char* lkept = slist->fullnames[0];
-				for (i = 1; slist->fullnames[i]; ++i) {
-					if (copy_prefer_over(fd, lkept, slist->fullnames[i])) {
-						if (unlinkat(fd, slist->fullnames[i], 0) < 0) {
-							perror(slist->fullnames[i]);
-						} else
-							++fixed;
-					} else if (copy_prefer_over(fd, slist->fullnames[i], lkept)) {
-						if (unlinkat(fd, lkept, 0) < 0) {
-							perror(lkept);
-						} else
-							++fixed;
-						lkept = slist->fullnames[i];
-					} else {
-						printf("\nCannot choose between %s and %s.", lkept, slist->fullnames[i]);
-						fflush(stdout);
-					}
+		add_error(ec, "%s: %zu occurences, which means stuff is not unique.",
+				dup->basename, dup->count);
+		for (i = 0; i < dup->count; ++i)
+			fprintf(out, "\n - %s", dup->fullnames[i]);
+		fflush(out);
+
+		if (fix_fixable) {
+			const char* lkept = dup->fullnames[0];
+			for (i = 1; i < dup->count; ++i) {
+				if (copy_prefer_over(fd, lkept, dup->fullnames[i])) {
+					if (unlinkat(fd, dup->fullnames[i], 0) < 0) {
+						perror(dup->fullnames[i]);
+					} else
+						add_fixed();
+				} else if (copy_prefer_over(fd, dup->fullnames[i], lkept)) {
+					if (unlinkat(fd, lkept, 0) < 0) {
+						perror(lkept);
+					} else
+						add_fixed();
+					lkept = dup->fullnames[i];
+				} else {
+					fprintf(out, "\nCannot choose between %s and %s.", lkept, dup->fullnames[i]);
+					fflush(out);
 				}
 			}
 		}
 	}
 
 	if (ec) {
-		printf("\n *** %d errors identified ***\n", ec);
+		fprintf(out, "\n *** %d errors identified ***\n", ec);
 	} else {
-		printf(" All Good.\n");
+		fprintf(out, " All Good.\n");
 	}
 
-	//msg_list_dump(mlist);
-	msg_list_free(mlist);
+	msg_index_free(&mindex);
 
 	return ec;
 }
 
+/* A folder to check (fd >= 0), or merely a message to output (fd < 0), so
+ * that everything is reported in order regardless of --jobs. */
+struct folder_check {
+	int fd;
+	char *rpath;
+	uid_t uid;
+	gid_t gid;
+	int ec;
+	char *report;
+	size_t reportlen;
+};
+
+/* runs on worker threads */
+static
+void folder_check_work(void* _f, void*)
+{
+	struct folder_check *f = _f;
+	FILE *out;
+
+	if (f->fd < 0)
+		return;
+
+	if (jobs <= 1) {
+		/* no need to buffer, output as we go */
+		f->ec = check_fdpath(stdout, f->fd, f->rpath, f->uid, f->gid);
+	} else if (!(out = open_memstream(&f->report, &f->reportlen))) {
+		perror("open_memstream");
+		exit(1);
+	} else {
+		f->ec = check_fdpath(out, f->fd, f->rpath, f->uid, f->gid);
+		fclose(out);
+	}
+	close(f->fd);
+}
+
+/* runs in push order on the main thread */
+static
+void folder_check_done(void* _f, void* ctx)
+{
+	struct folder_check *f = _f;
+
+	if (f->report) {
+		fwrite(f->report, 1, f->reportlen, stdout);
+		fflush(stdout);
+	}
+	*(int*)ctx += f->ec;
+
+	free(f->report);
+	free(f->rpath);
+	free(f);
+}
+
 static
-int check_path(const char* path)
+struct folder_check* folder_check_new(int fd, const char* rpath, uid_t uid, gid_t gid)
 {
-	int ec, sfd;
+	struct folder_check *f = calloc(1, sizeof(*f));
+
+	if (!f || (rpath && !(f->rpath = strdup(rpath)))) {
+		perror("malloc");
+		exit(1);
+	}
+	f->fd = fd;
+	f->uid = uid;
+	f->gid = gid;
+
+	return f;
+}
+
+static
+void __attribute__((format(printf, 3, 4))) queue_message(struct workqueue* wq, int ec, const char* fmt, ...)
+{
+	struct folder_check *f = folder_check_new(-1, NULL, 0, 0);
+	va_list ap;
+
+	f->ec = ec;
+	if (fmt) {
+		va_start(ap, fmt);
+		if (vasprintf(&f->report, fmt, ap) < 0) {
+			perror("vasprintf");
+			exit(1);
+		}
+		va_end(ap);
+		f->reportlen = strlen(f->report);
+	}
+
+	workqueue_push(wq, f);
+}
+
+static
+void check_path(struct workqueue* wq, const char* path)
+{
+	int sfd;
 	int fd = open(path, O_RDONLY);
-	DIR* dir;
-	struct dirent* de;
+	struct dirscan* dir;
+	struct dirscan_entry* de;
 	struct stat st;
 	uid_t uid;
 	gid_t gid;
 
 	if (fd < 0) {
 		perror(path);
-		return 1;
+		queue_message(wq, 1, NULL);
+		return;
 	}
-	printf("PATH: %s\n", path);
+	queue_message(wq, 0, "PATH: %s\n", path);
 
-	ec = myfstatat(fd, "", &st, AT_EMPTY_PATH);
-	if (ec < 0) {
-		printf("Error stat'ing base folder: %s.\n", strerror(errno));
-		return 1;
+	if (myfstatat(fd, "", &st, AT_EMPTY_PATH) < 0) {
+		queue_message(wq, 1, "Error stat'ing base folder: %s.\n", strerror(errno));
+		close(fd);
+		return;
 	}
 
 	uid = st.st_uid;
 	gid = st.st_gid;
 
-	ec = check_fdpath(fd, "", uid, gid);
+	/* workers close the fd they're given, and we still need ours below */
+	sfd = dup(fd);
+	if (sfd < 0)
+		queue_message(wq, 1, "%s: %s\n", path, strerror(errno));
+	else
+		workqueue_push(wq, folder_check_new(sfd, "", uid, gid));
 
-	dir = fdopendir(fd);
+	dir = dirscan_fdopen(fd);
 	if (!dir) {
-		printf("%s: %s\n", path, strerror(errno));
-		close(fd);
-		++ec;
+		queue_message(wq, 1, "%s: %s\n", path, strerror(errno));
 	} else {
-		while ((de = readdir(dir))) {
-			if (de->d_name[0] != '.' || strcmp(de->d_name, "..") == 0 || strcmp(de->d_name, ".") == 0)
+		while ((de = dirscan_next(dir))) {
+			if (de->name[0] != '.' || dirscan_dots(de))
 				continue;
 
-			if (de->d_type == DT_UNKNOWN) {
-				if (myfstatat(fd, de->d_name, &st, 0) < 0) {
-					printf("%s: %s.\n", de->d_name, strerror(errno));
-					++ec;
+			if (de->type == DT_UNKNOWN) {
+				if (myfstatat(fd, de->name, &st, 0) < 0) {
+					queue_message(wq, 1, "%s: %s.\n", de->name, strerror(errno));
 					continue;
 				}
 				if (S_ISDIR(st.st_mode))
-					de->d_type = DT_DIR;
+					de->type = DT_DIR;
 			}
 
-			if (de->d_type != DT_DIR) {
-				printf("%s: Not a folder (.Name entries must be folders).\n", de->d_name);
-				++ec;
+			if (de->type != DT_DIR) {
+				queue_message(wq, 1, "%s: Not a folder (.Name entries must be folders).\n", de->name);
 				continue;
 			}
 
-			sfd = openat(fd, de->d_name, O_RDONLY);
+			sfd = openat(fd, de->name, O_RDONLY);
 			if (sfd < 0) {
-				printf("%s: %s.\n", de->d_name, strerror(errno));
+				queue_message(wq, 0, "%s: %s.\n", de->name, strerror(errno));
 				continue;
 			}
-			ec += check_fdpath(sfd, de->d_name, uid, gid);
-			close(sfd);
+			workqueue_push(wq, folder_check_new(sfd, de->name, uid, gid));
 		}
-		closedir(dir);
+		dirscan_close(dir);
 	}
-
-	return ec;
 }
 
 static
@@ -495,6 +589,9 @@ void __attribute__((noreturn)) usage(int x)
 	fprintf(o, "  -F,--fix-fixable\n");
 	fprintf(o, "    Fix fixable errors, currently:\n");
 	fprintf(o, "     - ownership of files.\n");
+	fprintf(o, "  -j,--jobs N\n");
+	fprintf(o, "    Check up to N folders concurrently (0 = number of CPUs), the reports\n");
+	fprintf(o, "    are still output in the normal order.  Default 1.\n");
 	fprintf(o, "Progam will exit with 0 exit code if, and only if none of the folders exhibit any errors:\n");
 	fprintf(o, "  0 - no errors.\n");
 	fprintf(o, "  1 - usage error (ie, we terminated due to a usage problem).\n");
@@ -508,6 +605,7 @@ void __attribute__((noreturn)) usage(int x)
 static struct option options[] = {
 	{ "help",		no_argument, NULL, 'h' },
 	{ "fix-fixable",no_argument, NULL, 'F' },
+	{ "jobs",		required_argument, NULL, 'j' },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -515,8 +613,9 @@ int main(int argc, char **argv)
 {
 	progname = *argv;
 	int c;
+	struct workqueue *wq;
 
-	while (( c = getopt_long(argc, argv, "hF", options, NULL)) != -1) {
+	while (( c = getopt_long(argc, argv, "hFj:", options, NULL)) != -1) {
 		switch (c) {
 		case 0:
 			break;
@@ -525,6 +624,9 @@ int main(int argc, char **argv)
 		case 'F':
 			fix_fixable = true;
 			break;
+		case 'j':
+			jobs = workqueue_parse_jobs(optarg);
+			break;
 		default:
 			fprintf(stderr, "Option not implemented: %c.\n", c);
 			usage(1);
@@ -535,7 +637,10 @@ int main(int argc, char **argv)
 		usage(1);
 
 	c = 0;
+	wq = workqueue_create(jobs, 0, folder_check_work, folder_check_done, &c);
 	while (argv[optind])
-		c += check_path(argv[optind++]);
+		check_path(wq, argv[optind++]);
+	workqueue_finish(wq);
+
 	return c ? (fixed ? 3 : 2) : 0;
 }
@@ -9,80 +9,263 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <pthread.h>
 
 #include "servertypes.h"
 #include "filetools.h"
+#include "datetools.h"
+#include "workqueue.h"
 
 #define lerror(fmt, ...) fprintf(stderr, fmt ": %s.\n", ##__VA_ARGS__, strerror(errno))
 
 static const char* progname = NULL;
 static const char * maildir_subs[] = { "cur", "new", NULL }; /* no tmp */
 static unsigned long long mintime = 86400 * 7;
+static const char* const date_header[] = { "date", NULL };
+static int date_coprocess = false;
+static unsigned jobs = 1;
+static bool dryrun = false;
+static bool verbose = false;
+static unsigned rename_flags = RENAME_NOREPLACE;
+
+/* A cur/ or new/ folder, kept open until the last of its messages is done. */
+struct rename_dir {
+	const char *folder;
+	const char *sub;
+	struct dirscan *dir;
+	unsigned refs;
+	bool listed;
+};
+
+/* A message to check (dir != NULL), or merely a line for stdout (dir ==
+ * NULL), so that everything is output in order regardless of --jobs.  The
+ * headers are read and the date parsed on the worker threads, the rename
+ * itself happens in order on the main thread. */
+struct rename_msg {
+	struct rename_dir *dir;
+	char *name;
+	unsigned char type;
+	char *error;
+	bool skip;
+	long long header_ts;
+	char datestr[1024];
+};
+
+/* header buffers are big, so rather than one per message recycle them */
+struct header_buf {
+	struct header_buf *next;
+	struct mail_headers mh;
+};
+
+static pthread_mutex_t header_bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct header_buf *header_bufs = NULL;
 
 static
-unsigned long long convert_date(/* const */char* datestring)
+struct header_buf* header_buf_get()
 {
-	int pfds[2];
-	if (pipe(pfds) < 0) {
-		perror("pipe");
-		exit(1);
-	}
-
-	pid_t pid = fork();
-	if (pid == -1) {
-		perror("fork");
-		exit(1);
-	} else if (pid == 0) {
-		/* child */
-		if (dup2(pfds[1], 1) < 0) {
-			perror("dup2");
+	struct header_buf *hb;
+
+	pthread_mutex_lock(&header_bufs_lock);
+	hb = header_bufs;
+	if (hb)
+		header_bufs = hb->next;
+	pthread_mutex_unlock(&header_bufs_lock);
+
+	if (!hb) {
+		hb = malloc(sizeof(*hb));
+		if (!hb) {
+			perror("malloc");
 			exit(1);
 		}
-		close(pfds[0]);
-		close(pfds[1]);
-		char *const argv[] = {
-			"date",
-			"-d",
-			datestring,
-			"+%s",
-			NULL
-		};
-		execvp("date", argv);
-		perror("date");
+		hb->mh = (struct mail_headers)MAIL_HEADERS_INIT;
+	}
+
+	return hb;
+}
+
+static
+void header_buf_put(struct header_buf* hb)
+{
+	pthread_mutex_lock(&header_bufs_lock);
+	hb->next = header_bufs;
+	header_bufs = hb;
+	pthread_mutex_unlock(&header_bufs_lock);
+}
+
+static
+void header_bufs_free()
+{
+	while (header_bufs) {
+		struct header_buf *t = header_bufs->next;
+		mail_headers_free(&header_bufs->mh);
+		free(header_bufs);
+		header_bufs = t;
+	}
+}
+
+static
+void rename_dir_release(struct rename_dir* d)
+{
+	if (--d->refs || !d->listed)
+		return;
+	dirscan_close(d->dir);
+	free(d);
+}
+
+static
+void __attribute__((format(printf, 2, 3))) rename_msg_error(struct rename_msg* m, const char* fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (vasprintf(&m->error, fmt, ap) < 0) {
+		perror("vasprintf");
 		exit(1);
-	} else {
-		/* parent */
-		char bfr[64], *e;
-		int status;
-		close(pfds[1]);
-		int r = read(pfds[0], bfr, sizeof(bfr) - 1);
-		if (r < 0) {
-			perror("read");
-			exit(1);
-		}
-		bfr[r] = 0; /* null terminate the string */
-		close(pfds[0]);
-		if (waitpid(pid, &status, 0) < 0) {
-			perror("waitpid");
-			exit(1);
+	}
+	va_end(ap);
+}
+
+/* runs on worker threads */
+static
+void rename_msg_work(void* _m, void*)
+{
+	struct rename_msg *m = _m;
+	struct rename_dir *d = m->dir;
+	int sub_fd;
+	struct header_buf *hb;
+	struct mail_header date;
+	bool found;
+
+	if (!d)
+		return;
+	sub_fd = dirscan_fd(d->dir);
+
+	if (m->type == DT_UNKNOWN) {
+		struct stat st;
+		if (fstatat(sub_fd, m->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			rename_msg_error(m, "fstatat(%s/%s/%s): %s\n", d->folder, d->sub, m->name, strerror(errno));
+			return;
 		}
+		if ((st.st_mode & S_IFMT) == S_IFREG)
+			m->type = DT_REG;
+	}
+	if (m->type != DT_REG) {
+		m->skip = true;
+		return;
+	}
+
+	hb = header_buf_get();
+	if (mail_headers_open(&hb->mh, sub_fd, m->name, date_header) < 0) {
+		rename_msg_error(m, "%s/%s/%s: %s\n", d->folder, d->sub, m->name, strerror(errno));
+		header_buf_put(hb);
+		return;
+	}
+
+	/* only the first Date: header is used, so stop reading there */
+	found = mail_headers_next(&hb->mh, &date);
+	mail_headers_close(&hb->mh);
+
+	if (hb->mh.error)
+		rename_msg_error(m, "%s/%s/%s: %s\n", d->folder, d->sub, m->name, strerror(hb->mh.error));
+	else if (!found)
+		rename_msg_error(m, "%s/%s/%s: No Date: header found.\n", d->folder, d->sub, m->name);
+	else
+		mail_header_unfold(&date, m->datestr, sizeof(m->datestr));
+	header_buf_put(hb);
+
+	if (!m->error && (!parse_mail_date(m->datestr, &m->header_ts) || m->header_ts < 0))
+		rename_msg_error(m, "%s/%s/%s: Unable to parse Date: %s\n", d->folder, d->sub, m->name, m->datestr);
+}
+
+/* runs in push order on the main thread */
+static
+void rename_msg_commit(const struct rename_msg* m)
+{
+	const struct rename_dir *d = m->dir;
+	int sub_fd = dirscan_fd(d->dir);
+	struct maildir_name mn;
+
+	if (!(maildir_name_parse(m->name, &mn) & MAILDIR_NAME_TIME)) {
+		fprintf(stderr, "%s/%s/%s: Filename isn't of the format TS.stuff\n",
+				d->folder, d->sub, m->name);
+		return;
+	}
+
+	if (mn.timestamp < m->header_ts + mintime)
+		return;
+
+	char *tfname;
+	/* keep everything from the . after the timestamp */
+	asprintf(&tfname, "%lld%s", m->header_ts, strchr(m->name, '.'));
+	if (verbose)
+		printf("%s/%s/%s to %s (Date: %s)\n", d->folder, d->sub, m->name, tfname, m->datestr);
 
-		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-			fprintf(stderr, "date command exited abnormally (status=%d).\n", status);
-			exit(1); /* return 0 to indicate failure? */
+	if (!dryrun) {
+		struct stat st;
+
+		if ((rename_flags & RENAME_NOREPLACE) == 0) {
+			if (fstatat(sub_fd, tfname, &st, 0) == 0)
+				errno = EEXIST;
+
+			if (errno != ENOENT) {
+				lerror("%s/%s/%s => %s", d->folder, d->sub, m->name, tfname);
+				free(tfname);
+				return;
+			}
 		}
 
-		unsigned long long t = strtoull(bfr, &e, 10);
-		if (*bfr == 0 || (*e != '\n' && *e != 0)) {
-			fprintf(stderr, "Invalid output from date for %s (got %s).\n", datestring, bfr);
-			exit(1);
+		if (renameat2(sub_fd, m->name, sub_fd, tfname, rename_flags) < 0) {
+			lerror("%s/%s/%s => %s", d->folder, d->sub, m->name, tfname);
+			if ((rename_flags & RENAME_NOREPLACE) != 0 && errno == EINVAL &&
+					fstatat(sub_fd, tfname, &st, 0) == -1 && errno == ENOENT) {
+				fprintf(stderr, "We received EINVAL on rename using RENAME_NOREPLACE.  Possibly the filesystem doesn't like this, so please retry using (potentially dangerous) -R.\n");
+				exit(1);
+			}
 		}
-		return t;
 	}
+
+	free(tfname);
+}
+
+/* runs in push order on the main thread */
+static
+void rename_msg_done(void* _m, void*)
+{
+	struct rename_msg *m = _m;
+
+	if (!m->dir) {
+		fputs(m->name, stdout);
+	} else {
+		if (m->error)
+			fputs(m->error, stderr);
+		else if (!m->skip)
+			rename_msg_commit(m);
+		rename_dir_release(m->dir);
+	}
+
+	free(m->error);
+	free(m->name);
+	free(m);
+}
+
+static
+struct rename_msg* rename_msg_new(struct rename_dir* d, const char* name)
+{
+	struct rename_msg *m = calloc(1, sizeof(*m));
+
+	if (!m || !(m->name = strdup(name))) {
+		perror("malloc");
+		exit(1);
+	}
+	m->dir = d;
+	if (d)
+		++d->refs;
+
+	return m;
 }
 
 static
@@ -103,6 +286,12 @@ void __attribute__((noreturn)) usage(int x)
 	fprintf(o, "    Do NOT use REPLACE_NOREPLACE.  This option can potentially destroy email,\n");
 	fprintf(o, "    as an extra safety a stat() call will be made prior to rename, and if the\n");
 	fprintf(o, "    target file exists will be skipped.  This is racey, not to mention bad for performance.\n");
+	fprintf(o, "  --date-coprocess\n");
+	fprintf(o, "    Dates that can't be parsed natively are passed to date(1), use a single long-lived date\n");
+	fprintf(o, "    process for that rather than one per message.\n");
+	fprintf(o, "  -j|--jobs N\n");
+	fprintf(o, "    Read headers from up to N messages concurrently (0 = number of CPUs), renames are\n");
+	fprintf(o, "    still performed (and output) in the normal order.  Default 1.\n");
 	fprintf(o, "  -v|--verbose\n");
 	fprintf(o, "    Be verbose in that renames are output to stdout.\n");
 	fprintf(o, "  -h|--help\n");
@@ -114,6 +303,8 @@ static struct option options[] = {
 	{ "dry-run",		no_argument,		NULL,	'n' },
 	{ "mintime",		no_argument,		NULL,	'm' },
 	{ "replace",		no_argument,		NULL,	'R' },
+	{ "date-coprocess",	no_argument,		&date_coprocess, true },
+	{ "jobs",			required_argument,	NULL,	'j' },
 	{ "verbose",		no_argument,		NULL,	'v' },
 	{ "help",			no_argument,		NULL,	'h' },
 	{ NULL, 0, NULL, 0 },
@@ -122,13 +313,11 @@ static struct option options[] = {
 int main(int argc, char**argv)
 {
 	int c;
-	bool dryrun = false;
-	bool verbose = false;
-	unsigned rename_flags = RENAME_NOREPLACE;
+	struct workqueue *wq;
 
 	progname = *argv;
 
-	while ((c = getopt_long(argc, argv, "hnm:Rv", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hnm:Rvj:", options, NULL)) != -1) {
 		switch (c) {
 		case 0:
 			break;
@@ -154,6 +343,9 @@ int main(int argc, char**argv)
 		case 'v':
 			verbose = true;
 			break;
+		case 'j':
+			jobs = workqueue_parse_jobs(optarg);
+			break;
 		case 'h':
 			usage(0);
 		case '?':
@@ -173,124 +365,62 @@ int main(int argc, char**argv)
 		usage(1);
 	}
 
+	if (date_coprocess)
+		date_coprocess_start();
+
+	wq = workqueue_create(jobs, 0, rename_msg_work, rename_msg_done, NULL);
+
 	for ( ; argv[optind]; ++optind) {
-		if (verbose)
-			printf("Processing %s\n", argv[optind]);
+		if (verbose) {
+			char *line;
+			if (asprintf(&line, "Processing %s\n", argv[optind]) < 0) {
+				perror("asprintf");
+				exit(1);
+			}
+			workqueue_push(wq, rename_msg_new(NULL, line));
+			free(line);
+		}
 		int dir_fd = get_maildir_fd(argv[optind]);
 		if (dir_fd < 0)
 			continue;
 
 		for (const char ** sub = maildir_subs; *sub; ++sub) {
-			int sub_fd = openat(dir_fd, *sub, O_RDONLY);
-			if (sub_fd < 0) {
-				fprintf(stderr, "%s/%s: %s\n", argv[optind], *sub, strerror(errno));
-				continue;
+			struct rename_dir* d = calloc(1, sizeof(*d));
+			if (!d) {
+				perror("malloc");
+				exit(1);
 			}
-
-			DIR* dir= fdopendir(sub_fd);
-			if (!dir) {
+			d->folder = argv[optind];
+			d->sub = *sub;
+			d->dir = dirscan_openat(dir_fd, *sub);
+			if (!d->dir) {
 				fprintf(stderr, "%s/%s: %s\n", argv[optind], *sub, strerror(errno));
-				close(sub_fd);
+				free(d);
 				continue;
 			}
 
-			struct dirent * de;
-			while ((de = readdir(dir))) {
-				if (de->d_type == DT_UNKNOWN) {
-					struct stat st;
-					if (fstatat(sub_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
-						fprintf(stderr, "fstatat(%s/%s/%s): %s", argv[optind], *sub, de->d_name, strerror(errno));
-						continue;
-					}
-					if ((st.st_mode & S_IFMT) == S_IFREG)
-						de->d_type = DT_REG;
-				}
-				if (de->d_type != DT_REG)
-					continue;
-
-				errno = 0;
-				struct mail_header *hd = get_mail_header(sub_fd, de->d_name);
-				if (errno) {
-					fprintf(stderr, "%s/%s/%s: %s\n", argv[optind], *sub, de->d_name, strerror(errno));
-					free_mail_header(hd);
-					continue;
-				}
-
-				//for (struct mail_header *c = hd; c; c = c->next) {
-				//	printf("  %s:\n", c->header);
-				//	for (char ** v = c->value; *v; ++v) {
-				//		printf("    - %s\n", *v);
-				//	}
-				//}
-
-				const struct mail_header *date = find_mail_header(hd, "date");
-
-				if (!date) {
-					fprintf(stderr, "%s/%s/%s: No Date: header found.\n", argv[optind], *sub, de->d_name);
-					free_mail_header(hd);
-					continue;
-				}
-
-				if (date->value[1])
-					fprintf(stderr, "%s/%s/%s: Multiple Date: headers found, using first one.\n", argv[optind], *sub, de->d_name);
-
-				char *endp;
-				unsigned long long header_ts = convert_date(*date->value);
-				unsigned long long filename_ts = strtoull(de->d_name, &endp, 10);
-
-				if (*endp != '.') {
-					fprintf(stderr, "%s/%s/%s: Filename isn't of the format TS.stuff\n",
-							argv[optind], *sub, de->d_name);
-					free_mail_header(hd);
+			struct dirscan_entry * de;
+			while ((de = dirscan_next(d->dir))) {
+				if (de->type != DT_UNKNOWN && de->type != DT_REG)
 					continue;
-				}
-
-				//fprintf(stderr, "%s/%s/%s: header ts: %s = %lld\n", argv[optind], *sub, de->d_name, *date->value, header_ts);
-				//fprintf(stderr, "%s/%s/%s: filename ts: %lld\n", argv[optind], *sub, de->d_name, filename_ts);
 
-				if (filename_ts < header_ts + mintime) {
-					free_mail_header(hd);
-					continue;
-				}
-
-				char *tfname;
-				asprintf(&tfname, "%llu%s", header_ts, endp);
-				if (verbose)
-					printf("%s/%s/%s to %s (Date: %s)\n", argv[optind], *sub, de->d_name, tfname, *date->value);
-				free_mail_header(hd);
-
-				if (!dryrun) {
-					struct stat st;
-
-					if ((rename_flags & RENAME_NOREPLACE) == 0) {
-						if (fstatat(sub_fd, tfname, &st, 0) == 0)
-							errno = EEXIST;
-
-						if (errno != ENOENT) {
-							lerror("%s/%s/%s => %s", argv[optind], *sub, de->d_name, tfname);
-							free(tfname);
-							continue;
-						}
-					}
-
-					if (renameat2(sub_fd, de->d_name, sub_fd, tfname, rename_flags) < 0) {
-						lerror("%s/%s/%s => %s", argv[optind], *sub, de->d_name, tfname);
-						if ((rename_flags & RENAME_NOREPLACE) != 0 && errno == EINVAL &&
-								fstatat(sub_fd, tfname, &st, 0) == -1 && errno == ENOENT) {
-							fprintf(stderr, "We received EINVAL on rename using RENAME_NOREPLACE.  Possibly the filesystem doesn't like this, so please retry using (potentially dangerous) -R.\n");
-							exit(1);
-						}
-					}
-				}
-
-				free(tfname);
+				struct rename_msg *m = rename_msg_new(d, de->name);
+				m->type = de->type;
+				workqueue_push(wq, m);
 			}
 
-			closedir(dir);
+			/* hold a reference of our own so the folder can't be closed
+			 * before listing it completed */
+			++d->refs;
+			d->listed = true;
+			rename_dir_release(d);
 		}
 
 		close(dir_fd);
 	}
 
+	workqueue_finish(wq);
+	header_bufs_free();
+	date_coprocess_stop();
 	return 0;
 }
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "filetools.h"
+#include "hash64.h"
+#include "workqueue.h"
+
+/* files are hashed (mmap()ed) in windows of at most this size */
+#define HASH_WINDOW			(8 << 20)
+#define DEFAULT_INFLIGHT	256 /* MiB */
+
+static const char * progname;
+static int dry_run = 0;
+static int verbose = 0;
+static unsigned jobs = 1;
+
+/* bounds the total size of the windows mapped by all hashing threads */
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_cond = PTHREAD_COND_INITIALIZER;
+static size_t inflight_max = (size_t)DEFAULT_INFLIGHT << 20;
+static size_t inflight = 0;
+
+static size_t hashed_files = 0;
+static unsigned long long hashed_bytes = 0;
+
+struct dupe_file {
+	char *path; /* relative to the base folder */
+	unsigned long long size; /* from S= where possible */
+	unsigned long long hash;
+	unsigned long long timestamp;
+	bool hashed;
+	int err; /* from hashing */
+	unsigned long long bytes; /* actual size, as hashed */
+};
+
+static struct dupe_file *files = NULL;
+static size_t nfiles = 0, afiles = 0;
+
+static
+void __attribute__((noreturn)) usage(int x)
+{
+	FILE *o = x ? stderr : stdout;
+
+	fprintf(o, "USAGE: %s [options] path\n", progname);
+	fprintf(o, "OPTIONS:\n");
+	fprintf(o, "  -n|--dry-run\n");
+	fprintf(o, "    Don't actually do anything, just output what would be done.\n");
+	fprintf(o, "  -v|--verbose\n");
+	fprintf(o, "    Be very verbose, can be specified multiple times.  Should not normally be required.\n");
+	fprintf(o, "    1 time: output when files are already removed.\n");
+	fprintf(o, "    2 time: output initial file selections (this will list all duplicated files).\n");
+	fprintf(o, "  -j|--jobs N\n");
+	fprintf(o, "    Hash up to N files concurrently (0 = number of CPUs).  Default 1.\n");
+	fprintf(o, "  --max-inflight MiB\n");
+	fprintf(o, "    Maximum amount of file content mapped at any point in time whilst hashing.\n");
+	fprintf(o, "    Default %d.\n", DEFAULT_INFLIGHT);
+	fprintf(o, "  -h|--help\n");
+	fprintf(o, "    This help text.\n");
+	fprintf(o, "Files with the same size (S= is trusted where present) are hashed, and where the\n");
+	fprintf(o, "content is identical (verified byte for byte) all but the file with the oldest\n");
+	fprintf(o, "timestamp (the part of the filename before the first .) are removed.  Files without\n");
+	fprintf(o, "timestamps aren't considered.\n");
+	exit(x);
+}
+
+static
+void add_file(int dirfd, const char* rpath, const char* fname)
+{
+	struct dupe_file *f;
+	struct maildir_name mn;
+	unsigned long long size;
+	int err;
+
+	/* the timestamp is everything up to the first ., which must be numeric */
+	if (!(maildir_name_parse(fname, &mn) & MAILDIR_NAME_TIME))
+		return;
+
+	size = mn.size;
+	if (!(mn.fields & MAILDIR_SIZE_S)) {
+		char *name = (char*)fname;
+		maildir_stat_sizes(NULL, dirfd, &name, 1, &size, &err);
+		if (err) {
+			fprintf(stderr, "%s/%s: %s\n", rpath, fname, strerror(err));
+			return;
+		}
+	}
+
+	if (nfiles == afiles) {
+		afiles = afiles ? afiles * 2 : 1024;
+		files = (struct dupe_file*)realloc(files, afiles * sizeof(*files));
+		if (!files) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	f = &files[nfiles++];
+	if (asprintf(&f->path, "%s/%s", rpath, fname) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	f->size = size;
+	f->timestamp = mn.timestamp;
+	f->hashed = false;
+}
+
+static
+void scan_folder(int basefd, const char* rpath)
+{
+	struct dirscan *d = dirscan_openat(basefd, rpath);
+	struct dirscan_entry *de;
+	struct stat st;
+	char *sub;
+
+	if (!d) {
+		perror(rpath);
+		return;
+	}
+
+	while ((de = dirscan_next(d))) {
+		if (dirscan_dots(de))
+			continue;
+
+		if (de->type == DT_UNKNOWN) {
+			if (fstatat(dirscan_fd(d), de->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+				fprintf(stderr, "%s/%s: %s\n", rpath, de->name, strerror(errno));
+				continue;
+			}
+			if (S_ISDIR(st.st_mode))
+				de->type = DT_DIR;
+			else if (S_ISREG(st.st_mode))
+				de->type = DT_REG;
+		}
+
+		if (de->type == DT_DIR) {
+			if (asprintf(&sub, "%s/%s", rpath, de->name) < 0) {
+				perror("asprintf");
+				exit(1);
+			}
+			scan_folder(basefd, sub);
+			free(sub);
+		} else if (de->type == DT_REG) {
+			add_file(dirscan_fd(d), rpath, de->name);
+		}
+	}
+
+	if (errno)
+		perror(rpath);
+	dirscan_close(d);
+}
+
+static
+int dupe_cmp_size(const void* _a, const void* _b)
+{
+	const struct dupe_file *a = (const struct dupe_file*)_a, *b = (const struct dupe_file*)_b;
+
+	if (a->size != b->size)
+		return a->size < b->size ? -1 : 1;
+	return 0;
+}
+
+/* unhashed files (unique sizes) last, then by hash, and path for determinism */
+static
+int dupe_cmp_hash(const void* _a, const void* _b)
+{
+	const struct dupe_file *a = (const struct dupe_file*)_a, *b = (const struct dupe_file*)_b;
+
+	if (a->hashed != b->hashed)
+		return a->hashed ? -1 : 1;
+	if (a->size != b->size)
+		return a->size < b->size ? -1 : 1;
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	return strcmp(a->path, b->path);
+}
+
+static
+void inflight_acquire(size_t bytes)
+{
+	pthread_mutex_lock(&inflight_lock);
+	while (inflight + bytes > inflight_max)
+		pthread_cond_wait(&inflight_cond, &inflight_lock);
+	inflight += bytes;
+	pthread_mutex_unlock(&inflight_lock);
+}
+
+static
+void inflight_release(size_t bytes)
+{
+	pthread_mutex_lock(&inflight_lock);
+	inflight -= bytes;
+	pthread_cond_broadcast(&inflight_cond);
+	pthread_mutex_unlock(&inflight_lock);
+}
+
+static
+int hash_mapped(int fd, unsigned long long size, unsigned long long* hash)
+{
+	size_t window = inflight_max < HASH_WINDOW ? inflight_max : HASH_WINDOW;
+	unsigned long long off;
+	struct hash64 h;
+	void *m;
+
+	hash64_init(&h);
+	for (off = 0; off < size; off += window) {
+		size_t len = size - off < window ? size - off : window;
+
+		inflight_acquire(len);
+		m = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+		if (m == MAP_FAILED) {
+			inflight_release(len);
+			return -1;
+		}
+		madvise(m, len, MADV_SEQUENTIAL);
+		hash64_update(&h, m, len);
+		munmap(m, len);
+		inflight_release(len);
+	}
+
+	*hash = hash64_final(&h);
+	return 0;
+}
+
+/* runs on worker threads */
+static
+void hash_work(void* _f, void* ctx)
+{
+	struct dupe_file *f = (struct dupe_file*)_f;
+	struct stat st;
+	int fd = openat(*(int*)ctx, f->path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) < 0 || hash_mapped(fd, st.st_size, &f->hash) < 0) {
+		f->err = errno;
+	} else {
+		f->hashed = true;
+		f->bytes = st.st_size;
+	}
+
+	if (fd >= 0)
+		close(fd);
+}
+
+/* runs in order on the main thread */
+static
+void hash_done(void* _f, void*)
+{
+	struct dupe_file *f = (struct dupe_file*)_f;
+
+	if (f->hashed) {
+		++hashed_files;
+		hashed_bytes += f->bytes;
+	} else if (f->err == ENOENT) {
+		if (verbose >= 1)
+			printf("%s - already removed.\n", f->path);
+	} else {
+		fprintf(stderr, "%s: %s\n", f->path, strerror(f->err));
+	}
+}
+
+static
+void fire(int basefd, const struct dupe_file* victim, const struct dupe_file* keep,
+		size_t* removed, unsigned long long* freed)
+{
+	printf("%016llx: Firing %s over %s\n", victim->hash, victim->path, keep->path);
+	if (!dry_run && unlinkat(basefd, victim->path, 0) < 0) {
+		perror(victim->path);
+		return;
+	}
+	++*removed;
+	*freed += victim->size;
+}
+
+static struct option options[] = {
+	{ "dry-run",		no_argument,		NULL,	'n' },
+	{ "help",			no_argument,		NULL,	'h' },
+	{ "jobs",			required_argument,	NULL,	'j' },
+	{ "max-inflight",	required_argument,	NULL,	'm' },
+	{ "verbose",		no_argument,		NULL,	'v' },
+	{ NULL, 0, NULL, 0 },
+};
+
+int main(int argc, char** argv)
+{
+	int c, basefd;
+	size_t i, j, removed = 0;
+	unsigned long long freed = 0;
+	struct workqueue *wq;
+	struct timespec start, end;
+	double elapsed;
+	char *endp;
+
+	progname = *argv;
+
+	while ((c = getopt_long(argc, argv, "hj:nv", options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			usage(0);
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'v':
+			++verbose;
+			break;
+		case 'j':
+			jobs = workqueue_parse_jobs(optarg);
+			break;
+		case 'm':
+			inflight_max = strtoul(optarg, &endp, 10);
+			if (!*optarg || *endp || !inflight_max) {
+				fprintf(stderr, "Invalid --max-inflight value %s.\n", optarg);
+				usage(1);
+			}
+			inflight_max <<= 20;
+			break;
+		case '?':
+			usage(1);
+		default:
+			fprintf(stderr, "Option not implemented: %c.\n", c);
+			usage(1);
+		}
+	}
+
+	if (!argv[optind])
+		usage(1);
+
+	if (argv[optind + 1]) {
+		fprintf(stderr, "Checksum files are no longer supported (or needed), content is compared directly.\n");
+		usage(1);
+	}
+
+	basefd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+	if (basefd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	printf("Dry run: %d\n", dry_run);
+	printf("Verbose: %d\n", verbose);
+
+	scan_folder(basefd, ".");
+
+	/* only files that share their size with another can possibly be duplicates */
+	qsort(files, nfiles, sizeof(*files), dupe_cmp_size);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wq = workqueue_create(jobs, 0, hash_work, hash_done, &basefd);
+	for (i = 0; i < nfiles; i = j) {
+		for (j = i + 1; j < nfiles && files[j].size == files[i].size; ++j)
+			;
+		if (j - i < 2)
+			continue;
+		while (i < j)
+			workqueue_push(wq, &files[i++]);
+	}
+	workqueue_finish(wq);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+	printf("Hashed %zu files (%.2f MB) in %.2fs: %.2f MB/s, %.0f files/s.\n", hashed_files,
+			hashed_bytes / 1e6, elapsed, hashed_bytes / 1e6 / elapsed, hashed_files / elapsed);
+
+	qsort(files, nfiles, sizeof(*files), dupe_cmp_hash);
+	for (i = 0; i < nfiles && files[i].hashed; i = j) {
+		const struct dupe_file *keep = &files[i];
+
+		for (j = i + 1; j < nfiles && files[j].hashed && files[j].size == keep->size && files[j].hash == keep->hash; ++j)
+			;
+		if (j - i < 2)
+			continue;
+
+		if (verbose >= 2)
+			printf("%016llx: %s - initial select.\n", keep->hash, keep->path);
+
+		for (size_t k = i + 1; k < j; ++k) {
+			const struct dupe_file *f = &files[k];
+			int r;
+
+			if (f->timestamp == keep->timestamp) {
+				printf("Timestamps for %s and %s are identical, can't choose, please manually fire one\n",
+						f->path, keep->path);
+				continue;
+			}
+
+			r = files_identical_hash(basefd, keep->path, NULL, &keep->hash, basefd, f->path, NULL, &f->hash);
+			if (r < 0)
+				continue;
+			if (!r) {
+				printf("%016llx: %s and %s differ in spite of identical hashes, not removing either.\n",
+						f->hash, f->path, keep->path);
+				continue;
+			}
+
+			/* oldest wins */
+			if (f->timestamp < keep->timestamp) {
+				fire(basefd, keep, f, &removed, &freed);
+				keep = f;
+			} else {
+				fire(basefd, f, keep, &removed, &freed);
+			}
+		}
+	}
+
+	printf("%s %zu duplicates (%llu bytes).\n", dry_run ? "Would have removed" : "Removed", removed, freed);
+
+	for (i = 0; i < nfiles; ++i)
+		free(files[i].path);
+	free(files);
+	close(basefd);
+
+	return 0;
+}
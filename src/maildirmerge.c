@@ -12,12 +12,14 @@
 
 #include "servertypes.h"
 #include "filetools.h"
+#include "fsbatch.h"
 
 static const char* progname = NULL;
 static int force = 0, dry_run = 0, pop3_merge_seen = 0;
 static int pop3_uidl = 0;
 static int subscribe = 0;
 static const char* pop3_redirect = NULL;
+static struct fsbatch* batch = NULL;
 
 static
 void __attribute__((noreturn)) usage(int x)
@@ -41,6 +43,10 @@ void __attribute__((noreturn)) usage(int x)
 	fprintf(o, "    This is mutually exclusive with --pop3-redirect.\n");
 	fprintf(o, "    By default any previously seen messages are left behind if the destination\n");
 	fprintf(o, "    is detected to have POP3 active.  It doesn't care when last POP3 has been used currently.\n");
+	fprintf(o, "  -b|--batch depth\n");
+	fprintf(o, "    Use io_uring to queue up to depth renames at a time rather than performing them\n");
+	fprintf(o, "    one by one (falls back to synchronous renames if io_uring is unavailable).\n");
+	fprintf(o, "    Default 0 (synchronous).\n");
 	fprintf(o, "  --subscribe\n");
 	fprintf(o, "    For unknown folder sources (ie, we're unable to check if the folder is subscribed), auto subscribe.\n");
 	fprintf(o, "    NOTE:  This only takes effect if the source maildir type is unknown/unsupported.\n");
@@ -49,40 +55,74 @@ void __attribute__((noreturn)) usage(int x)
 	exit(x);
 }
 
+struct merge_move_data {
+	const struct maildir_type *stype;
+	void* stype_pvt;
+	struct maildir_type_list *target_types;
+	bool pop3_uidl; /* also transfer the POP3 UIDL */
+};
+
+/* maildir_move() completion, record fname (just moved into target) with the
+ * target's IMAP server(s), keeping the source UID where possible, and if
+ * requested transfer the POP3 UIDL */
+static
+void merge_moved(void* _d, const char* fname, int err)
+{
+	struct merge_move_data *d = _d;
+	struct maildir_type_list *ti;
+	unsigned long uid = 0, uidvalidity = 0;
+
+	if (err)
+		return;
+
+	char *basename = strdupa(fname);
+	char *t = strchr(basename, ':');
+	if (t)
+		*t = 0; /* truncate the fields out of there. */
+
+	if (d->stype && d->stype->imap_get_uid && d->stype->imap_uidvalidity) {
+		uid = d->stype->imap_get_uid(d->stype_pvt, basename);
+		uidvalidity = d->stype->imap_uidvalidity(d->stype_pvt);
+	}
+
+	for (ti = d->target_types; ti; ti = ti->next)
+		if (ti->type->imap_add_uid)
+			ti->type->imap_add_uid(ti->pvt, basename, uid, uidvalidity);
+
+	if (d->pop3_uidl && d->stype && d->stype->pop3_get_uidl) {
+		char *uidl = d->stype->pop3_get_uidl(d->stype_pvt, basename);
+
+		if (uidl) {
+			for (ti = d->target_types; ti; ti = ti->next)
+				if (ti->type->pop3_set_uidl)
+					ti->type->pop3_set_uidl(ti->pvt, basename, uidl);
+			free(uidl);
+		}
+	}
+}
+
 #define out_error_if(x, f, ...) do { if (x) { fprintf(stderr, f ": %s\n", ## __VA_ARGS__, strerror(errno)); goto out; } } while(0)
+/* takes ownership of sourcefd, stype is that of the source mailbox root (sub
+ * folders are not probed individually) */
 static
 void maildir_merge(const char* target, int targetfd, struct maildir_type_list *target_types,
-		const char* source)
+		const char* source, int sourcefd, const struct maildir_type *stype)
 {
-	struct maildir_type_list *source_types, *ti;
-	const struct maildir_type *stype = NULL;
-	int sourcefd = get_maildir_fd(source);
+	struct maildir_type_list *ti;
 	int sfd = -1, tfd = -1, rfd = -1;
 	char *redirectname = NULL;
 	struct stat st;
 	int is_pop3 = 0;
 	void *stype_pvt = NULL;
 
-	DIR* dir;
-	struct dirent *de;
-
-	if (sourcefd < 0)
-		return;
-
-	source_types = maildir_find_type(source);
-	if (source_types) {
-		if (source_types->next) {
-			fprintf(stderr, "%s: multiple types triggered, not proceeding for safety.\n",
-					source);
-			goto out;
-		}
+	struct dirscan* dir = NULL;
+	struct dirscan_entry *de;
 
-		stype = source_types->type;
-		maildir_type_list_free(source_types);
+	if (stype && stype->open)
+		stype_pvt = stype->open(source, sourcefd);
 
-		if (stype->open)
-			stype_pvt = stype->open(source, sourcefd);
-	}
+	struct merge_move_data new_data = { stype, stype_pvt, target_types, false };
+	struct merge_move_data cur_data = { stype, stype_pvt, target_types, pop3_uidl };
 
 	printf("Merging %s (%s) into %s.\n", source, stype ? stype->label : "no type detected", target);
 
@@ -100,16 +140,18 @@ void maildir_merge(const char* target, int targetfd, struct maildir_type_list *t
 	tfd = openat(targetfd, "new", O_RDONLY);
 	out_error_if(tfd < 0, "%s/new", target);
 
-	dir = fdopendir(sfd);
+	dir = dirscan_fdopen(sfd);
+	if (!dir)
+		sfd = -1; /* closed by dirscan_fdopen() */
 	out_error_if(!dir, "%s/new", source);
 
-	while ((de = readdir(dir))) {
-		switch (de->d_type) {
+	while ((de = dirscan_next(dir))) {
+		switch (de->type) {
 			case DT_REG:
 				break;
 			case DT_UNKNOWN:
-				if (fstatat(sfd, de->d_name, &st, 0) < 0) {
-					fprintf(stderr, "%s/cur/%s: %s\n", source, de->d_name, strerror(errno));
+				if (fstatat(sfd, de->name, &st, 0) < 0) {
+					fprintf(stderr, "%s/cur/%s: %s\n", source, de->name, strerror(errno));
 					continue;
 				}
 
@@ -120,9 +162,11 @@ void maildir_merge(const char* target, int targetfd, struct maildir_type_list *t
 				continue;
 		}
 
-		maildir_move(sfd, source, tfd, target, "new", de->d_name, dry_run);
+		maildir_move(batch, sfd, source, tfd, target, "new", de->name, dry_run, merge_moved, &new_data);
 	}
-	closedir(dir); dir = NULL; sfd = -1;
+	if (batch)
+		fsbatch_flush(batch);
+	dirscan_close(dir); dir = NULL; sfd = -1;
 	close(tfd); tfd = -1;
 
 	/* the cur folder is somewhat more involved, there are IMAP UID values, as well
@@ -137,22 +181,27 @@ void maildir_merge(const char* target, int targetfd, struct maildir_type_list *t
 	 *
 	 * These two 'functions' really aught to be merged.
 	 **/
+	if (pop3_uidl && (!stype || !stype->pop3_get_uidl))
+		fprintf(stderr, "UIDL transfer requested but source doesn't support UIDL retrieval.\n");
+
 	sfd = openat(sourcefd, "cur", O_RDONLY);
 	out_error_if(sfd < 0, "%s/cur", source);
 
 	tfd = openat(targetfd, "cur", O_RDONLY);
 	out_error_if(tfd < 0, "%s/cur", target);
 
-	dir = fdopendir(sfd);
+	dir = dirscan_fdopen(sfd);
+	if (!dir)
+		sfd = -1; /* closed by dirscan_fdopen() */
 	out_error_if(!dir, "%s/cur", source);
 
-	while ((de = readdir(dir))) {
-		switch (de->d_type) {
+	while ((de = dirscan_next(dir))) {
+		switch (de->type) {
 			case DT_REG:
 				break;
 			case DT_UNKNOWN:
-				if (fstatat(sfd, de->d_name, &st, 0) < 0) {
-					fprintf(stderr, "%s/cur/%s: %s\n", source, de->d_name, strerror(errno));
+				if (fstatat(sfd, de->name, &st, 0) < 0) {
+					fprintf(stderr, "%s/cur/%s: %s\n", source, de->name, strerror(errno));
 					continue;
 				}
 
@@ -163,29 +212,19 @@ void maildir_merge(const char* target, int targetfd, struct maildir_type_list *t
 				continue;
 		}
 
-		if (!is_pop3 || pop3_merge_seen || !message_seen(de->d_name)) {
-			maildir_move(sfd, source, tfd, target, "cur", de->d_name, dry_run);
-			if (pop3_uidl) {
-				if (!stype || !stype->pop3_get_uidl) {
-					fprintf(stderr, "UIDL transfer requested but source doesn't support UIDL retrieval.\n");
-				} else {
-					char *basename = strdupa(de->d_name);
-					char *t = strchr(basename, ':');
-					if (t)
-						*t = 0; /* truncate the fields out of there. */
-					char *uidl = stype->pop3_get_uidl(stype_pvt, basename);
-
-					if (uidl) {
-						if (dry_run) {
-							printf("Setting UIDL to %s\n", uidl);
-						} else {
-							for (ti = target_types; ti; ti = ti->next) {
-								if (ti->type->pop3_set_uidl)
-									ti->type->pop3_set_uidl(ti->pvt, basename, uidl);
-							}
-						}
-						free(uidl);
-					}
+		if (!is_pop3 || pop3_merge_seen || !message_seen(de->name)) {
+			/* the UIDL is transferred by merge_moved() once the rename succeeded */
+			maildir_move(batch, sfd, source, tfd, target, "cur", de->name, dry_run, merge_moved, &cur_data);
+			if (pop3_uidl && dry_run && stype && stype->pop3_get_uidl) {
+				char *basename = strdupa(de->name);
+				char *t = strchr(basename, ':');
+				if (t)
+					*t = 0;
+				char *uidl = stype->pop3_get_uidl(stype_pvt, basename);
+
+				if (uidl) {
+					printf("Setting UIDL to %s\n", uidl);
+					free(uidl);
 				}
 			}
 		} else if (pop3_redirect) {
@@ -203,14 +242,16 @@ void maildir_merge(const char* target, int targetfd, struct maildir_type_list *t
 				asprintf(&redirectname, "%s/%s", target, pop3_redirect);
 			}
 
-			maildir_move(sfd, source, rfd, redirectname, "cur", de->d_name, dry_run);
+			maildir_move(batch, sfd, source, rfd, redirectname, "cur", de->name, dry_run, NULL, NULL);
 		} else if (dry_run) {
 			printf("%s/cur/%s: left behind (seen, target is POP3, no redirect).\n",
-					source, de->d_name);
+					source, de->name);
 		}
 	}
 
-	closedir(dir); dir = NULL; sfd = -1;
+	if (batch)
+		fsbatch_flush(batch);
+	dirscan_close(dir); dir = NULL; sfd = -1;
 	close(tfd); tfd = -1;
 	if (rfd >= 0) {
 		close(rfd);
@@ -220,19 +261,20 @@ void maildir_merge(const char* target, int targetfd, struct maildir_type_list *t
 	/* at this point, we scan for sub-folders, those are folders starting with
 	 * ., which isn't . or .., at which point we create the sub-folders, and
 	 * recursively merge into them. */
-	dir = fdopendir(sourcefd);
+	dir = dirscan_fdopen(sourcefd);
+	sourcefd = -1; /* taken over by dir, even on failure */
 	if (!dir) {
 		perror(source);
 		goto out;
 	}
 
-	while ((de = readdir(dir))) {
-		switch (de->d_type) {
+	while ((de = dirscan_next(dir))) {
+		switch (de->type) {
 			case DT_DIR:
 				break;
 			case DT_UNKNOWN:
-				if (fstatat(sfd, de->d_name, &st, 0) < 0) {
-					fprintf(stderr, "%s/cur/%s: %s\n", source, de->d_name, strerror(errno));
+				if (fstatat(dirscan_fd(dir), de->name, &st, 0) < 0) {
+					fprintf(stderr, "%s/%s: %s\n", source, de->name, strerror(errno));
 					continue;
 				}
 
@@ -242,41 +284,47 @@ void maildir_merge(const char* target, int targetfd, struct maildir_type_list *t
 			default:
 				continue;
 		}
-		if (de->d_name[0] != '.' || strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+		if (de->name[0] != '.' || dirscan_dots(de))
 			continue;
 
-		printf("sub folder: %s\n", de->d_name);
+		printf("sub folder: %s\n", de->name);
 
-		if (fstatat(targetfd, de->d_name, &st, 0) == 0) {
+		if (fstatat(targetfd, de->name, &st, 0) == 0) {
 			/* we know both the source and destination exist, so we can just go recursively here */
 			char *sub_target;
 			char *sub_source;
-			int sub_target_fd = get_maildir_fd_at(targetfd, de->d_name);
+			int sub_target_fd = get_maildir_fd_at(targetfd, de->name);
 			if (sub_target_fd < 0)
 				continue;
+			int sub_source_fd = get_maildir_fd_at(dirscan_fd(dir), de->name);
+			if (sub_source_fd < 0) {
+				close(sub_target_fd);
+				continue;
+			}
 
-			if (asprintf(&sub_target, "%s/%s", target, de->d_name) < 0) {
+			if (asprintf(&sub_target, "%s/%s", target, de->name) < 0) {
 				fprintf(stderr, "memory error trying to merge %s from %s to %s.\n",
-						de->d_name, source, target);
+						de->name, source, target);
 				close(sub_target_fd);
+				close(sub_source_fd);
 				continue;
 			}
-			if (asprintf(&sub_source, "%s/%s", source, de->d_name) < 0) {
+			if (asprintf(&sub_source, "%s/%s", source, de->name) < 0) {
 				fprintf(stderr, "memory error trying to merge %s from %s to %s.\n",
-						de->d_name, source, target);
+						de->name, source, target);
 				free(sub_target);
 				close(sub_target_fd);
+				close(sub_source_fd);
 				continue;
 			}
 
-			struct maildir_type_list *sub_target_types = maildir_find_type(sub_target);
+			struct maildir_type_list *sub_target_types = maildir_type_list_inherit(target_types);
 			for (ti = sub_target_types; ti; ti = ti->next) {
-				printf("%s: Detected type: %s\n", sub_target, ti->type->label);
 				if (ti->type->open)
 					ti->pvt = ti->type->open(sub_target, sub_target_fd);
 			}
 
-			maildir_merge(sub_target, sub_target_fd, sub_target_types, sub_source);
+			maildir_merge(sub_target, sub_target_fd, sub_target_types, sub_source, sub_source_fd, stype);
 
 			maildir_type_list_free(sub_target_types);
 			free(sub_source);
@@ -285,32 +333,39 @@ void maildir_merge(const char* target, int targetfd, struct maildir_type_list *t
 
 		} else if (errno == ENOENT) {
 			/* it doesn't exist, so we can simply rename into, and then check subscriptions */
-			maildir_move(sourcefd, source, targetfd, target, "", de->d_name, dry_run);
+			maildir_move(batch, dirscan_fd(dir), source, targetfd, target, "", de->name, dry_run, NULL, NULL);
 
-			if (stype ? stype->imap_is_subscribed && stype->imap_is_subscribed(stype_pvt, de->d_name) : subscribe) {
+			if (stype ? stype->imap_is_subscribed && stype->imap_is_subscribed(stype_pvt, de->name) : subscribe) {
 				if (dry_run) {
-					printf("Will subscribe to %s on target.\n", de->d_name);
+					printf("Will subscribe to %s on target.\n", de->name);
 				} else {
 					for (ti = target_types; ti; ti = ti->next) {
 						if (ti->type->imap_subscribe)
-							ti->type->imap_subscribe(ti->pvt, de->d_name);
+							ti->type->imap_subscribe(ti->pvt, de->name);
 					}
 				}
 			}
 		} else {
-			fprintf(stderr, "%s/%s: %s\n", target, de->d_name, strerror(errno));
+			fprintf(stderr, "%s/%s: %s\n", target, de->name, strerror(errno));
 		}
 	}
-	closedir(dir); dir = NULL; sourcefd = -1;
+	if (batch)
+		fsbatch_flush(batch);
+	dirscan_close(dir); dir = NULL;
 
 out:
+	/* error paths may still have renames pending on fds we're about to close */
+	if (batch)
+		fsbatch_flush(batch);
+
 	if (stype && stype->close)
 		stype->close(stype_pvt);
 
 	if (dir)
-		closedir(dir);
+		dirscan_close(dir);
 
-	close(sourcefd);
+	if (sourcefd >= 0)
+		close(sourcefd);
 	if (sfd >= 0)
 		close(sfd);
 	if (tfd >= 0)
@@ -322,8 +377,38 @@ out:
 		free(redirectname);
 }
 
+/* probes the source mailbox root, and merges it (recursively) into target */
+static
+void merge_root(const char* target, int targetfd, struct maildir_type_list *target_types,
+		const char* source)
+{
+	struct maildir_type_list *source_types;
+	const struct maildir_type *stype = NULL;
+	int sourcefd = get_maildir_fd(source);
+
+	if (sourcefd < 0)
+		return;
+
+	source_types = maildir_find_type_at(sourcefd, source);
+	if (source_types) {
+		if (source_types->next) {
+			fprintf(stderr, "%s: multiple types triggered, not proceeding for safety.\n",
+					source);
+			maildir_type_list_free(source_types);
+			close(sourcefd);
+			return;
+		}
+
+		stype = source_types->type;
+		maildir_type_list_free(source_types);
+	}
+
+	maildir_merge(target, targetfd, target_types, source, sourcefd, stype);
+}
+
 static struct option options[] = {
-	{ "dry-run",		no_argument,		NULL,	'd' },
+	{ "batch",			required_argument,	NULL,	'b' },
+	{ "dry-run",		no_argument,		NULL,	'n' },
 	{ "force",			no_argument,		NULL,	'f' },
 	{ "help",			no_argument,		NULL,	'h' },
 	{ "pop3-redirect",	required_argument,	NULL,	'r' },
@@ -336,15 +421,19 @@ static struct option options[] = {
 int main(int argc, char** argv)
 {
 	int c, targetfd;
+	unsigned batch_depth = 0;
 	const char* target;
 	struct maildir_type_list *target_types, *ti;
 
 	progname = *argv;
 
-	while ((c = getopt_long(argc, argv, "fhn", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "b:fhn", options, NULL)) != -1) {
 		switch (c) {
 		case 0:
 			break;
+		case 'b':
+			batch_depth = fsbatch_parse_depth(optarg);
+			break;
 		case 'f':
 			force = 1;
 			break;
@@ -380,7 +469,7 @@ int main(int argc, char** argv)
 	if (targetfd < 0)
 		return 1;
 
-	target_types = maildir_find_type(target);
+	target_types = maildir_find_type_at(targetfd, target);
 	if (!target_types) {
 		fprintf(stderr, "Error detecting destination folder type(s).\n");
 		if (!force) {
@@ -395,14 +484,15 @@ int main(int argc, char** argv)
 			ti->pvt = ti->type->open(target, targetfd);
 	}
 
+	if (batch_depth && !dry_run)
+		batch = fsbatch_new(batch_depth);
+
 	while (argv[optind])
-		maildir_merge(target, targetfd, target_types, argv[optind++]);
+		merge_root(target, targetfd, target_types, argv[optind++]);
 
-	for (ti = target_types; ti; ti = ti->next) {
-		if (ti->type->close)
-			ti->type->close(ti->pvt);
-	}
+	fsbatch_free(batch);
 
+	/* also closes the pvt values */
 	maildir_type_list_free(target_types);
 
 	return 0;
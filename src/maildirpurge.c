@@ -15,10 +15,15 @@
 #include <ctype.h>
 
 #include "servertypes.h"
+#include "filetools.h"
+#include "datetools.h"
+#include "fsbatch.h"
+#include "workqueue.h"
 
 #define lerror(fmt, ...) fprintf(stderr, fmt ": %s.\n", ##__VA_ARGS__, strerror(errno))
 
 #define DEFAULT_MAXAGE		"1 year ago"
+#define STAT_CHUNK			256
 
 static const char* progname = NULL;
 static const char * subsources[] = { "new", "cur", NULL };
@@ -28,59 +33,42 @@ static char* sourcefolder = NULL;
 static size_t sflen = -1;
 static bool recursive = false;
 static bool dry_run = false;
+static bool human = false;
+static bool parse = false;
+static unsigned batch_depth = 0;
+static unsigned jobs = 1;
+
+/* set once a mailbox failed, no further mailboxes are started */
+static bool stop = false;
+
+struct purge_stats {
+	size_t count;
+	size_t failed;
+	unsigned long long size;
+};
 
-static
-time_t maxage2time(const char* maxage)
-{
-	int p[2]; // 0 read, 1 write.
-	FILE* fp;
-	pid_t pid;
-	time_t res = 0;
-	if (pipe(p) < 0) {
-		perror("pipe");
-		exit(1);
-	}
-
-	pid = fork();
-	if (pid < -1) {
-		perror("fork");
-		exit(1);
-	}
-
-	if (pid == 0) {
-		char* args[] = {
-			"date",
-			"+%s",
-			"-d",
-			strdupa(maxage),
-			NULL,
-		};
-		/* stdin */
-		int t = open("/dev/null", O_RDONLY);
-		dup2(t, 0);
-		close(t);
-		/* stdout */
-		dup2(p[1], 1);
-		/* read end */
-		close(p[0]);
-
-		execvp(*args, args);
-		perror("execvp(date)");
-		exit(1);
-	}
-
-	close(p[1]);
-	fp =  fdopen(p[0], "r");
-	if (fscanf(fp, "%lu", &res) != 1) {
-		fprintf(stderr, "Error reading from date sub-process.\n");
-		exit(1);
-	}
-	fclose(fp);
-
-	printf("Archiving email older than: %s", ctime(&res));
+static struct purge_stats total;
+
+/* A single mailbox (root_folder), processed on a worker thread with --jobs,
+ * with its stdout output collected in report and output in order. */
+struct purge_job {
+	char *base;
+	FILE *out;
+	char *report;
+	size_t reportlen;
+	struct fsbatch *batch;
+	struct purge_stats stats; /* over all folders */
+	size_t folders;
+	int ret;
+};
 
-	return res;
-}
+/* a queued unlink */
+struct purge_unlink {
+	struct purge_stats *stats;
+	const char *name;
+	const char *sub;
+	unsigned long long size;
+};
 
 static
 void __attribute__((noreturn)) usage(int x)
@@ -96,11 +84,26 @@ void __attribute__((noreturn)) usage(int x)
 	fprintf(o, "  -s|--sourcefolder sourcefolder\n");
 	fprintf(o, "    If purging should be performed on a source subfolder rather than INBOX\n");
 	fprintf(o, "  -m|--maxage string\n");
-	fprintf(o, "    Maximum age of emails to retain in source folder, this is passed to the\n");
-	fprintf(o, "    date CLI tool using date -d 'string' - so please verify this usage.\n");
+	fprintf(o, "    Maximum age of emails to retain in source folder, as understood by date -d 'string',\n");
+	fprintf(o, "    eg '90 days ago', '2020-01-31' or '@1580428800' (uncommon forms are passed to date).\n");
 	fprintf(o, "    defaults to '%s'.\n", DEFAULT_MAXAGE);
 	fprintf(o, "  -r|--recursive\n");
 	fprintf(o, "    Perform this recursively on all subfolders.\n");
+	fprintf(o, "  -b|--batch depth\n");
+	fprintf(o, "    Use io_uring to queue up to depth unlinks (and stats for messages without S=\n");
+	fprintf(o, "    tags) at a time rather than one by one.  Default 0 (synchronous).\n");
+	fprintf(o, "  --human\n");
+	fprintf(o, "    Output the freed sizes in human readable format.\n");
+	fprintf(o, "  -p|--parse\n");
+	fprintf(o, "    Output the per folder and total statistics in parseable format\n");
+	fprintf(o, "    (path size count failed), with only the statistics on stdout,\n");
+	fprintf(o, "    takes precedence over --human.\n");
+	fprintf(o, "  --from-file LIST\n");
+	fprintf(o, "    Read the root folders to purge (one per line) from LIST (- for stdin), in\n");
+	fprintf(o, "    addition to those given on the command line.\n");
+	fprintf(o, "  -j|--jobs N\n");
+	fprintf(o, "    Purge up to N root folders concurrently (0 = number of CPUs), output is still\n");
+	fprintf(o, "    in the normal order.  Default 1.\n");
 	fprintf(o, "  -h|--help\n");
 	fprintf(o, "    Enable force mode, permits overriding certain safeties.\n");
 	exit(x);
@@ -111,57 +114,173 @@ static struct option options[] = {
 	{ "sourcefolder",	required_argument,	NULL,	's' },
 	{ "maxage",			required_argument,	NULL,	'm' },
 	{ "recursive",		no_argument,		NULL,	'r' },
+	{ "batch",			required_argument,	NULL,	'b' },
+	{ "human",			no_argument,		NULL,	'H' },
+	{ "parse",			no_argument,		NULL,	'p' },
+	{ "from-file",		required_argument,	NULL,	'F' },
+	{ "jobs",			required_argument,	NULL,	'j' },
 	{ NULL, 0, NULL, 0 },
 };
 
 static
-int purge_sub(const char* name, int fd)
+void print_stats(FILE* out, const char* name, const struct purge_stats* st)
+{
+	char bfr[15];
+
+	if (parse)
+		fprintf(out, "%s %llu %zu %zu\n", name, st->size, st->count, st->failed);
+	else if (human)
+		fprintf(out, "%s: %s over %zu messages %s", name, pretty_size(st->size, bfr), st->count,
+				dry_run ? "would be freed" : "freed");
+	else
+		fprintf(out, "%s: %llu B over %zu messages %s", name, st->size, st->count,
+				dry_run ? "would be freed" : "freed");
+
+	if (!parse)
+		fprintf(out, st->failed ? " (%zu failed).\n" : ".\n", st->failed);
+}
+
+static
+void add_stats(struct purge_stats* to, const struct purge_stats* st)
+{
+	to->count += st->count;
+	to->failed += st->failed;
+	to->size += st->size;
+}
+
+static
+void purge_unlink_done(void* _u, const char* fname, const char*, int err)
+{
+	struct purge_unlink *u = _u;
+
+	if (err) {
+		fprintf(stderr, "unlink %s/%s/%s: %s\n", u->name, u->sub, fname, strerror(err));
+		u->stats->failed++;
+	} else {
+		u->stats->count++;
+		u->stats->size += u->size;
+	}
+	free(u);
+}
+
+static
+void purge_message(struct purge_job* job, struct purge_stats* stats, const char* name, const char* sub, int dfd,
+		const char* fname, unsigned long long size)
+{
+	if (dry_run) {
+		/* only the statistics go to stdout with --parse */
+		fprintf(parse ? stderr : job->out, "Would remove %s/%s/%s\n", name, sub, fname);
+		stats->count++;
+		stats->size += size;
+		return;
+	}
+
+	struct purge_unlink *u = malloc(sizeof(*u));
+	if (!u) {
+		perror("malloc");
+		exit(1);
+	}
+	u->stats = stats;
+	u->name = name;
+	u->sub = sub;
+	u->size = size;
+
+	if (job->batch)
+		fsbatch_unlinkat(job->batch, dfd, fname, 0, purge_unlink_done, u);
+	else
+		purge_unlink_done(u, fname, NULL, unlinkat(dfd, fname, 0) < 0 ? errno : 0);
+}
+
+/* messages without S= need a stat first, which is batched as well */
+static
+void purge_pending(struct purge_job* job, struct purge_stats* stats, const char* name, const char* sub, int dfd,
+		char** names, size_t count)
+{
+	unsigned long long sizes[STAT_CHUNK];
+	int errs[STAT_CHUNK];
+	size_t i;
+
+	maildir_stat_sizes(job->batch, dfd, names, count, sizes, errs);
+	for (i = 0; i < count; ++i) {
+		if (errs[i] == ENOENT) {
+			/* already gone */
+		} else {
+			if (errs[i]) {
+				fprintf(stderr, "%s/%s/%s: %s\n", name, sub, names[i], strerror(errs[i]));
+				sizes[i] = 0;
+			}
+			purge_message(job, stats, name, sub, dfd, names[i], sizes[i]);
+		}
+		free(names[i]);
+	}
+}
+
+static
+int purge_sub(struct purge_job* job, const char* name, int fd)
 {
 	int ret = 0;
 	time_t filetime;
-	char * endptr;
+	struct maildir_name mn;
+	struct purge_stats stats = { 0, 0, 0 };
+	char *pending[STAT_CHUNK];
+	size_t npending = 0;
 
 	for (const char ** nn = subsources; *nn; nn++) {
-		int dfd = openat(fd, *nn, O_RDONLY);
-		if (dfd < 0) {
-			fprintf(stderr, "%s/%s: %s\n", name, *nn, strerror(errno));
-			ret = 1;
-			continue;
-		}
-		DIR *dir = fdopendir(dfd);
+		struct dirscan *dir = dirscan_openat(fd, *nn);
 		if (!dir) {
 			fprintf(stderr, "%s/%s: %s\n", name, *nn, strerror(errno));
 			ret = 1;
 			continue;
 		}
-		struct dirent *de;
-		while ((de = readdir(dir))) {
-			if (de->d_type != DT_REG)
+		int dfd = dirscan_fd(dir);
+		struct dirscan_entry *de;
+		while ((de = dirscan_next(dir))) {
+			if (de->type != DT_REG)
 				continue;
 
-			filetime = strtoul(de->d_name, &endptr, 10);
-			if (endptr == de->d_name || !endptr || *endptr != '.') {
-				fprintf(stderr, "Failed to extra timestamp from %s/%s/%s\n", name, *nn, de->d_name);
+			if (!(maildir_name_parse(de->name, &mn) & MAILDIR_NAME_TIME)) {
+				fprintf(stderr, "Failed to extra timestamp from %s/%s/%s\n", name, *nn, de->name);
 				continue;
 			}
+			filetime = mn.timestamp;
 
 			if (filetime >= maxage)
 				continue;
 
-			if (dry_run)
-				printf("Would remove %s/%s/%s\n", name, *nn, de->d_name);
-			else
-				unlinkat(dfd, de->d_name, 0);
+			if (mn.fields & MAILDIR_SIZE_S) {
+				purge_message(job, &stats, name, *nn, dfd, de->name, mn.size);
+				continue;
+			}
+
+			if (!(pending[npending++] = strdup(de->name))) {
+				perror("strdup");
+				exit(1);
+			}
+			if (npending == STAT_CHUNK) {
+				purge_pending(job, &stats, name, *nn, dfd, pending, npending);
+				npending = 0;
+			}
 		}
-		closedir(dir); /* closes dfd */
+		purge_pending(job, &stats, name, *nn, dfd, pending, npending);
+		npending = 0;
+		/* the queued unlinks reference dfd */
+		if (job->batch)
+			fsbatch_flush(job->batch);
+		dirscan_close(dir); /* closes dfd */
 	}
+
+	print_stats(job->out, name, &stats);
+	add_stats(&job->stats, &stats);
+	job->folders++;
+
 	return ret;
 }
 
 static
-int purge(const char* base)
+int purge(struct purge_job* job)
 {
 	int ret = 0;
+	const char *base = job->base;
 
 	int basefd = open(base, O_RDONLY);
 	if (basefd < 0) {
@@ -169,41 +288,56 @@ int purge(const char* base)
 		goto errout;
 	}
 
+	if (batch_depth)
+		job->batch = fsbatch_new(batch_depth);
+
 	if (!sourcefolder)
-		purge_sub(base, basefd);
+		purge_sub(job, base, basefd);
 
 	if (sourcefolder || recursive) {
-		DIR* dir = fdopendir(dup(basefd));
-		struct dirent *de;
-		while ((de = readdir(dir))) {
+		struct dirscan* dir = dirscan_fdopen(dup(basefd));
+		struct dirscan_entry *de;
+		while (dir && (de = dirscan_next(dir))) {
 			char * sfname;
-			if (*de->d_name != '.' || strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			if (*de->name != '.' || dirscan_dots(de))
 				continue;
 			if (sourcefolder) {
-				if (strncmp(de->d_name, sourcefolder, sflen))
+				if (de->namelen < sflen || strncmp(de->name, sourcefolder, sflen))
 					continue;
-				if (de->d_name[sflen] && (!recursive || de->d_name[sflen] != '.'))
+				if (de->name[sflen] && (!recursive || de->name[sflen] != '.'))
 					continue;
 			}
 
-			if (de->d_type == DT_UNKNOWN) {
+			if (de->type == DT_UNKNOWN) {
 				static int warned = 0;
-				if (!warned) {
-					fprintf(stderr, "readdir() doesn't provide d_type, assuming everything is folders to avoid costly stat() calls.\n");
-					warned = 1;
-				}
-			} else if (de->d_type != DT_DIR)
+				if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+					fprintf(stderr, "getdents() doesn't provide d_type, assuming everything is folders to avoid costly stat() calls.\n");
+			} else if (de->type != DT_DIR)
 				continue;
 
-			int sfd = openat(basefd, de->d_name, O_RDONLY);
-			asprintf(&sfname, "%s/%s", base, de->d_name);
-			ret |= purge_sub(sfname, sfd);
+			int sfd = openat(basefd, de->name, O_RDONLY);
+			asprintf(&sfname, "%s/%s", base, de->name);
+			ret |= purge_sub(job, sfname, sfd);
 			close(sfd);
+			free(sfname);
 		}
-		closedir(dir);
+		if (dir)
+			dirscan_close(dir);
+		else
+			perror(base);
+	}
+
+	/* only where there could be more than one folder */
+	if (job->folders && (sourcefolder || recursive)) {
+		char *label;
+		asprintf(&label, parse ? "MAILBOX %s" : "Mailbox %s", base);
+		print_stats(job->out, label, &job->stats);
+		free(label);
 	}
 
 cleanup:
+	fsbatch_free(job->batch);
+	job->batch = NULL;
 	if (basefd >= 0)
 		close(basefd);
 
@@ -213,14 +347,71 @@ errout:
 	goto cleanup;
 }
 
+/* runs on worker threads */
+static
+void purge_work(void* _job, void*)
+{
+	struct purge_job *job = _job;
+
+	if (jobs <= 1) {
+		/* no need to buffer, output as we go */
+		job->out = stdout;
+	} else if (!(job->out = open_memstream(&job->report, &job->reportlen))) {
+		perror("open_memstream");
+		exit(1);
+	}
+
+	job->ret = purge(job);
+
+	if (job->out != stdout)
+		fclose(job->out);
+}
+
+/* runs in push order on the main thread */
+static
+void purge_done(void* _job, void*)
+{
+	struct purge_job *job = _job;
+
+	if (job->report) {
+		fwrite(job->report, 1, job->reportlen, stdout);
+		fflush(stdout);
+	}
+
+	add_stats(&total, &job->stats);
+	if (job->ret)
+		stop = true;
+
+	free(job->report);
+	free(job->base);
+	free(job);
+}
+
+static
+bool queue_mailbox(void* wq, const char* base)
+{
+	if (stop)
+		return false;
+
+	struct purge_job *job = calloc(1, sizeof(*job));
+	if (!job || !(job->base = strdup(base))) {
+		perror("malloc");
+		exit(1);
+	}
+
+	workqueue_push(wq, job);
+	return true;
+}
+
 int main(int argc, char** argv)
 {
 	int c;
-	const char* _maxage = DEFAULT_MAXAGE;
+	const char *_maxage = DEFAULT_MAXAGE, *from_file = NULL;
+	struct workqueue *wq;
 
 	progname = *argv;
 
-	while ((c = getopt_long(argc, argv, "ns:m:r", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "ns:m:rb:pj:", options, NULL)) != -1) {
 		switch (c) {
 		case 0:
 			break;
@@ -237,6 +428,21 @@ int main(int argc, char** argv)
 		case 'r':
 			recursive = true;
 			break;
+		case 'b':
+			batch_depth = fsbatch_parse_depth(optarg);
+			break;
+		case 'H':
+			human = true;
+			break;
+		case 'p':
+			parse = true;
+			break;
+		case 'F':
+			from_file = optarg;
+			break;
+		case 'j':
+			jobs = workqueue_parse_jobs(optarg);
+			break;
 		case 'h':
 			usage(0);
 		case '?':
@@ -248,25 +454,33 @@ int main(int argc, char** argv)
 		}
 	}
 
-	maxage = maxage2time(_maxage);
+	long long t;
+	if (parse_date_option(_maxage, &t))
+		maxage = t;
 	if (!maxage) {
 		fprintf(stderr, "Error converting '%s' to a date and time structure.\n",
 				_maxage);
 		usage(1);
 	}
+	/* keep --parse output machine readable */
+	if (!parse)
+		printf("Purging email older than: %s", ctime(&maxage));
 
-	printf("maxage=%lu\n", maxage);
-
-	if (!argv[optind]) {
+	if (!argv[optind] && !from_file) {
 		fprintf(stderr, "At least one maildir should be specified.\n");
 		usage(1);
 	}
 
-	while (argv[optind]) {
-		int r = purge(argv[optind++]);
-		if (r)
-			return r;
+	wq = workqueue_create(jobs, 0, purge_work, purge_done, NULL);
+	while (argv[optind] && queue_mailbox(wq, argv[optind]))
+		++optind;
+	if (from_file && read_lines(from_file, queue_mailbox, wq) < 0) {
+		perror(from_file);
+		stop = true;
 	}
+	workqueue_finish(wq);
+
+	print_stats(stdout, parse ? "TOTAL" : "Total", &total);
 
-	return 0;
+	return stop ? 1 : 0;
 }
@@ -84,8 +84,8 @@ int mdir(const char* target, int targetfd, const char* source, int sourcefd, con
 		struct stat st;
 
 		int linkto, linkfrom;
-		DIR* dir;
-		struct dirent* de;
+		struct dirscan* dir;
+		struct dirscan_entry* de;
 
 		int nocopy = base[0] == '-';
 		if (nocopy)
@@ -126,30 +126,29 @@ int mdir(const char* target, int targetfd, const char* source, int sourcefd, con
 			continue;
 		}
 
-		dir = fdopendir(linkfrom);
+		dir = dirscan_fdopen(linkfrom);
 		if (!dir) {
 			mdir_perror(source, base);
 			close(linkto);
-			close(linkfrom);
 			continue;
 		}
 
-		while ((de = readdir(dir))) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+		while ((de = dirscan_next(dir))) {
+			if (dirscan_dots(de))
 				continue;
 
-			if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN /* fstat below will reveal */) {
-				mdir_error(source, "%s/%s is not a regular file!", base, de->d_name);
+			if (de->type != DT_REG && de->type != DT_UNKNOWN /* fstat below will reveal */) {
+				mdir_error(source, "%s/%s is not a regular file!", base, de->name);
 				continue;
 			}
 
-			if (fstatat(linkfrom, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
-				mdir_fmt_error(source, "%s/%s", base, de->d_name);
+			if (fstatat(linkfrom, de->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+				mdir_fmt_error(source, "%s/%s", base, de->name);
 				continue;
 			}
 
 			if (!S_ISREG(st.st_mode)) {
-				mdir_error(source, "%s/%s is not a regular file!", base, de->d_name);
+				mdir_error(source, "%s/%s is not a regular file!", base, de->name);
 				continue;
 			}
 
@@ -160,12 +159,12 @@ int mdir(const char* target, int targetfd, const char* source, int sourcefd, con
 			}
 
 retry_link:
-			if (linkat(linkfrom, de->d_name, linkto, de->d_name, 0) == 0)
+			if (linkat(linkfrom, de->name, linkto, de->name, 0) == 0)
 				continue; /* we're done */
 
 			if (errno != EEXIST) {
 				fprintf(stderr, "Error linking %s from %s%s%s/%s/ to %s%s%s/%s/: %s.\n",
-						de->d_name,
+						de->name,
 						source, rel ? "/" : "", rel ?: "", base,
 						target, rel ? "/" : "", rel ?: "", base,
 						strerror(errno));
@@ -177,28 +176,28 @@ retry_link:
 			 * sure that they are identical (in content), if not, use the
 			 * later mtime one */
 
-			int r = files_identical(linkfrom, de->d_name, &st, linkto, de->d_name, NULL);
+			int r = files_identical(linkfrom, de->name, &st, linkto, de->name, NULL);
 
 			if (r == 0) {
 				struct stat st2;
 				/* only do this for meta files, a few duplicate downloads etc is probably OK
 				 * but with email files we want to take no chances */
-				if (extra && fstatat(linkto, de->d_name, &st2, AT_SYMLINK_NOFOLLOW) == 0) {
+				if (extra && fstatat(linkto, de->name, &st2, AT_SYMLINK_NOFOLLOW) == 0) {
 					if (timespec_cmp(&st2.st_mtim, &st.st_mtim) < 0) {
-						if (unlinkat(linkto, de->d_name, 0) < 0) {
-							mdir_perror(target, de->d_name);
+						if (unlinkat(linkto, de->name, 0) < 0) {
+							mdir_perror(target, de->name);
 						} else
 							goto retry_link;
 					}
 				} else {
 					mdir_error(target, "%s/%s: alternative file available at %s%s%s/%s/.\n",
-							base, de->d_name, source, rel ? "/" : "", rel ?: "", base);
+							base, de->name, source, rel ? "/" : "", rel ?: "", base);
 				}
 			} else if (r < 0)
 				ec++; /* files_identical will already have output an error */
 		}
 
-		closedir(dir); /* linkfrom */
+		dirscan_close(dir); /* linkfrom */
 		close(linkto);
 	}
 	return ec;
@@ -208,10 +207,10 @@ static
 int overlay(const char* target, int targetfd, const char* source, const char* const * metafiles, int root){
 	int sourcefd = open(source, O_RDONLY | O_DIRECTORY);
 	int ec = 0;
-	DIR *dir;
+	struct dirscan *dir;
 	const char **extra_folders = NULL;
 	int efc = 0, efm = 0;
-	struct dirent *de;
+	struct dirscan_entry *de;
 	struct stat st;
 	const char * const * mfscan;
 
@@ -220,54 +219,54 @@ int overlay(const char* target, int targetfd, const char* source, const char* co
 		return 1;
 	}
 
-	dir = fdopendir(dup(sourcefd));
+	dir = dirscan_fdopen(dup(sourcefd));
 	if (!dir) {
 		perror(source);
 		fprintf(stderr, "meta files/folders, and sub-folders in the case of mail root, will not be able to be synced.");
 		ec++;
 	} else {
-		while ((de = readdir(dir))) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0
-					|| strcmp(de->d_name, "new") == 0
-					|| strcmp(de->d_name, "cur") == 0
-					|| strcmp(de->d_name, "tmp") == 0
-					|| strcmp(de->d_name, "maildirfolder") == 0
-					|| strcmp(de->d_name, "maildirsize") == 0)
+		while ((de = dirscan_next(dir))) {
+			if (dirscan_dots(de)
+					|| strcmp(de->name, "new") == 0
+					|| strcmp(de->name, "cur") == 0
+					|| strcmp(de->name, "tmp") == 0
+					|| strcmp(de->name, "maildirfolder") == 0
+					|| strcmp(de->name, "maildirsize") == 0)
 				continue;
 
 			mfscan = metafiles;
-			while (*mfscan && strcmp(de->d_name, *mfscan) != 0)
+			while (*mfscan && strcmp(de->name, *mfscan) != 0)
 				++mfscan;
 
-			if (de->d_type == DT_UNKNOWN) {
-				if (fstatat(sourcefd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
-					fprintf(stderr, "%s/%s: %s.\n", source, de->d_name, strerror(errno));
+			if (de->type == DT_UNKNOWN) {
+				if (fstatat(sourcefd, de->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+					fprintf(stderr, "%s/%s: %s.\n", source, de->name, strerror(errno));
 					ec++;
 					continue;
 				}
 			} else
 				st.st_mode = 0; /* our marker, also stops S_IS* from working. */
 
-			if (de->d_type == DT_DIR || S_ISDIR(st.st_mode)) {
-				if (de->d_name[0] == '.') {
+			if (de->type == DT_DIR || S_ISDIR(st.st_mode)) {
+				if (de->name[0] == '.') {
 					if (root) {
 						char *starget = NULL, *ssource = NULL;
 						int sfd = -1, t;
 
-						asprintf(&starget, "%s/%s", target, de->d_name);
-						asprintf(&ssource, "%s/%s", source, de->d_name);
+						asprintf(&starget, "%s/%s", target, de->name);
+						asprintf(&ssource, "%s/%s", source, de->name);
 						if (!starget || !ssource) {
-							fprintf(stderr, "Memory allocation error trying to traverse into %s/%s - skipping.", source, de->d_name);
+							fprintf(stderr, "Memory allocation error trying to traverse into %s/%s - skipping.", source, de->name);
 							ec++;
 							free(starget);
 							free(ssource);
 							continue;
 						}
 
-						if (mkdirat(targetfd, de->d_name, 0700) < 0 && errno != EEXIST) {
+						if (mkdirat(targetfd, de->name, 0700) < 0 && errno != EEXIST) {
 							fprintf(stderr, "mkdir(%s): %s.\n", starget, strerror(errno));
 							ec++;
-						} else if ((sfd = openat(targetfd, de->d_name, O_RDONLY | O_DIRECTORY)) < 0) {
+						} else if ((sfd = openat(targetfd, de->name, O_RDONLY | O_DIRECTORY)) < 0) {
 							fprintf(stderr, "open(%s): %s.\n", starget, strerror(errno));
 							ec++;
 						} else {
@@ -285,7 +284,7 @@ int overlay(const char* target, int targetfd, const char* source, const char* co
 						free(ssource);
 					} else {
 						fprintf(stderr, "Sub-folder %s under sub-folder in %s?\n",
-								de->d_name, source);
+								de->name, source);
 					}
 				} else if (*mfscan) {
 					if (efc >= efm) {
@@ -294,16 +293,16 @@ int overlay(const char* target, int targetfd, const char* source, const char* co
 					}
 					extra_folders[efc++] = *mfscan;
 				} else {
-					fprintf(stderr, "WARNING: %s/%s isn't a known maildir file, and is not a known metadata file, ignoring.\n", source, de->d_name);
+					fprintf(stderr, "WARNING: %s/%s isn't a known maildir file, and is not a known metadata file, ignoring.\n", source, de->name);
 				}
-			} else if (de->d_type == DT_REG || S_ISREG(st.st_mode)) {
+			} else if (de->type == DT_REG || S_ISREG(st.st_mode)) {
 				if (!*mfscan) {
-					fprintf(stderr, "WARNING: %s/%s isn't a known maildir file, and is not a known metadata file, ignoring.\n", source, de->d_name);
+					fprintf(stderr, "WARNING: %s/%s isn't a known maildir file, and is not a known metadata file, ignoring.\n", source, de->name);
 					continue;
 				}
 
-				if (st.st_mode == 0 && fstatat(sourcefd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
-					fprintf(stderr, "%s/%s: %s.\n", source, de->d_name, strerror(errno));
+				if (st.st_mode == 0 && fstatat(sourcefd, de->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+					fprintf(stderr, "%s/%s: %s.\n", source, de->name, strerror(errno));
 					ec++;
 					continue;
 				}
@@ -315,12 +314,12 @@ int overlay(const char* target, int targetfd, const char* source, const char* co
 				}
 
 retry_link:
-				if (linkat(sourcefd, de->d_name, targetfd, de->d_name, 0) == 0)
+				if (linkat(sourcefd, de->name, targetfd, de->name, 0) == 0)
 					continue; /* we're done */
 
 				if (errno != EEXIST) {
 					fprintf(stderr, "Error linking %s from %s/ to %s/: %s.\n",
-							de->d_name, source, target, strerror(errno));
+							de->name, source, target, strerror(errno));
 					ec++;
 					continue;
 				}
@@ -329,35 +328,35 @@ retry_link:
 				 * sure that they are identical (in content), if not, use the
 				 * later mtime one */
 
-				int r = files_identical(sourcefd, de->d_name, &st, targetfd, de->d_name, NULL);
+				int r = files_identical(sourcefd, de->name, &st, targetfd, de->name, NULL);
 
 				if (r == 0) {
 					struct stat st2;
 					/* only do this for meta files, a few duplicate downloads etc is probably OK
 					 * but with email files we want to take no chances */
-					if (fstatat(targetfd, de->d_name, &st2, AT_SYMLINK_NOFOLLOW) == 0) {
+					if (fstatat(targetfd, de->name, &st2, AT_SYMLINK_NOFOLLOW) == 0) {
 						if (timespec_cmp(&st2.st_mtim, &st.st_mtim) < 0) {
-							if (unlinkat(targetfd, de->d_name, 0) < 0) {
+							if (unlinkat(targetfd, de->name, 0) < 0) {
 								fprintf(stderr, "unlink(%s/%s): %s.\n",
-										target, de->d_name, strerror(errno));
+										target, de->name, strerror(errno));
 								ec++;
 							} else
 								goto retry_link;
 						}
 					} else {
-						fprintf(stderr, "fstatat(%s/%s): %s.\n", target, de->d_name, strerror(errno));
+						fprintf(stderr, "fstatat(%s/%s): %s.\n", target, de->name, strerror(errno));
 						ec++;
 					}
 				} else if (r < 0)
 					ec++; /* files_identical will already have output an error */
 			} else {
 				fprintf(stderr, "%s/%s is neither a file nor a folder ... ?\n",
-						source, de->d_name);
+						source, de->name);
 				ec++;
 			}
 		}
 
-		closedir(dir);
+		dirscan_close(dir);
 
 		if (extra_folders)
 			extra_folders[efc] = 0;
@@ -419,20 +418,20 @@ int main(int argc, char** argv)
 			perror(target);
 			return 1;
 		}
-		DIR *dir = fdopendir(tfd);
+		struct dirscan *dir = dirscan_fdopen(tfd);
 		if (!dir) {
 			perror(target);
 			return 1;
 		}
-		struct dirent *d;
-		while ((d = readdir(dir))) {
-			if (strcmp(d->d_name, ".") && strcmp(d->d_name, "..")) {
+		struct dirscan_entry *d;
+		while ((d = dirscan_next(dir))) {
+			if (!dirscan_dots(d)) {
 				fprintf(stderr, "Target folder %s is not an empty folder.\n",
 						target);
 				return 1;
 			}
 		}
-		closedir(dir);
+		dirscan_close(dir);
 	}
 
 	c = 0;
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <getopt.h>
 #include <unistd.h>
@@ -8,6 +10,14 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+
+#include "filetools.h"
+#include "workqueue.h"
+#include "strmap.h"
+#include "fsbatch.h"
 
 static const char * progname;
 static const char * maildir_subs[] = { "cur", "new", NULL }; /* ignore tmp here */
@@ -17,29 +27,250 @@ static const char * maildir_subs[] = { "cur", "new", NULL }; /* ignore tmp here
 #define OUTPUT_TOTALSIZE	2
 #define OUTPUT_MESSAGECOUNT	3
 
+#define CACHE_USE			0
+#define CACHE_VERIFY		1
+#define CACHE_REBUILD		2
+
+#define CACHE_HEADER		"maildirsizes-cache 2"
+
+#define MAILDIRSIZE_NONE	0
+#define MAILDIRSIZE_REWRITE	1
+#define MAILDIRSIZE_UPDATE	2
+
+/* as per Maildir++, larger files should be recalculated */
+#define MAILDIRSIZE_MAX		5120
+
 static int human = 0;
 static int parse = 0;
 static int output = OUTPUT_ALL;
+static unsigned jobs = 1;
+static unsigned stat_batch = 0;
+static int rfc822 = 0;
+static int show_stats = 0;
+static bool first_mailbox = true;
+
+static int maildirsize_mode = MAILDIRSIZE_NONE;
+static const char* quota_spec = NULL;
+
+static const char* cache_file = NULL;
+static int cache_mode = CACHE_USE;
+static time_t cache_cutoff;
+static struct strmap cache_old = STRMAP_INIT; /* read only whilst workers are running */
+static struct strmap cache_new = STRMAP_INIT;
+static struct strmap cache_roots = STRMAP_INIT;
+static size_t cache_hits = 0, cache_misses = 0, cache_mismatches = 0;
+
+/* identifies the state of a cur/ or new/ folder, if this is unchanged the
+ * set of files in the folder (and thus their S= values) is unchanged. */
+struct dir_stamp {
+	unsigned long long dev, ino;
+	long long sec;
+	long nsec;
+};
+
+struct cache_entry {
+	const char* root; /* realpath() of the mailbox */
+	const char* rpath;
+	struct dir_stamp stamp[2]; /* as per maildir_subs */
+	size_t size, wsize, count;
+};
+
+struct mailbox_scan {
+	const char* path;
+	char* abspath; /* only if caching */
+	int fd;
+	size_t size, wsize, count;
+	size_t stats;
+	size_t pending; /* number of folder scans not yet passed through folder_done */
+	bool complete; /* all folders have been queued */
+};
+
+struct folder_scan {
+	struct mailbox_scan *mbox;
+	char *rpath; /* "" for INBOX */
+	size_t size, wsize, count;
+	size_t stats; /* number of messages without S= that had to be stat'ed */
+
+	bool stamped; /* stamp is valid */
+	struct dir_stamp stamp[2];
+	const struct cache_entry *cached; /* matching (by stamp) entry from cache_old */
+};
+
+static
+bool dir_stamp_get(int fd, struct dir_stamp stamp[2])
+{
+	struct stat st;
+	int i;
+
+	for (i = 0; maildir_subs[i]; ++i) {
+		if (fstatat(fd, maildir_subs[i], &st, 0) < 0)
+			return false;
+		stamp[i].dev = st.st_dev;
+		stamp[i].ino = st.st_ino;
+		stamp[i].sec = st.st_mtim.tv_sec;
+		stamp[i].nsec = st.st_mtim.tv_nsec;
+	}
+	return true;
+}
+
+static
+bool dir_stamp_equal(const struct dir_stamp a[2], const struct dir_stamp b[2])
+{
+	return memcmp(a, b, sizeof(*a) * 2) == 0;
+}
+
+static
+char* cache_key(const char* root, const char* rpath)
+{
+	char *k;
+	if (asprintf(&k, "%s\t%s", root, rpath) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	return k;
+}
+
+static
+void cache_add(struct strmap* m, const char* root, const char* rpath,
+		const struct dir_stamp stamp[2], size_t size, size_t wsize, size_t count)
+{
+	char *k = cache_key(root, rpath);
+	struct strmap_entry *e = strmap_insert(m, k, strlen(k), NULL);
+	struct cache_entry *ce = e->value;
+
+	free(k);
+	if (!ce) {
+		ce = strmap_alloc(m, sizeof(*ce));
+		/* the key is root\trpath, NUL separate it to obtain both */
+		char *r = strmap_alloc(m, e->keylen + 1);
+		memcpy(r, e->key, e->keylen + 1);
+		r[strlen(root)] = 0;
+		ce->root = r;
+		ce->rpath = r + strlen(root) + 1;
+		e->value = ce;
+	}
+	memcpy(ce->stamp, stamp, sizeof(ce->stamp));
+	ce->size = size;
+	ce->wsize = wsize;
+	ce->count = count;
+}
 
 static
-char* pretty_size(size_t input, char * buffer /* should be at least 12 bytes "XXXX.XX XiB" */)
+void cache_load()
 {
-	size_t rem = 0;
-	const char *units = "kMGTPEZY";
-	const char *unit = NULL;
+	char *line = NULL;
+	size_t lsize = 0;
+	ssize_t len;
+	unsigned lineno = 1;
+	FILE *fp;
+
+	if (cache_mode == CACHE_REBUILD)
+		return;
+
+	fp = fopen(cache_file, "r");
+	if (!fp) {
+		if (errno != ENOENT)
+			perror(cache_file);
+		return;
+	}
+
+	if ((len = getline(&line, &lsize, fp)) < 0 || strcmp(line, CACHE_HEADER "\n") != 0) {
+		fprintf(stderr, "%s: unrecognised cache file format, ignoring.\n", cache_file);
+		goto out;
+	}
+
+	while ((len = getline(&line, &lsize, fp)) > 0) {
+		struct dir_stamp stamp[2];
+		size_t size, wsize, count;
+		int off = 0;
+		char *root, *rpath;
+
+		++lineno;
+		if (line[len - 1] == '\n')
+			line[--len] = 0;
+
+		if (sscanf(line, "%zu %zu %zu %llu %llu %lld %ld %llu %llu %lld %ld\t%n", &size, &wsize, &count,
+					&stamp[0].dev, &stamp[0].ino, &stamp[0].sec, &stamp[0].nsec,
+					&stamp[1].dev, &stamp[1].ino, &stamp[1].sec, &stamp[1].nsec, &off) != 11 || !off
+				|| !(rpath = strchr(root = line + off, '\t'))) {
+			fprintf(stderr, "%s:%u: invalid cache entry, ignoring.\n", cache_file, lineno);
+			continue;
+		}
+		*rpath++ = 0;
+
+		cache_add(&cache_old, root, rpath, stamp, size, wsize, count);
+	}
+
+out:
+	free(line);
+	fclose(fp);
+}
+
+static
+void cache_write_entry(FILE* fp, const struct cache_entry* ce)
+{
+	fprintf(fp, "%zu %zu %zu %llu %llu %lld %ld %llu %llu %lld %ld\t%s\t%s\n", ce->size, ce->wsize, ce->count,
+			ce->stamp[0].dev, ce->stamp[0].ino, ce->stamp[0].sec, ce->stamp[0].nsec,
+			ce->stamp[1].dev, ce->stamp[1].ino, ce->stamp[1].sec, ce->stamp[1].nsec,
+			ce->root, ce->rpath);
+}
+
+static
+void cache_save()
+{
+	char *tmpname;
+	FILE *fp;
+	int fd;
+
+	if (asprintf(&tmpname, "%s.XXXXXX", cache_file) < 0) {
+		perror("asprintf");
+		return;
+	}
+
+	fd = mkstemp(tmpname);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror(tmpname);
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmpname);
+		}
+		free(tmpname);
+		return;
+	}
+
+	fprintf(fp, "%s\n", CACHE_HEADER);
+
+	/* retain entries for mailboxes that we didn't scan on this run */
+	strmap_foreach(&cache_old, e) {
+		const struct cache_entry *ce = e->value;
+		if (!strmap_find(&cache_roots, ce->root, strlen(ce->root)))
+			cache_write_entry(fp, ce);
+	}
+
+	strmap_foreach(&cache_new, e)
+		cache_write_entry(fp, e->value);
 
-	while (*units && input >= 1024) {
-		rem = input & 0x3ff;
-		input >>= 10;
-		unit = units++;
+	if (fflush(fp) != 0 || fsync(fd) < 0 || fclose(fp) != 0) {
+		perror(tmpname);
+		unlink(tmpname);
+	} else if (rename(tmpname, cache_file) < 0) {
+		fprintf(stderr, "rename(%s, %s): %s\n", tmpname, cache_file, strerror(errno));
+		unlink(tmpname);
 	}
 
-	if (unit)
-		sprintf(buffer, "%.2f %ciB", input + rem / 1024.0, *unit);
-	else
-		sprintf(buffer, "%zu B", input);
+	free(tmpname);
+}
 
-	return buffer;
+/* runs on worker threads, cache_old is read-only by then */
+static
+const struct cache_entry* cache_lookup(const struct folder_scan* f)
+{
+	char *k = cache_key(f->mbox->abspath, f->rpath);
+	const struct strmap_entry *e = strmap_find(&cache_old, k, strlen(k));
+	const struct cache_entry *ce = e ? e->value : NULL;
+
+	free(k);
+	return ce && dir_stamp_equal(ce->stamp, f->stamp) ? ce : NULL;
 }
 
 static
@@ -56,155 +287,553 @@ void __attribute__((noreturn)) usage(int x)
 	fprintf(o, "  --totalonly|--sizeonly|--countonly\n");
 	fprintf(o, "    Without these options all individual folders are listed as well.\n");
 	fprintf(o, "    Last one specified takes precedence.\n");
+	fprintf(o, "  --rfc822,-w\n");
+	fprintf(o, "    Also output the RFC822 sizes (from W= tags, the file size is used for\n");
+	fprintf(o, "    messages that don't have one), also with --sizeonly.\n");
+	fprintf(o, "  --stats\n");
+	fprintf(o, "    Also output the number of messages without S= tags, which had to be stat'ed.\n");
+	fprintf(o, "  --batch,-b depth\n");
+	fprintf(o, "    Use io_uring to batch the stat calls for messages without S= tags,\n");
+	fprintf(o, "    up to depth at a time.  Default 0 (one at a time).\n");
+	fprintf(o, "  --cache file\n");
+	fprintf(o, "    Keep per-folder sizes in file, keyed on the inode and mtime of cur/ and new/.\n");
+	fprintf(o, "    Folders where neither has changed since the previous run aren't rescanned.\n");
+	fprintf(o, "    The cache file is shared between all mailboxes it's used for.\n");
+	fprintf(o, "  --cache-verify\n");
+	fprintf(o, "    Rescan all folders anyway, report (on stderr) cache entries that didn't match\n");
+	fprintf(o, "    and exit with status 2 if there were any.  The cache is refreshed.\n");
+	fprintf(o, "  --cache-rebuild\n");
+	fprintf(o, "    Ignore the existing cache content, and rebuild it from scratch.\n");
+	fprintf(o, "  --maildirsize\n");
+	fprintf(o, "    (Re)write the Maildir++ maildirsize (quota) file of each mailbox from the\n");
+	fprintf(o, "    totals found.  The quota definition is retained from an existing file unless\n");
+	fprintf(o, "    --quota is given, mailboxes without either are left alone.\n");
+	fprintf(o, "  --maildirsize-update\n");
+	fprintf(o, "    As --maildirsize, but if the existing file is valid and small enough, only\n");
+	fprintf(o, "    append a line with the difference between the recorded and found totals.\n");
+	fprintf(o, "  --quota spec\n");
+	fprintf(o, "    Quota definition for maildirsize, eg 1073741824S,100000C.\n");
+	fprintf(o, "  --jobs,-j N\n");
+	fprintf(o, "    Scan up to N folders concurrently (0 = number of CPUs), output remains\n");
+	fprintf(o, "    ordered as per the sequential scan.  Default 1.\n");
 	exit(x);
 }
 
 static
-void calc_size(int dir_fd, size_t *total_size, size_t *total_count, const char* rpath)
+void calc_size(int dir_fd, struct folder_scan *f)
 {
-	size_t size = 0, count = 0;
 	const char ** sub;
+	struct fsbatch *batch = NULL;
+	char **names = NULL;
+	unsigned long long *sizes = NULL;
+	int *errs = NULL;
+	size_t nnames = 0, nalloc = 0, i;
 
 	for (sub = maildir_subs; *sub; ++sub) {
-		int sub_fd = openat(dir_fd, *sub, O_RDONLY);
-		if (sub_fd < 0) {
-			fprintf(stderr, "INBOX%s/%s: %s\n", rpath, *sub, strerror(errno));
-			continue;
-		}
-		DIR *d = fdopendir(sub_fd);
-		struct dirent *de;
+		struct dirscan *d = dirscan_openat(dir_fd, *sub);
+		struct dirscan_entry *de;
 		if (!d) {
-			fprintf(stderr, "INBOX%s/%s: %s\n", rpath, *sub, strerror(errno));
-			close(sub_fd);
+			fprintf(stderr, "INBOX%s/%s: %s\n", f->rpath, *sub, strerror(errno));
 			continue;
 		}
-		while ((de = readdir(d))) {
-			unsigned long long msgsize;
-			struct stat st;
+		nnames = 0;
+		while ((de = dirscan_next(d))) {
+			unsigned long long msgsize, wsize;
+			int tags;
 
 			/* We ignore anything starting with a ., this covers . and .., which should
 			 * be the only folders in this place, everything else should be valid
 			 * maildir names ... */
-			if (de->d_name[0] == '.')
+			if (de->name[0] == '.')
 				continue;
 
-			const char* S = strstr(de->d_name, "S=");
-			if (S) {
-				/* we can get the size from the filename ... let's just assume it's correct to avoid that stat call */
-				msgsize = strtoull(S+2, NULL, 10);
-			} else if (fstatat(sub_fd, de->d_name, &st, 0) == 0)  {
-				msgsize = st.st_size;
-			} else {
-				fprintf(stderr, "INBOX%s/%s/%s: filename doesn't have S= tag, and stat failed with '%s'.\n", rpath,
-					*sub, de->d_name, strerror(errno));
+			tags = maildir_name_sizes(de->name, &msgsize, &wsize);
+			if (!(tags & MAILDIR_SIZE_S)) {
+				/* no size in the filename, stat these once the folder has been read */
+				if (nnames == nalloc) {
+					nalloc = nalloc ? nalloc * 2 : 64;
+					names = realloc(names, nalloc * sizeof(*names));
+					if (!names) {
+						perror("realloc");
+						exit(1);
+					}
+				}
+				if (!(names[nnames++] = strdup(de->name))) {
+					perror("strdup");
+					exit(1);
+				}
 				continue;
 			}
 
-			size += msgsize;
-			++count;
+			/* we can get the size from the filename ... let's just assume it's correct to avoid that stat call */
+			f->size += msgsize;
+			f->wsize += tags & MAILDIR_SIZE_W ? wsize : msgsize;
+			++f->count;
 		}
-		closedir(d);
+
+		if (nnames) {
+			if (stat_batch && !batch)
+				batch = fsbatch_new(stat_batch);
+			sizes = realloc(sizes, nnames * sizeof(*sizes));
+			errs = realloc(errs, nnames * sizeof(*errs));
+			if (!sizes || !errs) {
+				perror("realloc");
+				exit(1);
+			}
+
+			maildir_stat_sizes(batch, dirscan_fd(d), names, nnames, sizes, errs);
+			f->stats += nnames;
+
+			for (i = 0; i < nnames; ++i) {
+				if (errs[i]) {
+					fprintf(stderr, "INBOX%s/%s/%s: filename doesn't have S= tag, and stat failed with '%s'.\n", f->rpath,
+						*sub, names[i], strerror(errs[i]));
+				} else {
+					unsigned long long wsize;
+
+					f->size += sizes[i];
+					f->wsize += maildir_name_sizes(names[i], NULL, &wsize) & MAILDIR_SIZE_W ? wsize : sizes[i];
+					++f->count;
+				}
+				free(names[i]);
+			}
+		}
+		dirscan_close(d);
 	}
 
-	*total_size += size;
-	*total_count += count;
+	fsbatch_free(batch);
+	free(names);
+	free(sizes);
+	free(errs);
+}
 
-	if (output == OUTPUT_ALL) {
-		if (parse) {
-			printf("INBOX%s %zu %zu\n", rpath, size, count);
-		} else if (human) {
-			char bfr[15];
-			printf("INBOX%-20s: %11s / %9zu messages\n", rpath, pretty_size(size, bfr),
-					count);
-		} else {
-			printf("INBOX%-20s: %12zu B / %9zu messages\n", rpath, size, count);
+/* runs on worker threads, mustn't touch anything but the folder_scan itself */
+static
+void folder_work(void* _f, void*)
+{
+	struct folder_scan *f = _f;
+	int sfd = f->mbox->fd;
+
+	if (*f->rpath) {
+		sfd = openat(f->mbox->fd, f->rpath, O_RDONLY);
+		if (sfd < 0) {
+			fprintf(stderr, "%s/%s: %s\n", f->mbox->path, f->rpath, strerror(errno));
+			return;
 		}
 	}
+
+	/* stamp before scanning, so that changes during the scan invalidates */
+	if (f->mbox->abspath && (f->stamped = dir_stamp_get(sfd, f->stamp)))
+		f->cached = cache_lookup(f);
+
+	if (f->cached && cache_mode != CACHE_VERIFY) {
+		f->size = f->cached->size;
+		f->wsize = f->cached->wsize;
+		f->count = f->cached->count;
+	} else {
+		calc_size(sfd, f);
+	}
+
+	if (sfd != f->mbox->fd)
+		close(sfd);
 }
 
 static
-void proc_path(const char* path)
+void folder_cache_update(const struct folder_scan *f)
 {
-	size_t msgsize = 0, msgcount = 0;
-	char bfr[15];
+	if (f->cached) {
+		++cache_hits;
+		if (f->cached->size != f->size || f->cached->wsize != f->wsize || f->cached->count != f->count) {
+			fprintf(stderr, "%s/%s: cache mismatch, cached %zu B over %zu messages, found %zu B over %zu messages.\n",
+					f->mbox->path, f->rpath, f->cached->size, f->cached->count, f->size, f->count);
+			++cache_mismatches;
+		}
+	} else {
+		++cache_misses;
+	}
+
+	/* If either folder was modified very recently, further modifications
+	 * within the timestamp granularity of the filesystem won't be detectable,
+	 * so rather rescan next time round. */
+	if (!f->stamped || f->stamp[0].sec >= cache_cutoff || f->stamp[1].sec >= cache_cutoff)
+		return;
+
+	/* keys and values are tab and newline separated */
+	if (strpbrk(f->mbox->abspath, "\t\n") || strpbrk(f->rpath, "\t\n"))
+		return;
+
+	cache_add(&cache_new, f->mbox->abspath, f->rpath, f->stamp, f->size, f->wsize, f->count);
+}
+
+struct maildirsize {
+	char* quota; /* first line, without the newline */
+	long long size, count; /* sum of all further lines */
+	off_t length;
 	struct stat st;
-	DIR *d;
-	struct dirent *de;
+};
 
-	int fd = open(path, O_RDONLY);
+static
+bool valid_quota_spec(const char* spec)
+{
+	/* comma separated list of numbers each followed by S or C */
+	do {
+		if (*spec < '0' || *spec > '9')
+			return false;
+		while (*spec >= '0' && *spec <= '9')
+			++spec;
+		if (*spec != 'S' && *spec != 'C')
+			return false;
+		++spec;
+	} while (*spec++ == ',');
+
+	return !spec[-1];
+}
+
+/* returns false if there is no (valid) maildirsize */
+static
+bool maildirsize_read(const struct mailbox_scan *m, struct maildirsize *mds)
+{
+	char *line = NULL;
+	size_t lsize = 0;
+	ssize_t len;
+	bool ok = false;
+	FILE *fp;
+	int fd;
+
+	memset(mds, 0, sizeof(*mds));
+
+	fd = openat(m->fd, "maildirsize", O_RDONLY);
 	if (fd < 0) {
-		perror(path);
-		return;
+		if (errno != ENOENT)
+			fprintf(stderr, "%s/maildirsize: %s\n", m->path, strerror(errno));
+		return false;
 	}
 
-	if (fstat(fd, &st) < 0) {
+	if (fstat(fd, &mds->st) < 0 || !(fp = fdopen(fd, "r"))) {
+		fprintf(stderr, "%s/maildirsize: %s\n", m->path, strerror(errno));
 		close(fd);
-		perror(path);
+		return false;
+	}
+	mds->length = mds->st.st_size;
+
+	if ((len = getline(&line, &lsize, fp)) <= 0 || line[len - 1] != '\n')
+		goto out;
+	line[len - 1] = 0;
+	mds->quota = strdup(line);
+
+	ok = true;
+	while ((len = getline(&line, &lsize, fp)) > 0) {
+		long long size, count;
+
+		/* partially written line from a crashed writer */
+		if (line[len - 1] != '\n' || sscanf(line, "%lld %lld", &size, &count) != 2) {
+			ok = false;
+			break;
+		}
+		mds->size += size;
+		mds->count += count;
+	}
+
+out:
+	free(line);
+	fclose(fp);
+	return ok;
+}
+
+static
+void maildirsize_rewrite(const struct mailbox_scan *m, const char* quota, const struct maildirsize *mds)
+{
+	char tmpname[64], *content;
+	struct stat st;
+	int fd, len, err;
+	ssize_t w;
+
+	len = asprintf(&content, "%s\n%zu %zu\n", quota, m->size, m->count);
+	if (len < 0) {
+		perror("asprintf");
 		return;
 	}
 
-	if (!S_ISDIR(st.st_mode)) {
-		close(fd);
-		fprintf(stderr, "%s is not a directory.\n", path);
+	/* Maildir++ requires that this is written in tmp/ and renamed into place */
+	snprintf(tmpname, sizeof(tmpname), "tmp/%ld.%d.maildirsize", (long)time(NULL), getpid());
+	fd = openat(m->fd, tmpname, O_WRONLY | O_CREAT | O_EXCL,
+			mds->quota ? mds->st.st_mode & 0666 : 0600);
+	if (fd < 0) {
+		fprintf(stderr, "%s/%s: %s\n", m->path, tmpname, strerror(errno));
+		free(content);
+		return;
 	}
 
-	if (output == OUTPUT_ALL) {
-		if (parse)
-			printf("PATH: %s\n", path);
-		else
-			printf("Folder details for %s:\n", path);
+	/* a maildirsize owned by root would break quota updates on delivery */
+	err = 0;
+	if (geteuid() == 0) {
+		if (mds->quota)
+			err = fchown(fd, mds->st.st_uid, mds->st.st_gid) < 0 ? errno : 0;
+		else if (fstat(m->fd, &st) == 0)
+			err = fchown(fd, st.st_uid, st.st_gid) < 0 ? errno : 0;
 	}
-	calc_size(fd, &msgsize, &msgcount, "");
 
-	d = fdopendir(fd);
-	if (!d) {
-		perror(path);
-		fprintf(stderr, "Not scanning for sub-folders.\n");
-	} else while ((de = readdir(d))) {
-		/* sub-folders starts with a ., and is obviously not . or .. */
-		if (de->d_name[0] != '.' || !strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
-			continue;
+	if (!err) {
+		w = write(fd, content, len);
+		if (w != len)
+			err = w < 0 ? errno : EIO;
+	}
+	if (close(fd) < 0 && !err)
+		err = errno;
+
+	if (err) {
+		fprintf(stderr, "%s/%s: %s\n", m->path, tmpname, strerror(err));
+		unlinkat(m->fd, tmpname, 0);
+	} else if (renameat(m->fd, tmpname, m->fd, "maildirsize") < 0) {
+		fprintf(stderr, "%s/%s => maildirsize: %s\n", m->path, tmpname, strerror(errno));
+		unlinkat(m->fd, tmpname, 0);
+	}
 
-		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
-			continue;
+	free(content);
+}
 
-		int sfd = openat(fd, de->d_name, O_RDONLY);
-		if (sfd < 0) {
-			fprintf(stderr, "%s/%s: %s\n", path, de->d_name, strerror(errno));
-			continue;
-		}
+static
+void maildirsize_append(const struct mailbox_scan *m, long long dsize, long long dcount)
+{
+	char line[64];
+	int fd, len;
 
-		calc_size(sfd, &msgsize, &msgcount, de->d_name);
-		close(sfd);
+	fd = openat(m->fd, "maildirsize", O_WRONLY | O_APPEND);
+	if (fd < 0) {
+		fprintf(stderr, "%s/maildirsize: %s\n", m->path, strerror(errno));
+		return;
+	}
+
+	/* a single write() so that concurrent appends by delivery agents don't interleave */
+	len = snprintf(line, sizeof(line), "%lld %lld\n", dsize, dcount);
+	if (write(fd, line, len) != len)
+		fprintf(stderr, "%s/maildirsize: %s\n", m->path, strerror(errno));
+	close(fd);
+}
+
+static
+void maildirsize_update(const struct mailbox_scan *m)
+{
+	struct maildirsize mds;
+	bool valid = maildirsize_read(m, &mds);
+	const char* quota = quota_spec ?: mds.quota;
+
+	if (!quota) {
+		fprintf(stderr, "%s: no quota defined, not writing maildirsize.\n", m->path);
+		return;
+	}
+
+	if (maildirsize_mode == MAILDIRSIZE_UPDATE && valid && strcmp(quota, mds.quota) == 0
+			&& mds.length < MAILDIRSIZE_MAX) {
+		long long dsize = (long long)m->size - mds.size;
+		long long dcount = (long long)m->count - mds.count;
+		if (dsize || dcount)
+			maildirsize_append(m, dsize, dcount);
+	} else {
+		maildirsize_rewrite(m, quota, &mds);
+	}
+
+	free(mds.quota);
+}
+
+/* the --rfc822 and --stats columns */
+static
+void print_extra(const char* sep, size_t wsize, size_t stats)
+{
+	char bfr[15];
+
+	if (rfc822) {
+		if (parse)
+			printf(" %zu", wsize);
+		else if (human)
+			printf("%s%s RFC822", sep, pretty_size(wsize, bfr));
+		else
+			printf("%s%zu B RFC822", sep, wsize);
+	}
+
+	if (show_stats) {
+		if (parse)
+			printf(" %zu", stats);
+		else
+			printf("%s%zu stat()s", sep, stats);
 	}
-	closedir(d);
+}
+
+static
+void mailbox_totals(struct mailbox_scan *m)
+{
+	char bfr[15];
 
 	switch (output) {
 	case OUTPUT_ALL:
 		if (parse)
-			printf("TOTAL %zu %zu\n", msgsize, msgcount);
+			printf("TOTAL %zu %zu", m->size, m->count);
 		else if (human)
-			printf("Total: %s over %zu messages.\n", pretty_size(msgsize, bfr), msgcount);
+			printf("Total: %s over %zu messages", pretty_size(m->size, bfr), m->count);
 		else
-			printf("Total: %zu B over %zu messages.\n", msgsize, msgcount);
+			printf("Total: %zu B over %zu messages", m->size, m->count);
+		print_extra(", ", m->wsize, m->stats);
+		printf(parse ? "\n" : ".\n");
 		break;
 	case OUTPUT_TOTALS:
 		if (parse)
-			printf("%s %zu %zu\n", path, msgsize, msgcount);
+			printf("%s %zu %zu", m->path, m->size, m->count);
 		else if (human)
-			printf("%s has %s over %zu messages.\n", path, pretty_size(msgsize, bfr), msgcount);
+			printf("%s has %s over %zu messages", m->path, pretty_size(m->size, bfr), m->count);
 		else
-			printf("%s has %zu B over %zu messages.\n", path, msgsize, msgcount);
+			printf("%s has %zu B over %zu messages", m->path, m->size, m->count);
+		print_extra(", ", m->wsize, m->stats);
+		printf(parse ? "\n" : ".\n");
 		break;
 	case OUTPUT_TOTALSIZE:
-		printf("%zu\n", msgsize);
+		if (rfc822)
+			printf("%zu %zu\n", m->size, m->wsize);
+		else
+			printf("%zu\n", m->size);
 		break;
 	case OUTPUT_MESSAGECOUNT:
-		printf("%zu\n", msgcount);
+		printf("%zu\n", m->count);
 		break;
 	default:
 		fprintf(stderr, "BUG: output format not understood for totals.\n");
 	}
+
+	if (maildirsize_mode != MAILDIRSIZE_NONE)
+		maildirsize_update(m);
+
+	close(m->fd);
+	free(m->abspath);
+	free(m);
+}
+
+/* called in queue order from the main thread */
+static
+void folder_done(void* _f, void*)
+{
+	struct folder_scan *f = _f;
+	struct mailbox_scan *m = f->mbox;
+
+	if (!*f->rpath && output == OUTPUT_ALL) {
+		if (!first_mailbox)
+			printf("\n");
+		if (parse)
+			printf("PATH: %s\n", m->path);
+		else
+			printf("Folder details for %s:\n", m->path);
+	}
+	first_mailbox = false;
+
+	m->size += f->size;
+	m->wsize += f->wsize;
+	m->count += f->count;
+	m->stats += f->stats;
+
+	if (m->abspath)
+		folder_cache_update(f);
+
+	if (output == OUTPUT_ALL) {
+		if (parse) {
+			printf("INBOX%s %zu %zu", f->rpath, f->size, f->count);
+		} else if (human) {
+			char bfr[15];
+			printf("INBOX%-20s: %11s / %9zu messages", f->rpath, pretty_size(f->size, bfr),
+					f->count);
+		} else {
+			printf("INBOX%-20s: %12zu B / %9zu messages", f->rpath, f->size, f->count);
+		}
+		print_extra(" / ", f->wsize, f->stats);
+		printf("\n");
+	}
+
+	free(f->rpath);
+	free(f);
+
+	if (!--m->pending && m->complete)
+		mailbox_totals(m);
+}
+
+static
+void queue_folder(struct workqueue *wq, struct mailbox_scan *m, const char* rpath)
+{
+	struct folder_scan *f = calloc(1, sizeof(*f));
+	if (!f || !(f->rpath = strdup(rpath))) {
+		perror("malloc");
+		exit(1);
+	}
+	f->mbox = m;
+
+	m->pending++;
+	workqueue_push(wq, f);
+}
+
+static
+void proc_path(struct workqueue *wq, const char* path)
+{
+	struct mailbox_scan *m;
+	struct stat st;
+	struct dirscan *d;
+	struct dirscan_entry *de;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		perror(path);
+		return;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		close(fd);
+		fprintf(stderr, "%s is not a directory.\n", path);
+		return;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		perror("malloc");
+		exit(1);
+	}
+	m->path = path;
+	m->fd = fd;
+
+	if (cache_file) {
+		m->abspath = realpath(path, NULL);
+		if (!m->abspath)
+			perror(path);
+		else
+			strmap_insert(&cache_roots, m->abspath, strlen(m->abspath), NULL);
+	}
+
+	/* totals are output by whoever sees pending reach zero with complete set,
+	 * which is either the last folder_done() or ourselves below. */
+	queue_folder(wq, m, "");
+
+	/* workers may be using fd concurrently, so scan using a dup. */
+	d = dirscan_fdopen(dup(fd));
+	if (!d) {
+		perror(path);
+		fprintf(stderr, "Not scanning for sub-folders.\n");
+	} else {
+		while ((de = dirscan_next(d))) {
+			/* sub-folders starts with a ., and is obviously not . or .. */
+			if (de->name[0] != '.' || dirscan_dots(de))
+				continue;
+
+			if (de->type != DT_DIR && de->type != DT_UNKNOWN)
+				continue;
+
+			queue_folder(wq, m, de->name);
+		}
+		dirscan_close(d);
+	}
+
+	m->complete = true;
+	if (!m->pending)
+		mailbox_totals(m);
 }
 
 static struct option options[] = {
@@ -213,6 +842,16 @@ static struct option options[] = {
 	{ "totalonly",		no_argument, &output, OUTPUT_TOTALS },
 	{ "sizeonly",		no_argument, &output, OUTPUT_TOTALSIZE },
 	{ "countonly",		no_argument, &output, OUTPUT_MESSAGECOUNT },
+	{ "rfc822",			no_argument, NULL, 'w' },
+	{ "stats",			no_argument, &show_stats, 1 },
+	{ "batch",			required_argument, NULL, 'b' },
+	{ "jobs",			required_argument, NULL, 'j' },
+	{ "cache",			required_argument, NULL, 'c' },
+	{ "cache-verify",	no_argument, &cache_mode, CACHE_VERIFY },
+	{ "cache-rebuild",	no_argument, &cache_mode, CACHE_REBUILD },
+	{ "maildirsize",	no_argument, &maildirsize_mode, MAILDIRSIZE_REWRITE },
+	{ "maildirsize-update",	no_argument, &maildirsize_mode, MAILDIRSIZE_UPDATE },
+	{ "quota",			required_argument, NULL, 'q' },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -220,8 +859,9 @@ int main(int argc, char** argv)
 {
 	progname = *argv;
 	int c;
+	struct workqueue *wq;
 
-	while ((c = getopt_long(argc, argv, "hp", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hpwj:b:", options, NULL)) != -1) {
 		switch (c) {
 		case 0:
 			break;
@@ -231,6 +871,25 @@ int main(int argc, char** argv)
 		case 'p':
 			parse = 1;
 			break;
+		case 'w':
+			rfc822 = 1;
+			break;
+		case 'j':
+			jobs = workqueue_parse_jobs(optarg);
+			break;
+		case 'b':
+			stat_batch = fsbatch_parse_depth(optarg);
+			break;
+		case 'c':
+			cache_file = optarg;
+			break;
+		case 'q':
+			if (!valid_quota_spec(optarg)) {
+				fprintf(stderr, "Invalid quota definition: %s.\n", optarg);
+				usage(1);
+			}
+			quota_spec = optarg;
+			break;
 		case '?':
 			usage(1);
 		default:
@@ -239,15 +898,34 @@ int main(int argc, char** argv)
 		}
 	}
 
-	if (!*argv) {
+	if (!argv[optind]) {
 		fprintf(stderr, "At least one path is required.\n");
 		usage(1);
 	}
 
-	while (argv[optind]) {
-		proc_path(argv[optind++]);
-		if (output == OUTPUT_ALL && argv[optind])
-			printf("\n");
+	if (cache_file) {
+		cache_cutoff = time(NULL) - 1;
+		cache_load();
+	} else if (cache_mode != CACHE_USE) {
+		fprintf(stderr, "--cache-verify and --cache-rebuild requires --cache.\n");
+		usage(1);
+	}
+
+	wq = workqueue_create(jobs, 0, folder_work, folder_done, NULL);
+	while (argv[optind])
+		proc_path(wq, argv[optind++]);
+	workqueue_finish(wq);
+
+	if (cache_file) {
+		cache_save();
+		if (cache_mode == CACHE_VERIFY)
+			fprintf(stderr, "Cache: %zu folders matched, %zu rescanned, %zu mismatches.\n",
+					cache_hits, cache_misses, cache_mismatches);
+		strmap_free(&cache_old);
+		strmap_free(&cache_new);
+		strmap_free(&cache_roots);
+		if (cache_mismatches)
+			return 2;
 	}
 
 	return 0;
@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
+
 #include "servertypes.h"
+#include "filetools.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,40 +10,44 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/sendfile.h>
+#include <time.h>
+#include <dirent.h>
+
+/* a courierpop3dsizelist record */
+struct courier_pop3 {
+	const char *basename; /* key in the sizelist map */
+	const char *rest; /* "size uid:uidvalidity" (just "size" for version 1) as loaded, NULL if added */
+	unsigned long uid, uidvalidity; /* of those added */
+	unsigned long long size; /* of those added, only determined when written out */
+	bool found;
+};
+
+struct courier_sizelist {
+	bool loaded, broken, dirty;
+	unsigned long version, next_uid, uidvalidity;
+	struct strmap map; /* basename => struct courier_pop3 */
+	struct courier_pop3 **entries; /* in file order, followed by those added */
+	size_t count, alloc;
+};
 
 struct courier_data {
 	const char* folder;
 	int dirfd;
 
-	struct uidl_list *uidl;
-	char *uidl_headline;
-};
+	/* courierimapuiddb, loaded on first use */
+	struct uid_index uiddb;
 
-struct courier_uidl_extra {
-	char *flags;
-	int utf8;
-	int size;
-};
-
-static
-int courier_detect(const char* folder)
-{
-	int detected;
-	struct stat dummy;
+	/* courierpop3dsizelist, loaded on first use */
+	struct courier_sizelist sizelist;
 
-	int dirfd = open(folder, O_RDONLY);
-	if (dirfd < 0) {
-		perror(folder);
-		exit(1);
-	}
-
-	detected = fstatat(dirfd, "courierimapuiddb", &dummy, 0) == 0
-		|| fstatat(dirfd, "courierpop3dsizelist", &dummy, 0) == 0;
+	struct line_set subscribed; /* courierimapsubscribed */
+};
 
-	close(dirfd);
-	return detected;
-}
+static const char * const courier_markers[] = {
+	"courierimapuiddb",
+	"courierpop3dsizelist",
+	NULL
+};
 
 static
 const char * const * courier_metafiles()
@@ -70,116 +77,403 @@ void* courier_open(const char* folder, int dirfd)
 
 	p->folder = folder;
 	p->dirfd = dirfd;
-	p->uidl = NULL;
+	memset(&p->uiddb, 0, sizeof(p->uiddb));
+	memset(&p->sizelist, 0, sizeof(p->sizelist));
+	p->subscribed = (struct line_set)LINE_SET_INIT;
+	line_set_load(&p->subscribed, dirfd, folder, "courierimapsubscribed");
 
 	return p;
 }
 
-//static
-//char* courier_pop3_get_uidl(void *_p)
-//{
-//	struct courier_data *p = _p;
-//	int fd = openat(p->dirfd, "courierpop3dsizelist");
-//
-//	return NULL;
-//}
-
+/* opens fname for reading, returns NULL (with *broken set if it's an error
+ * other than the file not existing) */
 static
-int courier_imap_is_subscribed(void* _p, const char* fldrname)
+FILE* courier_meta_open(struct courier_data* p, const char* fname, bool* broken)
 {
-	struct courier_data *p = _p;
-	char linebuf[2048];
-
-	// all subfolders in courier starts with INBOX.
+	FILE *fp;
+	int fd;
 
-	int fd = openat(p->dirfd, "courierimapsubscribed", O_RDONLY, 0);
+	fd = openat(p->dirfd, fname, O_RDONLY);
 	if (fd < 0) {
-		fprintf(stderr, "%s/%s: %s\n", p->folder, "courierimapsubscribed", strerror(errno));
-		return 0; /* best guess */
+		if (errno != ENOENT) {
+			fprintf(stderr, "%s/%s: %s\n", p->folder, fname, strerror(errno));
+			*broken = true;
+		}
+		return NULL;
 	}
 
-	FILE* fp = fdopen(fd, "r");
+	fp = fdopen(fd, "r");
 	if (!fp) {
-		fprintf(stderr, "%s/%s: %s\n", p->folder, "courierimapsubscribed", strerror(errno));
-		return 0; /* best guess */
+		fprintf(stderr, "%s/%s: %s\n", p->folder, fname, strerror(errno));
+		close(fd);
+		*broken = true;
 	}
+	return fp;
+}
 
-	while (fgets(linebuf, sizeof(linebuf), fp)) {
-		char *nl = strchr(linebuf, '\n');
-		if (nl)
-			*nl = 0;
-		if (strncmp("INBOX", linebuf, strlen("INBOX")))
-			continue;
-		if (strcmp(fldrname, linebuf + strlen("INBOX")))
-			continue;
-		return 1;
+static
+void courier_meta_close(struct courier_data* p, const char* fname, FILE* fp, bool* broken)
+{
+	if (ferror(fp)) {
+		fprintf(stderr, "%s/%s: %s\n", p->folder, fname, strerror(errno));
+		*broken = true;
 	}
+	fclose(fp);
+}
+
+/* Version 1 only, "1 uidvalidity nextuid" followed by "uid basename" records,
+ * other versions are left alone. */
+static
+struct uid_index* uiddb_get(struct courier_data* p)
+{
+	struct uid_index *ix = &p->uiddb;
+	char *line = NULL, *e;
+	size_t size = 0;
+	ssize_t len;
+	unsigned long uid;
+
+	if (ix->loaded)
+		return ix->broken ? NULL : ix;
+	ix->loaded = true;
+
+	FILE *fp = courier_meta_open(p, "courierimapuiddb", &ix->broken);
+	if (!fp) {
+		uid_index_loaded(ix);
+		return ix->broken ? NULL : ix;
+	}
+
+	if ((len = getline(&line, &size, fp)) > 0 && strtoul(line, &e, 10) == 1 && *e == ' ') {
+		ix->uidvalidity = strtoul(e, &e, 10);
+		ix->next_uid = strtoul(e, &e, 10);
 
-	return 0;
+		while ((len = getline(&line, &size, fp)) > 0) {
+			if (line[len - 1] == '\n')
+				line[--len] = 0;
+			uid = strtoul(line, &e, 10);
+			if (uid && *e == ' ')
+				uid_index_append(ix, e + 1, line + len - (e + 1), uid, NULL, 0);
+		}
+	} else if (len > 0) {
+		fprintf(stderr, "%s/%s: unsupported format, not touching it.\n", p->folder, "courierimapuiddb");
+		ix->broken = true;
+	}
+
+	free(line);
+	courier_meta_close(p, "courierimapuiddb", fp, &ix->broken);
+	uid_index_loaded(ix);
+
+	return ix->broken ? NULL : ix;
 }
 
 static
-void courier_imap_subscribe(void* _p, const char* fldrname)
+void uiddb_save(struct courier_data* p)
 {
-	struct courier_data *p = _p;
-	char tmpfname[1024];
+	struct uid_index *ix = &p->uiddb;
+	struct meta_replace mr;
+	size_t i;
+
+	if (!ix->dirty || ix->broken)
+		return;
+
+	uid_index_finish(ix);
+
+	FILE* fp = meta_replace_open(&mr, p->dirfd, p->folder, "courierimapuiddb");
+	if (!fp)
+		return;
+
+	fprintf(fp, "1 %lu %lu\n", ix->uidvalidity, ix->next_uid);
+	for (i = 0; i < ix->count; ++i)
+		fprintf(fp, "%lu %s\n", ix->entries[i]->uid, ix->entries[i]->basename);
+
+	if (meta_replace_commit(&mr) == 0)
+		ix->dirty = false;
+}
+
+static
+unsigned long courier_imap_uidvalidity(void* _p)
+{
+	struct uid_index *ix = uiddb_get(_p);
+
+	return ix ? ix->uidvalidity : 0;
+}
+
+static
+unsigned long courier_imap_get_uid(void* _p, const char* basename)
+{
+	struct uid_index *ix = uiddb_get(_p);
+	struct uid_entry *u;
+
+	if (!ix || !(u = uid_index_find(ix, basename)))
+		return 0;
+
+	return u->uid;
+}
+
+/* written out by courier_close() */
+static
+unsigned long courier_imap_add_uid(void* _p, const char* basename, unsigned long uid, unsigned long uidvalidity)
+{
+	struct uid_index *ix = uiddb_get(_p);
+
+	return ix ? uid_index_add(ix, basename, uid, uidvalidity) : 0;
+}
+
+static
+struct courier_pop3* sizelist_append(struct courier_sizelist* sl, const char* basename, size_t len,
+		const char* rest, size_t restlen)
+{
+	bool created;
+	struct strmap_entry *e = strmap_insert(&sl->map, basename, len, &created);
+	struct courier_pop3 *m;
+
+	if (!created)
+		return NULL;
+
+	e->value = m = strmap_alloc(&sl->map, sizeof(*m));
+	memset(m, 0, sizeof(*m));
+	m->basename = e->key;
+	if (rest) {
+		char *t = strmap_alloc(&sl->map, restlen + 1);
+		memcpy(t, rest, restlen);
+		t[restlen] = 0;
+		m->rest = t;
+	}
+
+	if (sl->count == sl->alloc) {
+		sl->alloc = sl->alloc ? sl->alloc * 2 : 1024;
+		sl->entries = realloc(sl->entries, sl->alloc * sizeof(*sl->entries));
+		if (!sl->entries) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	sl->entries[sl->count++] = m;
+
+	return m;
+}
+
+/* Version 2 starts with "/2 nextuid uidvalidity", followed by "basename size
+ * uid:uidvalidity" records, version 1 has no header and "basename size"
+ * records (the UIDL then being the basename). */
+static
+struct courier_sizelist* sizelist_get(struct courier_data* p)
+{
+	struct courier_sizelist *sl = &p->sizelist;
+	char *line = NULL, *e;
+	size_t size = 0;
+	ssize_t len;
+
+	if (sl->loaded)
+		return sl->broken ? NULL : sl;
+	sl->loaded = true;
+	sl->version = 2; /* for a new file */
+
+	FILE *fp = courier_meta_open(p, "courierpop3dsizelist", &sl->broken);
+	if (!fp)
+		return sl->broken ? NULL : sl;
+
+	sl->version = 1;
+	while ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = 0;
+		if (*line == '/') {
+			sl->version = strtoul(line + 1, &e, 10);
+			if (sl->version != 2) {
+				fprintf(stderr, "%s/%s: unsupported format, not touching it.\n", p->folder, "courierpop3dsizelist");
+				sl->broken = true;
+				break;
+			}
+			sl->next_uid = strtoul(e, &e, 10);
+			sl->uidvalidity = strtoul(e, &e, 10);
+		} else if ((e = strchr(line, ' '))) {
+			sizelist_append(sl, line, e - line, e + 1, line + len - (e + 1));
+		}
+	}
+
+	free(line);
+	courier_meta_close(p, "courierpop3dsizelist", fp, &sl->broken);
+
+	return sl->broken ? NULL : sl;
+}
+
+/* sizes of the added messages without S=, found by scanning sub */
+static
+void sizelist_find_sizes(struct courier_data* p, const char* sub)
+{
+	struct dirscan *dir = dirscan_openat(p->dirfd, sub);
+	struct dirscan_entry *de;
+	struct strmap_entry *e;
+	struct courier_pop3 *m;
 	struct stat st;
-	mode_t mode = 0644;
-	int tfd, stvalid = 0, r;
-	int sfd = openat(p->dirfd, "courierimapsubscribed", O_RDONLY, 0);
-	if (sfd < 0 && errno != ENOENT) {
-			/* ENOENT - no subscriptions, so no harm in creating */
-			fprintf(stderr, "%s/%s: %s\n", p->folder, "courierimapsubscribed", strerror(errno));
-			return;
+
+	if (!dir) {
+		fprintf(stderr, "%s/%s: %s\n", p->folder, sub, strerror(errno));
+		return;
 	}
 
-	if ((sfd >= 0 && fstat(sfd, &st) == 0) || fstat(p->dirfd, &st) == 0) {
-		stvalid = 1;
-		mode = st.st_mode & 0666;
+	while ((de = dirscan_next(dir))) {
+		e = strmap_find(&p->sizelist.map, de->name, strcspn(de->name, ":"));
+		if (!e || (m = e->value)->rest || m->found)
+			continue;
+		if (fstatat(dirscan_fd(dir), de->name, &st, 0) == 0) {
+			m->size = st.st_size;
+			m->found = true;
+		}
 	}
+	dirscan_close(dir);
+}
+
+static
+void sizelist_save(struct courier_data* p)
+{
+	struct courier_sizelist *sl = &p->sizelist;
+	struct meta_replace mr;
+	struct courier_pop3 *m;
+	bool missing = false;
+	size_t i;
 
-	do {
-		sprintf(tmpfname, "tmp/maildirmerge-courier-%d", rand());
-	} while ((tfd = openat(p->dirfd, tmpfname, O_WRONLY | O_CREAT | O_EXCL, mode)) < 0 && errno == EEXIST);
+	if (!sl->dirty || sl->broken)
+		return;
+
+	/* the messages have all been moved in by now */
+	for (i = 0; i < sl->count; ++i) {
+		m = sl->entries[i];
+		if (!m->rest && !(m->found = maildir_name_sizes(m->basename, &m->size, NULL) & MAILDIR_SIZE_S))
+			missing = true;
+	}
+	if (missing) {
+		sizelist_find_sizes(p, "cur");
+		sizelist_find_sizes(p, "new");
+	}
 
-	if (tfd < 0) {
-		fprintf(stderr, "%s/%s: %s\n", p->folder, tmpfname, strerror(errno));
-		if (sfd >= 0)
-			close(sfd);
+	FILE* fp = meta_replace_open(&mr, p->dirfd, p->folder, "courierpop3dsizelist");
+	if (!fp)
 		return;
+
+	fprintf(fp, "/2 %lu %lu\n", sl->next_uid, sl->uidvalidity);
+	for (i = 0; i < sl->count; ++i) {
+		m = sl->entries[i];
+		if (m->rest)
+			fprintf(fp, "%s %s\n", m->basename, m->rest);
+		else if (m->found)
+			fprintf(fp, "%s %llu %lu:%lu\n", m->basename, m->size, m->uid, m->uidvalidity);
+		else
+			fprintf(stderr, "%s: %s not found, not setting its UIDL.\n", p->folder, m->basename);
 	}
 
-	if (stvalid && geteuid() == 0)
-		fchown(tfd, st.st_uid, st.st_gid);
+	if (meta_replace_commit(&mr) == 0)
+		sl->dirty = false;
+}
 
-	if (sfd >= 0) {
-		while ((r = sendfile(tfd, sfd, NULL, 16384)) > 0);
-		if (r < 0) {
-			fprintf(stderr, "%s/%s: %s\n", p->folder, tmpfname, strerror(errno));
-			close(sfd);
-			close(tfd);
-			unlinkat(p->dirfd, tmpfname, 0);
-			return;
-		}
-		close(sfd);
+static
+void sizelist_free(struct courier_sizelist* sl)
+{
+	strmap_free(&sl->map);
+	free(sl->entries);
+	memset(sl, 0, sizeof(*sl));
+}
+
+static
+char* courier_pop3_get_uidl(void* _p, const char* basename)
+{
+	struct courier_sizelist *sl = sizelist_get(_p);
+	struct strmap_entry *e;
+	struct courier_pop3 *m;
+	unsigned long uid, uidvalidity;
+	char *uidl;
+
+	if (!sl || !(e = strmap_find(&sl->map, basename, strlen(basename))) || !(m = e->value)->rest)
+		return NULL;
+
+	if (sl->version == 1)
+		return strdup(basename);
+
+	if (sscanf(m->rest, "%*u %lu:%lu", &uid, &uidvalidity) != 2)
+		return NULL;
+	if (asprintf(&uidl, "UID%lu-%lu", uid, uidvalidity) < 0)
+		return NULL;
+	return uidl;
+}
+
+/* only UIDLs in Courier's own format (UIDuid-uidvalidity) can be represented,
+ * written out by courier_close() */
+static
+void courier_pop3_set_uidl(void* _p, const char* basename, const char* uidl)
+{
+	struct courier_data *p = _p;
+	struct courier_sizelist *sl = sizelist_get(p);
+	unsigned long uid, uidvalidity;
+	struct courier_pop3 *m;
+	int n = 0;
+
+	if (!sl || sl->version != 2)
+		return;
+
+	if (sscanf(uidl, "UID%lu-%lu%n", &uid, &uidvalidity, &n) != 2 || uidl[n]) {
+		fprintf(stderr, "%s: UIDL %s of %s can't be represented in courierpop3dsizelist.\n",
+				p->folder, uidl, basename);
+		return;
 	}
 
-	write(tfd, "INBOX", strlen("INBOX"));
-	write(tfd, fldrname, strlen(fldrname));
-	write(tfd, "\n", 1);
-	close(tfd);
+	if (!(m = sizelist_append(sl, basename, strlen(basename), NULL, 0)))
+		return; /* already listed */
+	m->uid = uid;
+	m->uidvalidity = uidvalidity;
+
+	if (!sl->uidvalidity)
+		sl->uidvalidity = time(NULL);
+	if (uidvalidity == sl->uidvalidity && uid >= sl->next_uid)
+		sl->next_uid = uid + 1;
+	if (!sl->next_uid)
+		sl->next_uid = 1;
+	sl->dirty = true;
+}
 
-	if (renameat(p->dirfd, tmpfname, p->dirfd, "courierimapsubscribed") < 0) {
-		fprintf(stderr, "%s => %s/courierimapsubscribed: %s\n", tmpfname, p->folder,
-				strerror(errno));
-		unlinkat(p->dirfd, tmpfname, 0);
+/* all subfolders in courier starts with INBOX. */
+static
+int courier_imap_is_subscribed(void* _p, const char* fldrname)
+{
+	struct courier_data *p = _p;
+	char *name;
+	int r;
+
+	if (asprintf(&name, "INBOX%s", fldrname) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	r = line_set_contains(&p->subscribed, name);
+	free(name);
+
+	return r;
+}
+
+/* written out by courier_close() */
+static
+void courier_imap_subscribe(void* _p, const char* fldrname)
+{
+	struct courier_data *p = _p;
+	char *name;
+
+	if (asprintf(&name, "INBOX%s", fldrname) < 0) {
+		perror("asprintf");
+		exit(1);
 	}
+	line_set_add(&p->subscribed, name);
+	free(name);
 }
 
 static
 void courier_close(void* _p)
 {
-	free(_p);
+	struct courier_data *p = _p;
+
+	uiddb_save(p);
+	uid_index_free(&p->uiddb);
+	sizelist_save(p);
+	sizelist_free(&p->sizelist);
+	line_set_save(&p->subscribed, p->dirfd, p->folder, "courierimapsubscribed");
+	line_set_free(&p->subscribed);
+	free(p);
 }
 
 static
@@ -193,12 +487,15 @@ int courier_is_pop3(void* _p)
 
 static struct maildir_type maildir_courier = {
 	.label = "Courier-IMAP",
-	.detect = courier_detect,
+	.markers = courier_markers,
 	.metafiles = courier_metafiles,
 	.open = courier_open,
 	.is_pop3 = courier_is_pop3,
-//	.pop3_get_uidl = courier_pop3_get_uidl,
-//	.pop3_set_uidl = courier_pop3_set_uidl,
+	.pop3_get_uidl = courier_pop3_get_uidl,
+	.pop3_set_uidl = courier_pop3_set_uidl,
+	.imap_uidvalidity = courier_imap_uidvalidity,
+	.imap_get_uid = courier_imap_get_uid,
+	.imap_add_uid = courier_imap_add_uid,
 	.imap_is_subscribed = courier_imap_is_subscribed,
 	.imap_subscribe = courier_imap_subscribe,
 	.close = courier_close,
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "servertypes.h"
 
 #include <stdlib.h>
@@ -7,40 +9,25 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/sendfile.h>
+
 
 struct dovecot_data {
 	const char* folder;
 	int dirfd;
 
-	struct uidl_list *uidl;
-	char *uidl_headline;
+	struct uid_index uidlist; /* dovecot-uidlist, loaded on first use */
+	struct line_set subscribed; /* subscriptions */
+	bool subscriptions_v2; /* "V\t2" header, \t as hierarchy separator */
 };
 
-struct dovecot_uidl_extra {
-	char *flags;
-	int utf8;
-	int size;
+static const char * const dovecot_markers[] = {
+	"dovecot-uidlist",
+	"dovecot-uidvalidity",
+	"dovecot.index",
+	"dovecot.index.log",
+	NULL
 };
 
-static
-int dovecot_detect(const char* folder)
-{
-	int detected;
-	struct stat dummy;
-
-	int dirfd = open(folder, O_RDONLY);
-	if (dirfd < 0) {
-		perror(folder);
-		exit(1);
-	}
-
-	detected = fstatat(dirfd, "courierimapuiddb", &dummy, 0) == 0;
-
-	close(dirfd);
-	return detected;
-}
-
 static
 const char * const * dovecot_metafiles()
 {
@@ -71,103 +58,199 @@ void* dovecot_open(const char* folder, int dirfd)
 
 	p->folder = folder;
 	p->dirfd = dirfd;
-	p->uidl = NULL;
+	memset(&p->uidlist, 0, sizeof(p->uidlist));
+	p->subscribed = (struct line_set)LINE_SET_INIT;
+	line_set_load(&p->subscribed, dirfd, folder, "subscriptions");
+	p->subscriptions_v2 = p->subscribed.count && strcmp(p->subscribed.lines[0], "V\t2") == 0;
 
 	return p;
 }
 
+/* the subscriptions entry for maildir++ folder fldrname, in name */
+static
+void dovecot_subscription_name(const struct dovecot_data* p, const char* fldrname, char* name)
+{
+	strcpy(name, fldrname + 1 /* skip leading . */);
+	if (p->subscriptions_v2)
+		for (char *c = name; (c = strchr(c, '.')); ++c)
+			*c = '\t';
+}
+
 static
 int dovecot_imap_is_subscribed(void* _p, const char* fldrname)
 {
 	struct dovecot_data *p = _p;
-	char linebuf[2048];
+	char *name = alloca(strlen(fldrname));
 
-	// all subfolders in courier starts with INBOX.
+	dovecot_subscription_name(p, fldrname, name);
+	return line_set_contains(&p->subscribed, name);
+}
 
-	int fd = openat(p->dirfd, "subscriptions", O_RDONLY, 0);
+/* written out by dovecot_close() */
+static
+void dovecot_imap_subscribe(void* _p, const char* fldrname)
+{
+	struct dovecot_data *p = _p;
+	char *name = alloca(strlen(fldrname));
+
+	dovecot_subscription_name(p, fldrname, name);
+	line_set_add(&p->subscribed, name);
+}
+
+/* Versions 1 ("1 uidvalidity nextuid", records "uid basename") and 3
+ * ("3 Vuidvalidity Nnextuid ...", records "uid [ext ...] :basename") are
+ * understood, the latter is always written. */
+static
+struct uid_index* uidlist_get(struct dovecot_data* p)
+{
+	struct uid_index *ul = &p->uidlist;
+	char *line = NULL, *e, *t;
+	size_t size = 0;
+	ssize_t len;
+	unsigned long version = 0, uid;
+
+	if (ul->loaded)
+		return ul->broken ? NULL : ul;
+	ul->loaded = true;
+
+	int fd = openat(p->dirfd, "dovecot-uidlist", O_RDONLY);
 	if (fd < 0) {
-		fprintf(stderr, "%s/%s: %s\n", p->folder, "subscriptions", strerror(errno));
-		return 0; /* best guess */
+		if (errno == ENOENT) {
+			uid_index_loaded(ul);
+			return ul; /* will be created */
+		}
+		fprintf(stderr, "%s/%s: %s\n", p->folder, "dovecot-uidlist", strerror(errno));
+		ul->broken = true;
+		return NULL;
 	}
 
 	FILE* fp = fdopen(fd, "r");
 	if (!fp) {
-		fprintf(stderr, "%s/%s: %s\n", p->folder, "subscriptions", strerror(errno));
-		return 0; /* best guess */
+		fprintf(stderr, "%s/%s: %s\n", p->folder, "dovecot-uidlist", strerror(errno));
+		close(fd);
+		ul->broken = true;
+		return NULL;
 	}
 
-	while (fgets(linebuf, sizeof(linebuf), fp)) {
-		char *nl = strchr(linebuf, '\n');
-		if (nl)
-			*nl = 0;
-		if (strcmp(fldrname + 1 /* skip leading . */, linebuf) == 0)
-			return 1;
+	if ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = 0;
+		version = strtoul(line, &e, 10);
+		if (version == 1) {
+			ul->uidvalidity = strtoul(e, &e, 10);
+			ul->next_uid = strtoul(e, &e, 10);
+		} else if (version == 3) {
+			while ((t = strsep(&e, " "))) {
+				if (*t == 'V')
+					ul->uidvalidity = strtoul(t + 1, NULL, 10);
+				else if (*t == 'N')
+					ul->next_uid = strtoul(t + 1, NULL, 10);
+				else if (*t && asprintf(&t, "%s%s%s", ul->header ? ul->header : "", ul->header ? " " : "", t) >= 0) {
+					free(ul->header);
+					ul->header = t;
+				}
+			}
+		}
 	}
 
-	return 0;
+	if (version != 1 && version != 3) {
+		fprintf(stderr, "%s/%s: unsupported format, not touching it.\n", p->folder, "dovecot-uidlist");
+		ul->broken = true;
+	} else {
+		while ((len = getline(&line, &size, fp)) > 0) {
+			if (line[len - 1] == '\n')
+				line[--len] = 0;
+			uid = strtoul(line, &e, 10);
+			if (!uid || *e != ' ')
+				continue;
+			if (version == 1) {
+				uid_index_append(ul, e + 1, line + len - (e + 1), uid, NULL, 0);
+			} else if ((t = strstr(e, " :"))) {
+				/* the extension fields are kept as is */
+				uid_index_append(ul, t + 2, line + len - (t + 2), uid,
+						e + 1, t > e ? t - (e + 1) : 0);
+			}
+		}
+		if (ferror(fp)) {
+			fprintf(stderr, "%s/%s: %s\n", p->folder, "dovecot-uidlist", strerror(errno));
+			ul->broken = true;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	uid_index_loaded(ul);
+
+	return ul->broken ? NULL : ul;
 }
 
 static
-void dovecot_imap_subscribe(void* _p, const char* fldrname)
+unsigned long dovecot_imap_uidvalidity(void* _p)
 {
-	struct dovecot_data *p = _p;
-	char tmpfname[1024];
-	struct stat st;
-	mode_t mode = 0644;
-	int tfd, stvalid = 0, r;
-	int sfd = openat(p->dirfd, "subscriptions", O_RDONLY, 0);
-	if (sfd < 0 && errno != ENOENT) {
-			/* ENOENT - no subscriptions, so no harm in creating */
-			fprintf(stderr, "%s/%s: %s\n", p->folder, "subscriptions", strerror(errno));
-			return;
-	}
+	struct uid_index *ul = uidlist_get(_p);
 
-	if ((sfd >= 0 && fstat(sfd, &st) == 0) || fstat(p->dirfd, &st) == 0) {
-		stvalid = 1;
-		mode = st.st_mode & 0666;
-	}
+	return ul ? ul->uidvalidity : 0;
+}
+
+static
+unsigned long dovecot_imap_get_uid(void* _p, const char* basename)
+{
+	struct uid_index *ul = uidlist_get(_p);
+	struct uid_entry *u;
+
+	if (!ul || !(u = uid_index_find(ul, basename)))
+		return 0;
+
+	return u->uid;
+}
 
-	do {
-		sprintf(tmpfname, "tmp/dovecot-subscriptions-%d", rand());
-	} while ((tfd = openat(p->dirfd, tmpfname, O_WRONLY | O_CREAT | O_EXCL, mode)) < 0 && errno == EEXIST);
+/* written out by dovecot_close() */
+static
+unsigned long dovecot_imap_add_uid(void* _p, const char* basename, unsigned long uid, unsigned long uidvalidity)
+{
+	struct uid_index *ul = uidlist_get(_p);
+
+	return ul ? uid_index_add(ul, basename, uid, uidvalidity) : 0;
+}
 
-	if (tfd < 0) {
-		fprintf(stderr, "%s/%s: %s\n", p->folder, tmpfname, strerror(errno));
-		if (sfd >= 0)
-			close(sfd);
+static
+void uidlist_save(struct dovecot_data* p)
+{
+	struct uid_index *ul = &p->uidlist;
+	struct meta_replace mr;
+	size_t i;
+
+	if (!ul->dirty || ul->broken)
 		return;
-	}
 
-	if (stvalid && geteuid() == 0)
-		fchown(tfd, st.st_uid, st.st_gid);
-
-	if (sfd >= 0) {
-		while ((r = sendfile(tfd, sfd, NULL, 16384)) > 0);
-		if (r < 0) {
-			fprintf(stderr, "%s/%s: %s\n", p->folder, tmpfname, strerror(errno));
-			close(sfd);
-			close(tfd);
-			unlinkat(p->dirfd, tmpfname, 0);
-			return;
-		}
-		close(sfd);
-	}
+	/* records must be in ascending UID order */
+	uid_index_finish(ul);
 
-	write(tfd, fldrname + 1 /* skip leading . */, strlen(fldrname));
-	write(tfd, "\n", 1);
-	close(tfd);
+	FILE* fp = meta_replace_open_lock(&mr, p->dirfd, p->folder, "dovecot-uidlist", "dovecot-uidlist.lock");
+	if (!fp)
+		return;
 
-	if (renameat(p->dirfd, tmpfname, p->dirfd, "subscriptions") < 0) {
-		fprintf(stderr, "%s => %s/subscriptions: %s\n", tmpfname, p->folder,
-				strerror(errno));
-		unlinkat(p->dirfd, tmpfname, 0);
-	}
+	fprintf(fp, "3 V%lu N%lu%s%s\n", ul->uidvalidity, ul->next_uid,
+			ul->header ? " " : "", ul->header ? ul->header : "");
+	for (i = 0; i < ul->count; ++i)
+		fprintf(fp, "%lu%s%s :%s\n", ul->entries[i]->uid, ul->entries[i]->ext ? " " : "",
+				ul->entries[i]->ext ? ul->entries[i]->ext : "", ul->entries[i]->basename);
+
+	if (meta_replace_commit(&mr) == 0)
+		ul->dirty = false;
 }
 
 static
 void dovecot_close(void* _p)
 {
-	free(_p);
+	struct dovecot_data *p = _p;
+
+	uidlist_save(p);
+	uid_index_free(&p->uidlist);
+	line_set_save(&p->subscribed, p->dirfd, p->folder, "subscriptions");
+	line_set_free(&p->subscribed);
+	free(p);
 }
 
 static
@@ -179,10 +262,13 @@ int dovecot_is_pop3(void*)
 static struct maildir_type maildir_courier = {
 	.label = "Dovecot",
 	.buglist = root_maildirfolder,
-	.detect = dovecot_detect,
+	.markers = dovecot_markers,
 	.metafiles = dovecot_metafiles,
 	.open = dovecot_open,
 	.is_pop3 = dovecot_is_pop3,
+	.imap_uidvalidity = dovecot_imap_uidvalidity,
+	.imap_get_uid = dovecot_imap_get_uid,
+	.imap_add_uid = dovecot_imap_add_uid,
 	.imap_is_subscribed = dovecot_imap_is_subscribed,
 	.imap_subscribe = dovecot_imap_subscribe,
 	.close = dovecot_close,
@@ -1,7 +1,18 @@
+#define _GNU_SOURCE
+
+#include "servertypes.h"
+#include "filetools.h"
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
 
-#include "servertypes.h"
+#define UID_INDEX_MAX_GAP	(1UL << 24) /* furthest a kept UID may lie beyond the last one */
 
 static struct maildir_type_list *type_list = NULL;
 
@@ -25,15 +36,79 @@ void register_maildir_type(const struct maildir_type* type)
 	maildir_type_list_prepend(&type_list, type);
 }
 
-struct maildir_type_list* maildir_find_type(const char* folder)
+static
+bool type_has_marker(const struct maildir_type* type, const char* name)
 {
-	const struct maildir_type_list* test = type_list;
+	for (const char * const* m = type->markers; m && *m; ++m)
+		if (strcmp(*m, name) == 0)
+			return true;
+	return false;
+}
+
+struct maildir_type_list* maildir_find_type_at(int dirfd, const char* folder)
+{
+	const struct maildir_type_list* test;
+	const struct maildir_type* found[32];
+	size_t nfound = 0, i;
 	struct maildir_type_list *result = NULL;
+	struct dirscan *dir;
+	struct dirscan_entry *de;
+
+	/* not dup(), that would share (and move) the offset of dirfd */
+	dir = dirscan_fdopen(openat(dirfd, ".", O_RDONLY | O_DIRECTORY));
+	if (!dir) {
+		perror(folder);
+		return NULL;
+	}
+
+	while ((de = dirscan_next(dir))) {
+		/* sub-folders, cur, new and tmp are never markers */
+		if (de->name[0] == '.' || de->namelen <= 3)
+			continue;
+
+		for (test = type_list; test; test = test->next) {
+			for (i = 0; i < nfound && found[i] != test->type; ++i)
+				;
+			if (i == nfound && nfound < sizeof(found) / sizeof(*found) &&
+					type_has_marker(test->type, de->name))
+				found[nfound++] = test->type;
+		}
+	}
+	if (errno)
+		perror(folder);
+	dirscan_close(dir);
+
+	for (test = type_list; test; test = test->next)
+		for (i = 0; i < nfound; ++i)
+			if (found[i] == test->type)
+				maildir_type_list_prepend(&result, test->type);
+
+	return result;
+}
 
-	while(test) {
-		if (test->type->detect(folder))
-			maildir_type_list_prepend(&result, test->type);
-		test = test->next;
+struct maildir_type_list* maildir_find_type(const char* folder)
+{
+	struct maildir_type_list *result;
+	int dirfd = open(folder, O_RDONLY | O_DIRECTORY);
+
+	if (dirfd < 0) {
+		perror(folder);
+		return NULL;
+	}
+
+	result = maildir_find_type_at(dirfd, folder);
+	close(dirfd);
+
+	return result;
+}
+
+struct maildir_type_list* maildir_type_list_inherit(const struct maildir_type_list* root)
+{
+	struct maildir_type_list *result = NULL, **tail = &result;
+
+	for (; root; root = root->next) {
+		maildir_type_list_prepend(tail, root->type);
+		tail = &(*tail)->next;
 	}
 
 	return result;
@@ -67,6 +142,356 @@ const char* const * maildir_get_all_metafiles()
 		return metafiles;
 }
 
+static
+FILE* meta_replace_create(struct meta_replace* mr, int dirfd, const char* folder, const char* fname,
+		const char* lockname)
+{
+	struct stat st;
+	mode_t mode = 0644;
+	bool stvalid = false;
+	int fd;
+
+	mr->dirfd = dirfd;
+	mr->folder = folder;
+	mr->fname = fname;
+	mr->fp = NULL;
+
+	if (fstatat(dirfd, fname, &st, 0) == 0 || fstat(dirfd, &st) == 0) {
+		stvalid = true;
+		mode = st.st_mode & 0666;
+	}
+
+	if (lockname) {
+		snprintf(mr->tmpname, sizeof(mr->tmpname), "%s", lockname);
+		fd = openat(dirfd, mr->tmpname, O_WRONLY | O_CREAT | O_EXCL, mode);
+	} else {
+		do {
+			snprintf(mr->tmpname, sizeof(mr->tmpname), "tmp/%s-%d.%d", fname, getpid(), rand());
+		} while ((fd = openat(dirfd, mr->tmpname, O_WRONLY | O_CREAT | O_EXCL, mode)) < 0 && errno == EEXIST);
+	}
+
+	if (fd < 0) {
+		fprintf(stderr, "%s/%s: %s\n", folder, mr->tmpname, strerror(errno));
+		return NULL;
+	}
+
+	if (stvalid && geteuid() == 0)
+		fchown(fd, st.st_uid, st.st_gid);
+
+	mr->fp = fdopen(fd, "w");
+	if (!mr->fp) {
+		fprintf(stderr, "%s/%s: %s\n", folder, mr->tmpname, strerror(errno));
+		close(fd);
+		unlinkat(dirfd, mr->tmpname, 0);
+	}
+
+	return mr->fp;
+}
+
+FILE* meta_replace_open(struct meta_replace* mr, int dirfd, const char* folder, const char* fname)
+{
+	return meta_replace_create(mr, dirfd, folder, fname, NULL);
+}
+
+FILE* meta_replace_open_lock(struct meta_replace* mr, int dirfd, const char* folder, const char* fname,
+		const char* lockname)
+{
+	return meta_replace_create(mr, dirfd, folder, fname, lockname);
+}
+
+int meta_replace_commit(struct meta_replace* mr)
+{
+	bool failed = ferror(mr->fp);
+
+	if (fclose(mr->fp) != 0)
+		failed = true;
+	mr->fp = NULL;
+
+	if (failed) {
+		fprintf(stderr, "%s/%s: %s\n", mr->folder, mr->tmpname, strerror(errno));
+	} else if (renameat(mr->dirfd, mr->tmpname, mr->dirfd, mr->fname) < 0) {
+		fprintf(stderr, "%s => %s/%s: %s\n", mr->tmpname, mr->folder, mr->fname,
+				strerror(errno));
+		failed = true;
+	}
+
+	if (failed) {
+		unlinkat(mr->dirfd, mr->tmpname, 0);
+		return -1;
+	}
+	return 0;
+}
+
+void meta_replace_abort(struct meta_replace* mr)
+{
+	if (mr->fp) {
+		fclose(mr->fp);
+		mr->fp = NULL;
+		unlinkat(mr->dirfd, mr->tmpname, 0);
+	}
+}
+
+static
+void line_set_append(struct line_set* ls, const char* line, size_t len)
+{
+	bool created;
+	struct strmap_entry *e = strmap_insert(&ls->map, line, len, &created);
+
+	if (!created)
+		return;
+
+	if (ls->count == ls->alloc) {
+		ls->alloc = ls->alloc ? ls->alloc * 2 : 64;
+		ls->lines = realloc(ls->lines, ls->alloc * sizeof(*ls->lines));
+		if (!ls->lines) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	ls->lines[ls->count++] = e->key;
+}
+
+int line_set_load(struct line_set* ls, int dirfd, const char* folder, const char* fname)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int r = 0;
+
+	int fd = openat(dirfd, fname, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "%s/%s: %s\n", folder, fname, strerror(errno));
+		return -1;
+	}
+
+	FILE* fp = fdopen(fd, "r");
+	if (!fp) {
+		fprintf(stderr, "%s/%s: %s\n", folder, fname, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	while ((len = getline(&line, &size, fp)) >= 0) {
+		char *t = realloc(ls->raw, ls->rawlen + len);
+		if (!t) {
+			perror("realloc");
+			exit(1);
+		}
+		ls->raw = t;
+		memcpy(ls->raw + ls->rawlen, line, len);
+		ls->rawlen += len;
+
+		if (len && line[len - 1] == '\n')
+			line[--len] = 0;
+		if (len)
+			line_set_append(ls, line, len);
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "%s/%s: %s\n", folder, fname, strerror(errno));
+		r = -1;
+	}
+	ls->loaded = ls->count;
+
+	free(line);
+	fclose(fp);
+	return r;
+}
+
+bool line_set_contains(const struct line_set* ls, const char* line)
+{
+	return strmap_find(&ls->map, line, strlen(line)) != NULL;
+}
+
+bool line_set_add(struct line_set* ls, const char* line)
+{
+	size_t count = ls->count;
+
+	line_set_append(ls, line, strlen(line));
+	if (ls->count == count)
+		return false;
+
+	ls->dirty = true;
+	return true;
+}
+
+int line_set_save(struct line_set* ls, int dirfd, const char* folder, const char* fname)
+{
+	struct meta_replace mr;
+
+	if (!ls->dirty)
+		return 0;
+
+	FILE* fp = meta_replace_open(&mr, dirfd, folder, fname);
+	if (!fp)
+		return -1;
+
+	fwrite(ls->raw, 1, ls->rawlen, fp);
+	if (ls->rawlen && ls->raw[ls->rawlen - 1] != '\n')
+		fputc('\n', fp);
+	for (size_t i = ls->loaded; i < ls->count; ++i)
+		fprintf(fp, "%s\n", ls->lines[i]);
+
+	if (meta_replace_commit(&mr) < 0)
+		return -1;
+
+	ls->dirty = false;
+	return 0;
+}
+
+void line_set_free(struct line_set* ls)
+{
+	strmap_free(&ls->map);
+	free(ls->lines);
+	free(ls->raw);
+	ls->lines = NULL;
+	ls->raw = NULL;
+	ls->count = ls->alloc = ls->loaded = ls->rawlen = 0;
+	ls->dirty = false;
+}
+
+static
+bool uid_index_used(const struct uid_index* ix, unsigned long uid)
+{
+	if (uid < ix->first_new)
+		return true; /* the UIDs clients have seen are never reused */
+	uid -= ix->first_new;
+	return uid / 8 < ix->usedsize && (ix->used[uid / 8] & (1 << (uid % 8)));
+}
+
+static
+void uid_index_mark(struct uid_index* ix, unsigned long uid)
+{
+	if (uid < ix->first_new)
+		return;
+	uid -= ix->first_new;
+	if (uid / 8 >= ix->usedsize) {
+		size_t n = ix->usedsize ? ix->usedsize : 1024;
+		while (uid / 8 >= n)
+			n *= 2;
+		ix->used = realloc(ix->used, n);
+		if (!ix->used) {
+			perror("realloc");
+			exit(1);
+		}
+		memset(ix->used + ix->usedsize, 0, n - ix->usedsize);
+		ix->usedsize = n;
+	}
+	ix->used[uid / 8] |= 1 << (uid % 8);
+}
+
+struct uid_entry* uid_index_append(struct uid_index* ix, const char* basename, size_t len,
+		unsigned long uid, const char* ext, size_t extlen)
+{
+	bool created;
+	struct strmap_entry *e = strmap_insert(&ix->map, basename, len, &created);
+	struct uid_entry *u;
+
+	if (!created)
+		return e->value; /* listed twice, the first one wins */
+
+	e->value = u = strmap_alloc(&ix->map, sizeof(*u));
+	u->uid = uid;
+	u->basename = e->key;
+	u->ext = NULL;
+	if (extlen) {
+		char *t = strmap_alloc(&ix->map, extlen + 1);
+		memcpy(t, ext, extlen);
+		t[extlen] = 0;
+		u->ext = t;
+	}
+
+	if (ix->count == ix->alloc) {
+		ix->alloc = ix->alloc ? ix->alloc * 2 : 1024;
+		ix->entries = realloc(ix->entries, ix->alloc * sizeof(*ix->entries));
+		if (!ix->entries) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	ix->entries[ix->count++] = u;
+
+	if (uid >= ix->next_uid)
+		ix->next_uid = uid + 1;
+
+	return u;
+}
+
+void uid_index_loaded(struct uid_index* ix)
+{
+	if (!ix->next_uid)
+		ix->next_uid = 1;
+	ix->loaded_count = ix->count;
+	ix->first_new = ix->next_uid;
+}
+
+struct uid_entry* uid_index_find(const struct uid_index* ix, const char* basename)
+{
+	struct strmap_entry *e = strmap_find(&ix->map, basename, strlen(basename));
+
+	return e ? e->value : NULL;
+}
+
+unsigned long uid_index_add(struct uid_index* ix, const char* basename, unsigned long uid, unsigned long uidvalidity)
+{
+	struct uid_entry *u = uid_index_find(ix, basename);
+
+	if (u)
+		return u->uid;
+
+	/* nobody can have cached anything for an empty folder, but a replacement
+	 * UIDVALIDITY must be greater than the one clients may have seen (RFC 3501
+	 * 2.3.1.1), else keep ours and allocate fresh UIDs */
+	if (!ix->count && uidvalidity && (!ix->uidvalidity || uidvalidity > ix->uidvalidity)) {
+		ix->uidvalidity = uidvalidity;
+		ix->next_uid = ix->first_new = 1;
+	}
+	if (!ix->uidvalidity)
+		ix->uidvalidity = time(NULL);
+
+	/* kept UIDs must still be new to clients of this folder, the others are
+	 * only allocated by uid_index_finish(), so that they can't take a UID yet
+	 * to be kept by a later message */
+	if (!uid || uidvalidity != ix->uidvalidity || uid_index_used(ix, uid) ||
+			uid - ix->first_new >= UID_INDEX_MAX_GAP)
+		uid = 0;
+	else
+		uid_index_mark(ix, uid);
+
+	uid_index_append(ix, basename, strlen(basename), uid, NULL, 0);
+	ix->dirty = true;
+
+	return uid;
+}
+
+static
+int uid_entry_compare(const void* a, const void* b)
+{
+	unsigned long ua = (*(struct uid_entry* const*)a)->uid, ub = (*(struct uid_entry* const*)b)->uid;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+void uid_index_finish(struct uid_index* ix)
+{
+	/* next_uid is above any UID in use */
+	for (size_t i = ix->loaded_count; i < ix->count; ++i)
+		if (!ix->entries[i]->uid)
+			ix->entries[i]->uid = ix->next_uid++;
+
+	qsort(ix->entries + ix->loaded_count, ix->count - ix->loaded_count, sizeof(*ix->entries), uid_entry_compare);
+}
+
+void uid_index_free(struct uid_index* ix)
+{
+	strmap_free(&ix->map);
+	free(ix->entries);
+	free(ix->used);
+	free(ix->header);
+	memset(ix, 0, sizeof(*ix));
+}
+
 static
 void __attribute__((destructor)) deinit()
 {
@@ -0,0 +1,141 @@
+#include "strmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRMAP_MIN_SIZE		64
+#define STRMAP_ARENA_BLOCK	(64 << 10)
+
+struct strmap_arena {
+	struct strmap_arena *next;
+	size_t used, size;
+	char data[];
+};
+
+unsigned long strmap_hash(const char* key, size_t keylen)
+{
+	/* FNV-1a, good enough for file names and cheap to compute */
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	while (keylen--) {
+		h ^= (unsigned char)*key++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+void* strmap_alloc(struct strmap* m, size_t size)
+{
+	struct strmap_arena *a = m->arena;
+
+	size = (size + 7) & ~(size_t)7;
+	if (!a || a->size - a->used < size) {
+		size_t bs = size > STRMAP_ARENA_BLOCK / 4 ? size : STRMAP_ARENA_BLOCK;
+		a = malloc(sizeof(*a) + bs);
+		if (!a) {
+			perror("malloc");
+			exit(1);
+		}
+		a->used = 0;
+		a->size = bs;
+		if (bs == STRMAP_ARENA_BLOCK || !m->arena) {
+			a->next = m->arena;
+			m->arena = a;
+		} else {
+			/* keep the current (partially used) block at the head */
+			a->next = m->arena->next;
+			m->arena->next = a;
+		}
+	}
+
+	void *r = a->data + a->used;
+	a->used += size;
+	return r;
+}
+
+static
+struct strmap_entry* strmap_slot(const struct strmap_entry* entries, size_t size,
+		const char* key, size_t keylen, unsigned long hash)
+{
+	size_t mask = size - 1, i = hash & mask;
+
+	while (entries[i].key) {
+		if (entries[i].hash == hash && entries[i].keylen == keylen && memcmp(entries[i].key, key, keylen) == 0)
+			break;
+		i = (i + 1) & mask;
+	}
+
+	return (struct strmap_entry*)&entries[i];
+}
+
+static
+void strmap_grow(struct strmap* m)
+{
+	size_t nsize = m->size ? m->size * 2 : STRMAP_MIN_SIZE, i;
+	struct strmap_entry *n = calloc(nsize, sizeof(*n));
+
+	if (!n) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < m->size; ++i) {
+		if (m->entries[i].key)
+			*strmap_slot(n, nsize, m->entries[i].key, m->entries[i].keylen, m->entries[i].hash) = m->entries[i];
+	}
+
+	free(m->entries);
+	m->entries = n;
+	m->size = nsize;
+}
+
+struct strmap_entry* strmap_find(const struct strmap* m, const char* key, size_t keylen)
+{
+	struct strmap_entry *e;
+
+	if (!m->count)
+		return NULL;
+
+	e = strmap_slot(m->entries, m->size, key, keylen, strmap_hash(key, keylen));
+	return e->key ? e : NULL;
+}
+
+struct strmap_entry* strmap_insert(struct strmap* m, const char* key, size_t keylen, bool* created)
+{
+	unsigned long hash = strmap_hash(key, keylen);
+	struct strmap_entry *e;
+
+	/* keep load factor below 3/4 */
+	if ((m->count + 1) * 4 > m->size * 3)
+		strmap_grow(m);
+
+	e = strmap_slot(m->entries, m->size, key, keylen, hash);
+	if (created)
+		*created = !e->key;
+	if (e->key)
+		return e;
+
+	char *k = strmap_alloc(m, keylen + 1);
+	memcpy(k, key, keylen);
+	k[keylen] = 0;
+
+	e->key = k;
+	e->keylen = keylen;
+	e->hash = hash;
+	e->value = NULL;
+	m->count++;
+
+	return e;
+}
+
+void strmap_free(struct strmap* m)
+{
+	while (m->arena) {
+		struct strmap_arena *t = m->arena->next;
+		free(m->arena);
+		m->arena = t;
+	}
+	free(m->entries);
+	m->entries = NULL;
+	m->size = m->count = 0;
+}
@@ -0,0 +1,195 @@
+#include "workqueue.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct workqueue_slot {
+	void *item;
+	bool complete;
+};
+
+struct workqueue {
+	workqueue_fn work;
+	workqueue_fn done;
+	void *ctx;
+
+	unsigned jobs;
+	pthread_t *threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond_work; /* workers wait on this for new items */
+	pthread_cond_t cond_done; /* pusher waits on this for completions */
+
+	/* ring buffer, all counters increase monotonically and are taken modulo size:
+	 * head - oldest item not yet passed to done()
+	 * next - next item to be handed to a worker
+	 * tail - next free slot */
+	struct workqueue_slot *slots;
+	size_t size, head, next, tail;
+	bool closing;
+};
+
+static
+void* workqueue_worker(void* _wq)
+{
+	struct workqueue *wq = _wq;
+	size_t idx;
+
+	pthread_mutex_lock(&wq->lock);
+	while (true) {
+		while (wq->next == wq->tail && !wq->closing)
+			pthread_cond_wait(&wq->cond_work, &wq->lock);
+		if (wq->next == wq->tail)
+			break;
+
+		idx = wq->next++ % wq->size;
+		pthread_mutex_unlock(&wq->lock);
+
+		wq->work(wq->slots[idx].item, wq->ctx);
+
+		pthread_mutex_lock(&wq->lock);
+		wq->slots[idx].complete = true;
+		if (idx == wq->head % wq->size)
+			pthread_cond_signal(&wq->cond_done);
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	return NULL;
+}
+
+/* must be called with the lock held, may temporarily release it */
+static
+void workqueue_deliver(struct workqueue* wq)
+{
+	while (wq->head != wq->tail && wq->slots[wq->head % wq->size].complete) {
+		struct workqueue_slot *s = &wq->slots[wq->head % wq->size];
+		void *item = s->item;
+
+		s->complete = false;
+		s->item = NULL;
+
+		/* we are the only thread that advances head, so it's safe to call
+		 * done() without the lock, and only then release the slot */
+		pthread_mutex_unlock(&wq->lock);
+		wq->done(item, wq->ctx);
+		pthread_mutex_lock(&wq->lock);
+
+		wq->head++;
+	}
+}
+
+struct workqueue* workqueue_create(unsigned jobs, size_t max_pending,
+		workqueue_fn work, workqueue_fn done, void* ctx)
+{
+	struct workqueue *wq = calloc(1, sizeof(*wq));
+	unsigned i;
+
+	if (!wq) {
+		perror("calloc");
+		exit(1);
+	}
+
+	wq->work = work;
+	wq->done = done;
+	wq->ctx = ctx;
+	wq->jobs = jobs;
+
+	if (jobs <= 1)
+		return wq;
+
+	wq->size = max_pending ?: jobs * 4;
+	wq->slots = calloc(wq->size, sizeof(*wq->slots));
+	wq->threads = calloc(jobs, sizeof(*wq->threads));
+	if (!wq->slots || !wq->threads) {
+		perror("calloc");
+		exit(1);
+	}
+
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond_work, NULL);
+	pthread_cond_init(&wq->cond_done, NULL);
+
+	for (i = 0; i < jobs; ++i) {
+		int r = pthread_create(&wq->threads[i], NULL, workqueue_worker, wq);
+		if (r) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(r));
+			exit(1);
+		}
+	}
+
+	return wq;
+}
+
+void workqueue_push(struct workqueue* wq, void* item)
+{
+	if (wq->jobs <= 1) {
+		wq->work(item, wq->ctx);
+		wq->done(item, wq->ctx);
+		return;
+	}
+
+	pthread_mutex_lock(&wq->lock);
+	while (true) {
+		workqueue_deliver(wq);
+		if (wq->tail - wq->head < wq->size)
+			break;
+		pthread_cond_wait(&wq->cond_done, &wq->lock);
+	}
+
+	wq->slots[wq->tail % wq->size].item = item;
+	wq->slots[wq->tail % wq->size].complete = false;
+	wq->tail++;
+	pthread_cond_signal(&wq->cond_work);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void workqueue_finish(struct workqueue* wq)
+{
+	unsigned i;
+
+	if (wq->jobs > 1) {
+		pthread_mutex_lock(&wq->lock);
+		wq->closing = true;
+		pthread_cond_broadcast(&wq->cond_work);
+		while (true) {
+			workqueue_deliver(wq);
+			if (wq->head == wq->tail)
+				break;
+			pthread_cond_wait(&wq->cond_done, &wq->lock);
+		}
+		pthread_mutex_unlock(&wq->lock);
+
+		for (i = 0; i < wq->jobs; ++i)
+			pthread_join(wq->threads[i], NULL);
+
+		pthread_cond_destroy(&wq->cond_done);
+		pthread_cond_destroy(&wq->cond_work);
+		pthread_mutex_destroy(&wq->lock);
+		free(wq->threads);
+		free(wq->slots);
+	}
+
+	free(wq);
+}
+
+unsigned workqueue_parse_jobs(const char* arg)
+{
+	char *endp;
+	unsigned long j = strtoul(arg, &endp, 10);
+
+	if (!*arg || *endp || j > 1024) {
+		fprintf(stderr, "Invalid number of jobs: %s.\n", arg);
+		exit(1);
+	}
+
+	if (j == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		j = n > 0 ? n : 1;
+	}
+
+	return j;
+}